@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM
+#endif
+
+// Castagnoli polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78
+
+// The CRC instructions take a few cycles to complete but can start
+// one per cycle, so the hardware kernels checksum three lanes of
+// CRC32C_LANE bytes at once and merge them afterwards (3 lanes make
+// 4080 bytes, so a block takes a single pass).
+#define CRC32C_LANE 1360
+
+// all the kernels work on the raw CRC register: crc32c()
+// takes care of the inversions before and after.
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static crc32c_fn crc32c_kernel;
+static const char *crc32c_name;
+
+// slicing-by-8 tables: sw_table[k][b] is the CRC of byte b
+// followed by k zero bytes
+static uint32_t sw_table[8][256];
+
+// shift_table[i][k][b] multiplies by x^(8 * CRC32C_LANE * (i + 1)) the
+// register holding byte b in its k-th byte, i.e. moves a lane's CRC
+// over the (i + 1) lanes that follow it
+static uint32_t shift_table[2][4][256];
+
+// reads 8 bytes at @p as a little endian value, whatever its alignment
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+static uint32_t sw_kernel(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word = read64(p) ^ crc;
+        crc = sw_table[7][word & 0xff] ^ sw_table[6][(word >> 8) & 0xff]
+              ^ sw_table[5][(word >> 16) & 0xff]
+              ^ sw_table[4][(word >> 24) & 0xff]
+              ^ sw_table[3][(word >> 32) & 0xff]
+              ^ sw_table[2][(word >> 40) & 0xff]
+              ^ sw_table[1][(word >> 48) & 0xff]
+              ^ sw_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// a * b modulo the polynomial, both bit-reflected (x^0 is the top bit)
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m; m >>= 1) {
+        if (a & m) {
+            p ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * @n) modulo the polynomial: the factor that moves
+// a CRC register over @n zero bytes
+static uint32_t x8nmodp(uint64_t n)
+{
+    uint32_t result = 1u << 31; // x^0
+    uint32_t square = 1u << 23; // x^8
+    for (; n; n >>= 1) {
+        if (n & 1) {
+            result = multmodp(square, result);
+        }
+        square = multmodp(square, square);
+    }
+    return result;
+}
+
+// merges the CRCs of three consecutive lanes, @crc0 covering
+// whatever came before the first lane as well
+static uint32_t lanes_merge(uint32_t crc0, uint32_t crc1, uint32_t crc2)
+{
+    uint32_t crc = crc2;
+    for (int k = 0; k < 4; ++k) {
+        crc ^= shift_table[1][k][(crc0 >> (8 * k)) & 0xff]
+               ^ shift_table[0][k][(crc1 >> (8 * k)) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t sse42_kernel(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc0 = crc;
+
+    while (len >= 3 * CRC32C_LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, p + i, 8);
+            memcpy(&word1, p + CRC32C_LANE + i, 8);
+            memcpy(&word2, p + 2 * CRC32C_LANE + i, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        crc0 = lanes_merge(crc0, crc1, crc2);
+        p += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+    while (len--) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    return crc0;
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t armv8_kernel(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint32_t crc0 = crc;
+
+    while (len >= 3 * CRC32C_LANE) {
+        uint32_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, p + i, 8);
+            memcpy(&word1, p + CRC32C_LANE + i, 8);
+            memcpy(&word2, p + 2 * CRC32C_LANE + i, 8);
+            crc0 = __crc32cd(crc0, word0);
+            crc1 = __crc32cd(crc1, word1);
+            crc2 = __crc32cd(crc2, word2);
+        }
+        crc0 = lanes_merge(crc0, crc1, crc2);
+        p += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = __crc32cd(crc0, word);
+    }
+    while (len--) {
+        crc0 = __crc32cb(crc0, *p++);
+    }
+    return crc0;
+}
+#endif
+
+// builds the tables and picks the kernel, once
+static void crc32c_init(void)
+{
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        sw_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+            uint32_t prev = sw_table[k - 1][b];
+            sw_table[k][b] = (prev >> 8) ^ sw_table[0][prev & 0xff];
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        uint32_t factor = x8nmodp((uint64_t)CRC32C_LANE * (i + 1));
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t b = 0; b < 256; ++b) {
+                shift_table[i][k][b] = multmodp(factor, b << (8 * k));
+            }
+        }
+    }
+
+    crc32c_name = "portable";
+    crc32c_kernel = sw_kernel;
+#if defined(CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_name = "sse4.2";
+        crc32c_kernel = sse42_kernel;
+    }
+#elif defined(CRC32C_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c_name = "armv8";
+        crc32c_kernel = armv8_kernel;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (!crc32c_kernel) {
+        crc32c_init();
+    }
+    return ~crc32c_kernel(~crc, buf, len);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len)
+{
+    if (!crc32c_kernel) {
+        crc32c_init();
+    }
+    return ~sw_kernel(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+    if (!crc32c_kernel) {
+        crc32c_init();
+    }
+    return crc32c_name;
+}
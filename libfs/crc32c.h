@@ -0,0 +1,40 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the data preceding @buf, or 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Size of @buf in bytes
+ *
+ * Uses the CRC instructions of the processor when it has them (SSE4.2 on
+ * x86-64, the CRC extension on ARMv8), and a table-driven implementation
+ * otherwise. The choice is made on the first call.
+ *
+ * Return: the checksum of the data preceding @buf followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_portable - Compute a CRC32C checksum without CRC instructions
+ * @crc: Checksum of the data preceding @buf, or 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Size of @buf in bytes
+ *
+ * Same as crc32c(), but always uses the table-driven implementation.
+ *
+ * Return: the checksum of the data preceding @buf followed by @buf.
+ */
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_impl - Name the implementation crc32c() uses
+ *
+ * Return: "sse4.2", "armv8" or "portable".
+ */
+const char *crc32c_impl(void);
+
+#endif /* _CRC32C_H */
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE /* O_DIRECT */
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,20 +18,131 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Free single-block buffers the pool keeps, at most */
+#define BUF_POOL_MAX 64
+
+/* Size of the bounce buffers of direct I/O, in blocks */
+#define BOUNCE_BLOCKS 16
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Opened with O_DIRECT */
+	int direct;
 };
 
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
-int block_disk_open(const char *diskname)
+/* Pool of free single-block buffers */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool[BUF_POOL_MAX];
+static size_t pool_count;
+
+/* Transfer @len bytes between @buf and the disk at @offset */
+static int disk_io(int writing, void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	/*
+	 * Positioned transfers don't move the file offset, so that ranges can
+	 * be transferred from several threads at once. Large ones can come
+	 * back short, finish them.
+	 */
+	while (done < len) {
+		if (writing)
+			ret = pwrite(disk.fd, (char *)buf + done, len - done,
+				     offset + done);
+		else
+			ret = pread(disk.fd, (char *)buf + done, len - done,
+				    offset + done);
+		if (ret < 0) {
+			perror(writing ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Transfer @count blocks, through aligned buffers if direct I/O needs it */
+static int disk_blocks_io(int writing, void *buf, size_t block, size_t count)
+{
+	size_t chunk, i, n;
+	char *bounce;
+
+	if (!disk.direct || (uintptr_t)buf % BLOCK_SIZE == 0)
+		return disk_io(writing, buf, count * BLOCK_SIZE,
+			       (off_t)block * BLOCK_SIZE);
+
+	chunk = count < BOUNCE_BLOCKS ? count : BOUNCE_BLOCKS;
+	bounce = block_buf_get(chunk);
+	if (!bounce) {
+		block_error("cannot allocate bounce buffer");
+		return -1;
+	}
+	for (i = 0; i < count; i += n) {
+		char *data = (char *)buf + i * BLOCK_SIZE;
+
+		n = count - i < chunk ? count - i : chunk;
+		if (writing)
+			memcpy(bounce, data, n * BLOCK_SIZE);
+		if (disk_io(writing, bounce, n * BLOCK_SIZE,
+			    (off_t)(block + i) * BLOCK_SIZE)) {
+			block_buf_put(bounce, chunk);
+			return -1;
+		}
+		if (!writing)
+			memcpy(data, bounce, n * BLOCK_SIZE);
+	}
+	block_buf_put(bounce, chunk);
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
 {
 	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Sparse file, unwritten blocks read as zeros */
+	if (ftruncate(fd, (off_t)bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	int fd, oflags;
 	struct stat st;
 
 	if (!diskname) {
@@ -39,7 +155,11 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	oflags = flags & BLOCK_DISK_READONLY ? O_RDONLY : O_RDWR;
+	if (flags & BLOCK_DISK_DIRECT)
+		oflags |= O_DIRECT;
+
+	if ((fd = open(diskname, oflags, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
@@ -58,6 +178,7 @@ int block_disk_open(const char *diskname)
 
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.direct = !!(flags & BLOCK_DISK_DIRECT);
 
 	return 0;
 }
@@ -99,46 +220,147 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* Perform the actual write into the disk image */
+	return disk_blocks_io(1, (void *)buf, block, 1);
+}
+
+int block_read(size_t block, void *buf)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
 		return -1;
 	}
 
-	return 0;
+	/* Perform the actual read from the disk image */
+	return disk_blocks_io(0, buf, block, 1);
 }
 
-int block_read(size_t block, void *buf)
+
+int block_write_range(size_t block, size_t count, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return disk_blocks_io(1, (void *)buf, block, count);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return -1;
+	}
+
+	return disk_blocks_io(0, buf, block, count);
+}
+
+int block_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (fdatasync(disk.fd) < 0) {
+		perror("fdatasync");
 		return -1;
 	}
 
 	return 0;
 }
 
+void *block_map(size_t block, size_t count)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	off_t start, base;
+	char *addr;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (count == 0 || block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return NULL;
+	}
+
+	/* Mappings start on a page, which may hold several blocks */
+	start = (off_t)block * BLOCK_SIZE;
+	base = start - start % page;
+	addr = mmap(NULL, start - base + count * BLOCK_SIZE, PROT_READ,
+		    MAP_SHARED, disk.fd, base);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return addr + (start - base);
+}
+
+int block_unmap(void *addr, size_t count)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t skip = (size_t)addr % page;
+
+	if (munmap((char *)addr - skip, skip + count * BLOCK_SIZE)) {
+		perror("munmap");
+		return -1;
+	}
+
+	return 0;
+}
+
+void *block_buf_get(size_t count)
+{
+	void *buf = NULL;
+
+	if (count == 1) {
+		pthread_mutex_lock(&pool_lock);
+		if (pool_count > 0)
+			buf = pool[--pool_count];
+		pthread_mutex_unlock(&pool_lock);
+		if (buf)
+			return buf;
+	}
+
+	if (posix_memalign(&buf, BLOCK_SIZE, (count ? count : 1) * BLOCK_SIZE))
+		return NULL;
+
+	return buf;
+}
+
+void block_buf_put(void *buf, size_t count)
+{
+	if (buf && count == 1) {
+		pthread_mutex_lock(&pool_lock);
+		if (pool_count < BUF_POOL_MAX) {
+			pool[pool_count++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	free(buf);
+}
@@ -6,6 +6,20 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ *
+ * Create virtual disk file @diskname, large enough to hold @bcount blocks. All
+ * the blocks initially read as zeros. An existing file named @diskname is
+ * overwritten. The virtual disk file is not opened.
+ *
+ * Return: -1 if @diskname is invalid, or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +33,30 @@
  */
 int block_disk_open(const char *diskname);
 
+/** block_disk_open_flags() flag: bypass the host's page cache (O_DIRECT) */
+#define BLOCK_DISK_DIRECT 0x1
+
+/** block_disk_open_flags() flag: open the virtual disk file read-only */
+#define BLOCK_DISK_READONLY 0x2
+
+/**
+ * block_disk_open_flags - Open virtual disk file with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: Open flags
+ *
+ * Same as block_disk_open(). With %BLOCK_DISK_DIRECT in @flags, the blocks
+ * are transferred between the virtual disk file and the buffers directly,
+ * without going through the host's page cache. The buffers then need to be
+ * aligned on %BLOCK_SIZE bytes, like those block_buf_get() hands out: other
+ * buffers are bounced through aligned ones, at the cost of a copy. With
+ * %BLOCK_DISK_READONLY, block_write() and block_write_range() fail.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * (including when its file system doesn't support direct I/O) or is already
+ * open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +98,91 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, as a single I/O operation.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, as a single I/O operation.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/**
+ * block_sync - Make the writes durable
+ *
+ * Wait until all the blocks written so far to the virtual disk have reached
+ * stable storage. The range functions can be called from several threads at
+ * once, and don't wait for that.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the
+ * synchronization fails. 0 otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_map - Map consecutive blocks in memory
+ * @block: Index of the first block to map
+ * @count: Number of blocks to map
+ *
+ * Map the virtual disk's blocks @block to @block + @count - 1 read-only in
+ * memory. The mapping shares the virtual disk file's pages: it reflects the
+ * blocks written afterwards, and stays valid after the virtual disk file is
+ * closed, until it is unmapped with block_unmap().
+ *
+ * Return: NULL if any of the blocks is out of bounds, or if the mapping fails.
+ * Otherwise the address of the content of block @block.
+ */
+void *block_map(size_t block, size_t count);
+
+/**
+ * block_unmap - Unmap blocks mapped in memory
+ * @addr: Address returned by block_map()
+ * @count: Number of blocks given to block_map()
+ *
+ * Return: -1 if the unmapping fails. 0 otherwise.
+ */
+int block_unmap(void *addr, size_t count);
+
+/**
+ * block_buf_get - Get a block buffer
+ * @count: Number of blocks the buffer holds
+ *
+ * Single-block buffers come from a pool, which keeps a bounded number of them
+ * around once they are given back, so that a steady workload doesn't allocate
+ * any. Bigger ones are allocated. Either way, the buffer is aligned on
+ * %BLOCK_SIZE bytes, as direct I/O requires. The pool can be used from several
+ * threads at once.
+ *
+ * Return: NULL if there is not enough memory. Otherwise a buffer of @count *
+ * %BLOCK_SIZE bytes, to give back with block_buf_put().
+ */
+void *block_buf_get(size_t count);
+
+/**
+ * block_buf_put - Give a block buffer back
+ * @buf: Buffer returned by block_buf_get(), or NULL
+ * @count: Number of blocks given to block_buf_get()
+ */
+void block_buf_put(void *buf, size_t count);
+
 #endif /* _DISK_H */
 
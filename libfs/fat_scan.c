@@ -0,0 +1,468 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fat_scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FAT_SCAN_X86
+#endif
+
+/* SCALAR KERNELS */
+
+static size_t scalar_count_nonzero16(const uint16_t *entries, size_t count)
+{
+    size_t nonzero = 0;
+    for (size_t i = 0; i < count; ++i) {
+        nonzero += entries[i] != 0;
+    }
+    return nonzero;
+}
+
+static size_t scalar_count_nonzero32(const uint32_t *entries, size_t count)
+{
+    size_t nonzero = 0;
+    for (size_t i = 0; i < count; ++i) {
+        nonzero += entries[i] != 0;
+    }
+    return nonzero;
+}
+
+static size_t scalar_find_zero16(const uint16_t *entries, size_t count)
+{
+    size_t i = 0;
+    while (i < count && entries[i] != 0) {
+        ++i;
+    }
+    return i;
+}
+
+static size_t scalar_find_zero32(const uint32_t *entries, size_t count)
+{
+    size_t i = 0;
+    while (i < count && entries[i] != 0) {
+        ++i;
+    }
+    return i;
+}
+
+static size_t scalar_find_zero_run16(const uint16_t *entries, size_t count,
+                                     size_t run)
+{
+    size_t zeros = 0;
+    if (run == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        zeros = entries[i] == 0 ? zeros + 1 : 0;
+        if (zeros == run) {
+            return i + 1 - run;
+        }
+    }
+    return count;
+}
+
+static size_t scalar_find_zero_run32(const uint32_t *entries, size_t count,
+                                     size_t run)
+{
+    size_t zeros = 0;
+    if (run == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        zeros = entries[i] == 0 ? zeros + 1 : 0;
+        if (zeros == run) {
+            return i + 1 - run;
+        }
+    }
+    return count;
+}
+
+static const struct fat_scan_ops scalar_ops = {
+    "scalar",
+    scalar_count_nonzero16, scalar_count_nonzero32,
+    scalar_find_zero16, scalar_find_zero32,
+    scalar_find_zero_run16, scalar_find_zero_run32,
+};
+
+#ifdef FAT_SCAN_X86
+
+/* ZERO-RUN SEARCH */
+
+// The vector kernels turn each group of @lanes entries into a mask
+// with a bit set for every zero entry, and feed it to run_step().
+// Most masks are all zeros (allocated region) or all ones (free
+// region), which take a single test.
+struct run_search {
+    size_t need;  // length of the run we are looking for
+    size_t zeros; // zero entries in a row right before the group
+    size_t start; // where the run begins, once found
+};
+
+// Return: true once the run is found.
+static inline bool run_step(struct run_search *search, uint64_t mask,
+                            unsigned lanes, size_t base)
+{
+    uint64_t full = lanes == 64 ? ~(uint64_t)0 : ((uint64_t)1 << lanes) - 1;
+
+    if (mask == 0) {
+        search->zeros = 0;
+        return false;
+    }
+    if (mask == full) {
+        search->zeros += lanes;
+        if (search->zeros >= search->need) {
+            search->start = base + lanes - search->zeros;
+            return true;
+        }
+        return false;
+    }
+
+    // zeros at the start of the group extend the current run
+    unsigned pos = __builtin_ctzll(~mask);
+    if (search->zeros + pos >= search->need) {
+        search->start = base - search->zeros;
+        return true;
+    }
+
+    // then every run within the group, the last one possibly
+    // going on in the next group (bits past @lanes are 0 in
+    // @mask, which stops the counts there)
+    search->zeros = 0;
+    while (pos < lanes && (mask >> pos) != 0) {
+        pos += __builtin_ctzll(mask >> pos);
+        unsigned len = __builtin_ctzll(~(mask >> pos));
+        if (len >= search->need) {
+            search->start = base + pos;
+            return true;
+        }
+        if (pos + len == lanes) {
+            search->zeros = len;
+        }
+        pos += len;
+    }
+    return false;
+}
+
+// scalar end of the zero-run search, for the entries left over
+// after the last whole group
+#define RUN_TAIL(search, entries, i, count)                       \
+do {                                                              \
+    while (i < count) {                                           \
+        unsigned lanes = count - i < 64 ? count - i : 64;         \
+        uint64_t mask = 0;                                        \
+        for (unsigned k = 0; k < lanes; ++k) {                    \
+            mask |= (uint64_t)(entries[i + k] == 0) << k;         \
+        }                                                         \
+        if (run_step(&search, mask, lanes, i)) {                  \
+            return search.start;                                  \
+        }                                                         \
+        i += lanes;                                               \
+    }                                                             \
+} while (0)
+
+/* SSE2 KERNELS */
+
+static size_t sse2_count_nonzero16(const uint16_t *entries, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t zeros = 0, i = 0;
+
+    // each lane of acc counts the zeros it saw, on 16 bits,
+    // so acc is emptied before it can overflow
+    while (count - i >= 8) {
+        __m128i acc = zero;
+        for (int n = 0; n < 4096 && count - i >= 8; ++n, i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+            acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(v, zero));
+        }
+        uint32_t sums[4];
+        acc = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+        _mm_storeu_si128((__m128i *)sums, acc);
+        zeros += (size_t)sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    return count - zeros - (count - i)
+           + scalar_count_nonzero16(entries + i, count - i);
+}
+
+static size_t sse2_count_nonzero32(const uint32_t *entries, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t zeros = 0, i = 0;
+
+    while (count - i >= 4) {
+        __m128i acc = zero;
+        for (int n = 0; n < (1 << 20) && count - i >= 4; ++n, i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+            acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(v, zero));
+        }
+        uint32_t sums[4];
+        _mm_storeu_si128((__m128i *)sums, acc);
+        zeros += (size_t)sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    return count - zeros - (count - i)
+           + scalar_count_nonzero32(entries + i, count - i);
+}
+
+static size_t sse2_find_zero16(const uint16_t *entries, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; count - i >= 8; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+    return i + scalar_find_zero16(entries + i, count - i);
+}
+
+static size_t sse2_find_zero32(const uint32_t *entries, size_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; count - i >= 4; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask) / 4;
+        }
+    }
+    return i + scalar_find_zero32(entries + i, count - i);
+}
+
+static size_t sse2_find_zero_run16(const uint16_t *entries, size_t count,
+                                   size_t run)
+{
+    const __m128i zero = _mm_setzero_si128();
+    struct run_search search = { run, 0, 0 };
+    size_t i = 0;
+
+    if (run == 0) {
+        return 0;
+    }
+    // 16 entries per group, packed to one byte each
+    for (; count - i >= 16; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(entries + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(entries + i + 8));
+        __m128i zeros = _mm_packs_epi16(_mm_cmpeq_epi16(lo, zero),
+                                        _mm_cmpeq_epi16(hi, zero));
+        uint64_t mask = (uint32_t)_mm_movemask_epi8(zeros);
+        if (run_step(&search, mask, 16, i)) {
+            return search.start;
+        }
+    }
+    RUN_TAIL(search, entries, i, count);
+    return count;
+}
+
+static size_t sse2_find_zero_run32(const uint32_t *entries, size_t count,
+                                   size_t run)
+{
+    const __m128i zero = _mm_setzero_si128();
+    struct run_search search = { run, 0, 0 };
+    size_t i = 0;
+
+    if (run == 0) {
+        return 0;
+    }
+    // 16 entries per group, 4 bits per vector
+    for (; count - i >= 16; i += 16) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; ++k) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(entries + i
+                                                          + 4 * k));
+            __m128 zeros = _mm_castsi128_ps(_mm_cmpeq_epi32(v, zero));
+            mask |= (uint64_t)_mm_movemask_ps(zeros) << (4 * k);
+        }
+        if (run_step(&search, mask, 16, i)) {
+            return search.start;
+        }
+    }
+    RUN_TAIL(search, entries, i, count);
+    return count;
+}
+
+static const struct fat_scan_ops sse2_ops = {
+    "sse2",
+    sse2_count_nonzero16, sse2_count_nonzero32,
+    sse2_find_zero16, sse2_find_zero32,
+    sse2_find_zero_run16, sse2_find_zero_run32,
+};
+
+/* AVX2 KERNELS */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static size_t avx2_count_nonzero16(const uint16_t *entries,
+                                        size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t zeros = 0, i = 0;
+
+    while (count - i >= 16) {
+        __m256i acc = zero;
+        for (int n = 0; n < 4096 && count - i >= 16; ++n, i += 16) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+            acc = _mm256_sub_epi16(acc, _mm256_cmpeq_epi16(v, zero));
+        }
+        uint32_t sums[8];
+        acc = _mm256_madd_epi16(acc, _mm256_set1_epi16(1));
+        _mm256_storeu_si256((__m256i *)sums, acc);
+        for (int k = 0; k < 8; ++k) {
+            zeros += sums[k];
+        }
+    }
+    return count - zeros - (count - i)
+           + scalar_count_nonzero16(entries + i, count - i);
+}
+
+AVX2 static size_t avx2_count_nonzero32(const uint32_t *entries,
+                                        size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t zeros = 0, i = 0;
+
+    while (count - i >= 8) {
+        __m256i acc = zero;
+        for (int n = 0; n < (1 << 20) && count - i >= 8; ++n, i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+            acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(v, zero));
+        }
+        uint32_t sums[8];
+        _mm256_storeu_si256((__m256i *)sums, acc);
+        for (int k = 0; k < 8; ++k) {
+            zeros += sums[k];
+        }
+    }
+    return count - zeros - (count - i)
+           + scalar_count_nonzero32(entries + i, count - i);
+}
+
+AVX2 static size_t avx2_find_zero16(const uint16_t *entries, size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; count - i >= 16; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+    return i + scalar_find_zero16(entries + i, count - i);
+}
+
+AVX2 static size_t avx2_find_zero32(const uint32_t *entries, size_t count)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; count - i >= 8; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask) / 4;
+        }
+    }
+    return i + scalar_find_zero32(entries + i, count - i);
+}
+
+AVX2 static size_t avx2_find_zero_run16(const uint16_t *entries,
+                                        size_t count, size_t run)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    struct run_search search = { run, 0, 0 };
+    size_t i = 0;
+
+    if (run == 0) {
+        return 0;
+    }
+    // 32 entries per group, packed to one byte each (packs works
+    // within 128-bit halves, hence the permute to restore the order)
+    for (; count - i >= 32; i += 32) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(entries + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(entries + i
+                                                          + 16));
+        __m256i zeros = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, zero),
+                                           _mm256_cmpeq_epi16(hi, zero));
+        zeros = _mm256_permute4x64_epi64(zeros, 0xd8);
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(zeros);
+        if (run_step(&search, mask, 32, i)) {
+            return search.start;
+        }
+    }
+    RUN_TAIL(search, entries, i, count);
+    return count;
+}
+
+AVX2 static size_t avx2_find_zero_run32(const uint32_t *entries,
+                                        size_t count, size_t run)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    struct run_search search = { run, 0, 0 };
+    size_t i = 0;
+
+    if (run == 0) {
+        return 0;
+    }
+    // 32 entries per group, 8 bits per vector
+    for (; count - i >= 32; i += 32) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; ++k) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i
+                                                             + 8 * k));
+            __m256 zeros = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero));
+            mask |= (uint64_t)_mm256_movemask_ps(zeros) << (8 * k);
+        }
+        if (run_step(&search, mask, 32, i)) {
+            return search.start;
+        }
+    }
+    RUN_TAIL(search, entries, i, count);
+    return count;
+}
+
+static const struct fat_scan_ops avx2_ops = {
+    "avx2",
+    avx2_count_nonzero16, avx2_count_nonzero32,
+    avx2_find_zero16, avx2_find_zero32,
+    avx2_find_zero_run16, avx2_find_zero_run32,
+};
+
+#endif /* FAT_SCAN_X86 */
+
+const struct fat_scan_ops *fat_scan_impl(const char *name)
+{
+    if (!strcmp(name, "scalar")) {
+        return &scalar_ops;
+    }
+#ifdef FAT_SCAN_X86
+    // SSE2 is part of x86-64
+    if (!strcmp(name, "sse2")) {
+        return &sse2_ops;
+    }
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        return &avx2_ops;
+    }
+#endif
+    return NULL;
+}
+
+const struct fat_scan_ops *fat_scan(void)
+{
+    static const struct fat_scan_ops *best;
+
+    if (!best) {
+        const char *names[] = { "avx2", "sse2", "scalar" };
+        for (size_t i = 0; !best; ++i) {
+            best = fat_scan_impl(names[i]);
+        }
+    }
+    return best;
+}
@@ -0,0 +1,53 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct fat_scan_ops - FAT scanning kernels
+ * @name: Name of the implementation ("scalar", "sse2" or "avx2")
+ * @count_nonzero16: Number of non-zero entries among @count 16-bit entries
+ * @count_nonzero32: Same, over 32-bit entries
+ * @find_zero16: Index of the first zero entry among @count 16-bit entries, or
+ *	@count if there is none
+ * @find_zero32: Same, over 32-bit entries
+ * @find_zero_run16: Index of the first of @run consecutive zero entries among
+ *	@count 16-bit entries, or @count if there are no such entries
+ * @find_zero_run32: Same, over 32-bit entries
+ *
+ * The entries are FAT entries as stored on disk, in memory that doesn't need
+ * any particular alignment.
+ */
+struct fat_scan_ops {
+    const char *name;
+    size_t (*count_nonzero16)(const uint16_t *entries, size_t count);
+    size_t (*count_nonzero32)(const uint32_t *entries, size_t count);
+    size_t (*find_zero16)(const uint16_t *entries, size_t count);
+    size_t (*find_zero32)(const uint32_t *entries, size_t count);
+    size_t (*find_zero_run16)(const uint16_t *entries, size_t count,
+                              size_t run);
+    size_t (*find_zero_run32)(const uint32_t *entries, size_t count,
+                              size_t run);
+};
+
+/**
+ * fat_scan - Get the fastest FAT scanning kernels
+ *
+ * The choice depends on what the processor supports (AVX2, then SSE2, then
+ * plain C), and is made on the first call.
+ *
+ * Return: the kernels.
+ */
+const struct fat_scan_ops *fat_scan(void);
+
+/**
+ * fat_scan_impl - Get a given implementation of the FAT scanning kernels
+ * @name: Name of the implementation
+ *
+ * Return: NULL if there is no implementation called @name, or if the processor
+ * cannot run it. Otherwise the kernels.
+ */
+const struct fat_scan_ops *fat_scan_impl(const char *name);
+
+#endif /* _FAT_SCAN_H */
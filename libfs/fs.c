@@ -1,23 +1,149 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
+#include "crc32c.h"
 #include "disk.h"
+#include "fat_scan.h"
 #include "fs.h"
+#include "lz.h"
 
-#define FAT_EOC 65535
+// end of a FAT chain, as kept in memory. On disk, the classic
+// format stores it as FAT16_EOC and the large format as FAT32_EOC.
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 65535
+#define FAT32_EOC 0xFFFFFFFF
+
+// number of FAT entries held by one FAT block, per format
+#define FAT16_ENTRIES (BLOCK_SIZE / 2)
+#define FAT32_ENTRIES (BLOCK_SIZE / 4)
+
+#define FS_SIGNATURE "ECS150FS"     // classic format, 16-bit FAT
+#define FS_SIGNATURE_32 "ECS150FL"  // large format, 32-bit FAT
+
+// root entry flags
+#define ROOT_COMPRESSED 0x1 // data stored as compressed chunks
+#define ROOT_LONG_NAME 0x2 // name in the name heap (large format only)
+#define ROOT_PACKED 0x4 // data stored as a fragment of a pack cluster
+
+// compressed files are cut in chunks of this many bytes (or
+// one cluster if clusters are bigger), compressed separately
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#define CHUNK_MAGIC 0x4d4b4843 // "CHKM"
+#define CHUNK_RAW 0x80000000 // chunk didn't compress, stored as is
+
+// fs_copy() moves the data by batches of this many blocks
+#define COPY_BATCH_BLOCKS 256
 
 /* HELPER FUNCTION PROTOTYPES */
 int file_search(const char* filename);
 int get_root_entry(const char* filename);
+int fs_lock_take(void);
+void fs_unlock(int *guard);
+void fs_lock_init(void);
+struct fs_request *async_submit(int op, int fd, void *buf, size_t count,
+                                fs_callback_t callback, void *arg);
+void *async_worker(void *unused);
+int async_fd_pending(int fd_index);
+int async_shutdown(void);
+int view_count(int fd_index);
 int get_fd_table_index(int fd);
-size_t get_and_set_fat(size_t first_db_num);
-int set_multi_fat (size_t *first_db_num, size_t offset_data_block);
-int get_next_fat(int updated_i, int updated_j);
-struct superblock {
+int fd_alloc(void);
+void fd_release(int fd_index);
+size_t get_and_set_fat(size_t last_db_num);
+size_t set_multi_fat(size_t last_db_num, size_t count, size_t *first_new);
+size_t alloc_find(size_t last, size_t first_free, size_t want,
+                  bool *scattered, size_t *len);
+size_t alloc_group_goal(void);
+size_t get_next_fat(size_t entry);
+size_t get_free_run(size_t entry, size_t count);
+size_t free_run_length(size_t entry, size_t max);
+size_t get_best_run(size_t count, size_t *len);
+int fat_cache_init(bool lazy);
+void fat_cache_free(void);
+union fat_block *fat_block_get(size_t index);
+void fat_block_evict(void);
+int fat_cache_flush(void);
+int fat_groups_init(void);
+int summary_load(void);
+void summary_rebuild(void);
+void summary_store(bool clean);
+uint32_t fat_get(size_t entry);
+void fat_set(size_t entry, uint32_t value);
+int checked_read(uint64_t block, size_t count, void *buf);
+int checked_write(uint64_t block, size_t count, const void *buf);
+int cluster_read(uint32_t cluster, size_t offset, void *buf, size_t len);
+int cluster_write(uint32_t cluster, size_t offset, const void *buf,
+                  size_t len, size_t valid);
+int read_file_data(int entry, uint64_t offset, void *buf, size_t count);
+int write_file_data(int entry, uint64_t offset, const void *buf,
+                    size_t count);
+int read_file_iov(int entry, uint64_t offset, const struct iovec *iov,
+                  int iovcnt);
+int write_file_iov(int entry, uint64_t offset, const struct iovec *iov,
+                   int iovcnt);
+uint32_t fat_walk(uint32_t cluster, uint64_t steps);
+size_t cluster_run(uint32_t cluster, size_t max);
+int insert_clusters(uint32_t after, size_t count);
+void remove_clusters(uint32_t after, size_t count);
+int read_compressed(int entry, uint64_t offset, void *buf, size_t count);
+int write_compressed(int entry, uint64_t offset, const void *buf,
+                     size_t count);
+struct chunk_map *chunk_map_get(int entry);
+int chunk_map_store(int entry);
+int chunk_load(int entry, uint64_t chunk);
+int chunk_store(int entry);
+int chunk_flush(int entry);
+int chunk_flush_open(void);
+void chunk_map_free(int entry);
+int read_packed(int entry, uint64_t offset, const struct iovec *iov,
+                int iovcnt, size_t count);
+int write_packed(int entry, uint64_t offset, const struct iovec *iov,
+                 int iovcnt);
+int copy_chain(int from, int to);
+int copy_data(int from, int to);
+int unpack_write(int entry, uint64_t offset, const struct iovec *iov,
+                 int iovcnt);
+int pack_store(uint32_t cluster, uint16_t unit, size_t units,
+               const void *buf, size_t len);
+int load_metadata(const struct fs_mount_opts *opts);
+int chain_load(uint32_t first, uint32_t **clusters, size_t *count);
+int chain_grow(uint32_t **clusters, size_t *count);
+void chain_shrink(uint32_t *clusters, size_t *count, size_t new_count);
+uint64_t root_block_index(size_t block);
+int root_block_decode(size_t block, const uint8_t *buf);
+void root_block_encode(size_t block, uint8_t *buf);
+int root_resize(size_t blocks);
+int root_load(void);
+int root_grow(void);
+void root_shrink(size_t cluster_count);
+int root_flush(void);
+int name_heap_load(void);
+int name_heap_add(const char *filename, size_t len, bool compact);
+void name_heap_shrink(size_t cluster_count);
+void name_heap_compact(void);
+int name_heap_flush(void);
+void release_metadata(void);
+int filename_check(const char *filename);
+int entry_is_open(int entry);
+void free_fat_chain(size_t first_db_num);
+int flush_metadata(bool clean);
+int metadata_write(bool clean);
+uint32_t filename_hash(const char *filename);
+void fat_store(size_t entry, uint32_t value);
+int sync_begin(uint64_t *sequence);
+
+// superblock as stored on disk by the classic format
+struct superblock16 {
     uint8_t signature[8]; // ECS150FS
     uint16_t total_blocks;
     uint16_t root_dir_index;
@@ -27,120 +153,761 @@ struct superblock {
     uint8_t padding[4079]; // to prevent malloc errors
 }__attribute__((__packed__));
 
+// superblock as stored on disk by the large format. Same
+// fields as the classic one, only wide enough for big images.
+struct superblock32 {
+    uint8_t signature[8]; // ECS150FL
+    uint64_t total_blocks;
+    uint64_t root_dir_index;
+    uint64_t data_block_index;
+    uint64_t total_data_blocks;
+    uint32_t total_fat_blocks;
+    uint32_t cluster_blocks; // data blocks per cluster, 0 reads as 1
+    uint32_t csum_blocks; // size of the checksum area, 0 if none
+    uint32_t root_chain; // first cluster of the root directory after
+                         // its first block, 0 if none
+    uint32_t name_chain; // first cluster of the name heap, 0 if none
+    uint32_t journal_blocks; // size of the journal, 0 if none
+    uint8_t padding[4032];
+}__attribute__((__packed__));
+
+// allocation summary, kept in the padding of the superblock (of either
+// format) so that a mount doesn't have to scan the whole FAT to know
+// where the free clusters are. group_free[] has the number of free
+// clusters in each group of group_blocks FAT blocks, groups being as
+// small as the padding allows (a single block for any classic disk).
+// clean is cleared on disk for as long as the file system is mounted:
+// only a summary written by an unmount is trusted.
+#define SUMMARY_MAGIC 0x4d555346 // "FSUM"
+#define SUMMARY_VERSION 1
+
+struct sb_summary {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t clean;
+    uint8_t reserved;
+    uint32_t crc; // CRC32C of the summary, computed with crc set to 0
+    uint32_t free_root_entries;
+    uint64_t free_clusters;
+    uint32_t group_blocks;
+    uint32_t group_count;
+    uint32_t group_free[];
+}__attribute__((__packed__));
+
+// in-memory superblock, whatever the on-disk format is.
+// raw keeps the block as it was read so that whatever
+// lives in the padding survives the write back.
+// the FAT has one entry per cluster of cluster_blocks data
+// blocks (always 1 in the classic format), hence total_clusters.
+// with checksums, csums holds the CRC32C of every block of the disk,
+// loaded from the csum_blocks blocks that follow the root directory.
+// the journal (if any) is the journal_blocks blocks right before the
+// data blocks.
+struct superblock {
+    uint64_t total_blocks;
+    uint64_t root_dir_index;
+    uint64_t data_block_index;
+    uint64_t total_data_blocks;
+    uint32_t total_fat_blocks;
+    uint32_t cluster_blocks;
+    uint64_t total_clusters;
+    size_t cluster_size; // in bytes
+    bool fat32; // large format
+    uint32_t csum_blocks;
+    uint32_t *csums; // NULL without checksums
+    uint32_t journal_blocks;
+    uint8_t raw[BLOCK_SIZE];
+};
+
 // we will have an array of FAT blocks.
 // each FAT block has an array of entries
-// (2048 entries for a total of 4096 bytes)
-struct fat_block {
-    uint16_t entries[2048];
+// (2048 16-bit entries or 1024 32-bit entries for a total of 4096 bytes)
+// only go through fat_get()/fat_set() to access them.
+union fat_block {
+    uint16_t entries[FAT16_ENTRIES];
+    uint32_t entries32[FAT32_ENTRIES];
+};
+
+// root entries as stored on disk, 32 bytes each in both formats
+struct root16 {
+    uint8_t filename[FS_FILENAME_LEN];
+    uint32_t filesize;
+    uint16_t first_db_num;
+    uint8_t flags;
+    uint16_t pack_unit; // with ROOT_PACKED
+    uint8_t padding[7]; // to prevent malloc issues
+}__attribute__((__packed__));
+
+struct root32 {
+    uint8_t filename[FS_FILENAME_LEN];
+    uint64_t filesize;
+    uint32_t first_db_num;
+    uint8_t flags;
+    uint16_t pack_unit; // with ROOT_PACKED
+    uint8_t padding[1];
 }__attribute__((__packed__));
 
+// what a root32 holds instead of its filename with ROOT_LONG_NAME set:
+// where the name is in the name heap, along with its first bytes and
+// hash so that lookups mostly compare entries without going there.
+struct root32_long_name {
+    uint8_t prefix[6];
+    uint16_t length;
+    uint32_t hash; // filename_hash() of the whole name
+    uint32_t offset;
+}__attribute__((__packed__));
 
-// we will have an array of root entries.
-// each root entry itself has an array
-// with indices representing the struct members.
+// we will have an array of root entries (in-memory version,
+// converted from/to root16 or root32 at mount and unmount).
+// chunks is only set while a compressed file is open. A long name
+// is in the name heap, filename only holding its first bytes.
+// A packed file is in cluster first_db_num, from unit pack_unit.
 struct root {
     uint8_t filename[FS_FILENAME_LEN];
-    uint32_t filesize;
-    uint16_t first_db_num;
-    uint8_t padding[10]; // to prevent malloc issues
+    uint32_t name_hash; // filename_hash() of the whole name
+    uint32_t name_offset; // in name_heap, for a long name
+    uint16_t name_len; // 0 if the name fits filename
+    uint64_t filesize;
+    uint32_t first_db_num;
+    uint8_t flags;
+    uint16_t pack_unit;
+    struct chunk_map *chunks;
+    uint32_t open_count; // file descriptors referencing the entry
+    // last cluster of the chain and its position in it, found by the
+    // writes that reach it (0 until then): writes at the end of the
+    // file, appends first, start from there instead of walking the
+    // chain. How full it is follows from filesize.
+    uint32_t tail_cluster;
+    uint64_t tail_index;
+};
+
+#define ROOT_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(struct root32))
+
+// a compressed file's chain starts with map_clusters clusters
+// holding a chunk_header and the stored length of every chunk,
+// followed by the chunks themselves, each starting on a cluster
+// boundary. Only the chunk held in cache is kept uncompressed.
+struct chunk_header {
+    uint32_t magic;
+    uint32_t count;
 }__attribute__((__packed__));
 
+struct chunk_map {
+    uint32_t count;          // chunks stored on disk
+    uint32_t capacity;       // size of lengths[] and first_cluster[]
+    uint32_t *lengths;       // stored size of each chunk (| CHUNK_RAW)
+    uint32_t *first_cluster; // where each chunk starts in the chain
+    uint32_t map_clusters;
+    bool dirty;              // map changed since it was last written
+    uint8_t *cache;          // one chunk, uncompressed
+    uint64_t cache_chunk;
+    bool cache_valid;
+    bool cache_dirty;        // written to, but not stored yet
+    uint64_t stored_size;    // size the chunks and map on disk cover,
+                             // which is what the root entry records
+};
+
+// small files (see the pack_small_files mount option) are packed in
+// pack clusters, each file being a fragment of whole PACK_UNIT-byte
+// units that never crosses a block boundary, so that reading it takes
+// a single block read. The FAT entry of a pack cluster ends a chain of
+// its own, which the last fragment to go frees. packs[] has the pack
+// clusters sorted, along with the units and fragments they hold, and
+// is rebuilt from the root directory at mount.
+#define PACK_UNIT 16
+#define PACK_MAX (BLOCK_SIZE / 2) // larger files get a chain
+#define PACK_BLOCK_UNITS (BLOCK_SIZE / PACK_UNIT)
+#define PACK_SCAN 64 // packs looked at for room before making a new one
+
+struct pack {
+    uint32_t cluster;
+    uint32_t fragments;
+    uint32_t free_units;
+    uint64_t *used; // one bit per unit
+};
+
+// fragments freed by changes that are not durable yet. Like the
+// clusters of journal_freed, they stay in use until they are.
+struct pack_freed {
+    uint32_t cluster;
+    uint16_t unit;
+    uint16_t units;
+    uint64_t sequence;
+};
+
+// the fd table grows as needed, and an fd is its index in there.
+// free entries have an id of -1 and are linked by next_free, the
+// last one freed first. async_pending and async_running belong to
+// the asynchronous requests, and are protected by async_lock (which
+// is why the table only moves with both locks held).
 struct fd {
     int id;
-    int offset;
+    uint64_t offset;
     int root_entry;
-}__attribute__((__packed__));
+    int next_free;
+    int async_pending; // requests queued or being performed
+    bool async_running; // one of them is being performed
+};
 
 // we will use this fact that sb is init as NULL
 // to check in the other functions if the disk has
 // been mounted or not. sb will only be NULL if
 // fs_mount() hasn't been called yet.
 static struct superblock* sb = NULL;
-static struct fat_block* fat_array = NULL;
-static struct root root_entries[FS_FILE_MAX_COUNT];// 128 for 1 root block
-static struct fd fd_table[FS_OPEN_MAX_COUNT]; // maximum 32 fd's open at a time
+// the root directory, ROOT_BLOCK_ENTRIES entries per block. The first
+// block is at root_dir_index, and the large format chains the others
+// (if the directory grew) in root_clusters, cluster_blocks at a time.
+// root_disk holds the blocks as they are on disk, so that only those
+// that changed get written back. Every entry below root_free_hint is
+// in use, and root_index finds the others by name.
+// With a journal, root_dirty flags the blocks changed since the last
+// commit, and root_logged holds the blocks as the journal has them.
+static struct root *root_entries = NULL;
+static size_t root_count = 0;
+static size_t root_free_count = 0;
+static size_t root_free_hint = 0;
+static uint32_t *root_clusters = NULL;
+static size_t root_cluster_count = 0;
+static uint8_t *root_disk = NULL;
+static bool *root_dirty = NULL;
+static bool root_dirty_any = false;
+static uint8_t *root_logged = NULL;
 
-int fs_mount(const char *diskname)
+// bumped whenever a file is created, deleted, renamed or changes its
+// size or first cluster (i.e. what fs_list() shows), and on mount
+static uint64_t dir_version = 0;
+
+// long names (large format only) are packed in the name heap, each
+// followed by a NULL character, in a chain of clusters the superblock
+// points to. Like root_disk, name_disk is the heap as it is on disk.
+// The names of deleted files are garbage until the heap is compacted.
+// With a journal, [name_dirty_lo, name_dirty_hi) is the part of the
+// heap changed since the last commit.
+static uint8_t *name_heap = NULL;
+static size_t name_heap_used = 0;
+static size_t name_heap_garbage = 0;
+static uint32_t *name_clusters = NULL;
+static size_t name_cluster_count = 0;
+static uint8_t *name_disk = NULL;
+static size_t name_dirty_lo = SIZE_MAX;
+static size_t name_dirty_hi = 0;
+static struct fd *fd_table = NULL;
+static int fd_capacity = 0;
+static int fd_free_head = -1;
+static int fd_open_count = 0;
+
+// every FAT entry below this one is known to be in use, so
+// the first-fit searches for a free entry can start from here.
+static size_t fat_free_hint = 1;
+
+// mounted with the read_only option: nothing may be written back.
+static bool mount_read_only = false;
+
+// where set_multi_fat() puts new clusters, and where the previous
+// allocation ended (the next-fit searches start from there).
+static enum fs_alloc_policy alloc_policy = FS_ALLOC_FIRST_FIT;
+static size_t alloc_cursor = 1;
+
+// the pack clusters (see struct pack). New fragments go in the pack
+// the last one went to (pack_current, 0 if none), or else in one of
+// the packs that follow pack_scan.
+static bool pack_small = false;
+static struct pack *packs = NULL;
+static size_t pack_count = 0;
+static size_t pack_cap = 0;
+static uint32_t pack_current = 0;
+static size_t pack_scan = 0;
+static struct pack_freed *pack_freed = NULL;
+static size_t pack_freed_count = 0;
+static size_t pack_freed_cap = 0;
+
+void free_file_data(const struct root *file);
+int pack_load(void);
+void pack_release(void);
+size_t pack_index(uint32_t cluster);
+struct pack *pack_find(uint32_t cluster);
+struct pack *pack_new(void);
+void pack_drop(struct pack *pack);
+bool pack_fit(const struct pack *pack, size_t units, uint16_t *unit);
+void pack_mark(struct pack *pack, size_t unit, size_t units, bool used);
+bool pack_block_shared(const struct pack *pack, size_t unit, size_t units);
+int pack_alloc(size_t units, uint32_t *cluster, uint16_t *unit);
+void pack_free(uint32_t cluster, size_t unit, size_t units);
+void pack_release_freed(uint64_t durable);
+
+// the FAT, held one block at a time (only go through fat_block_get()).
+// A normal mount reads all of it at once into fat_slab, and every slot
+// points in there. A lazy mount only reads a block the first time one
+// of its entries is accessed, and keeps at most fat_cache_max blocks in
+// memory (0 for no limit): past that, the clock hand picks a block that
+// wasn't referenced lately to make room, writing it back if dirty.
+// Either way the blocks come from block_buf_get(), aligned for direct
+// I/O.
+struct fat_slot {
+    union fat_block *block; // NULL while not in memory
+    bool dirty;             // changed since it was read or written
+    bool referenced;        // accessed since the clock hand went by
+};
+
+// free clusters in each group of fat_group_blocks FAT blocks (the
+// layout of the summary), and in total. Kept up to date by fat_set().
+static uint32_t *fat_group_free = NULL;
+static size_t fat_group_blocks = 1;
+static size_t fat_group_count = 0;
+static uint64_t fat_free_count = 0;
+
+static struct fat_slot *fat_cache = NULL;
+static union fat_block *fat_slab = NULL;
+static size_t fat_cache_max = 0;
+static size_t fat_resident = 0; // blocks paged in by a lazy mount
+static size_t fat_clock = 0;
+
+// codec activity since the disk was mounted
+static struct fs_compress_stats compress_stats;
+
+// every public function holds the library lock for its whole
+// duration, taken by FS_LOCK() and released when the function
+// returns. It is recursive, as some of them call others, and
+// fs_lock_depth tells the outermost call (which may commit the journal
+// once it has released the lock).
+static pthread_mutex_t fs_lock;
+static int fs_lock_depth = 0;
+static pthread_once_t fs_lock_once = PTHREAD_ONCE_INIT;
+
+#define FS_LOCK() \
+    int fs_lock_guard __attribute__((cleanup(fs_unlock), unused)) = \
+            fs_lock_take()
+
+// asynchronous requests are queued, and performed by a pool of
+// worker threads that the first request starts and that fs_umount()
+// stops. async_lock protects all of the following, and is never held
+// while performing a request (which takes the library lock).
+#define ASYNC_WORKERS 4
+
+enum async_op {
+    ASYNC_READ,
+    ASYNC_WRITE
+};
+
+struct fs_request {
+    enum async_op op;
+    int fd;
+    void *buf;
+    size_t count;
+    fs_callback_t callback;
+    void *arg;
+    int result;
+    bool done;
+    struct fs_request *next; // in async_queue
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+static pthread_t async_workers[ASYNC_WORKERS];
+static int async_worker_count = 0;
+static bool async_stop = false;
+// queued requests, oldest first
+static struct fs_request *async_queue = NULL;
+static struct fs_request *async_queue_tail = NULL;
+// requests not completely done yet, callbacks included
+static int async_total = 0;
+
+// memory views of files handed out by fs_map(), until fs_unmap().
+// A direct view maps the file's blocks straight from the disk
+// image, any other is a private copy of the data.
+struct fs_view {
+    const void *addr; // returned by fs_map()
+    void *base;       // to unmap
+    size_t len;       // blocks mapped (direct), or bytes (private)
+    bool direct;
+    int fd_index;
+    struct fs_view *next;
+};
+
+static struct fs_view *views = NULL;
+
+// operations recorded between fs_batch_begin() and fs_batch_commit().
+// nothing in here touches root_entries or the FAT until the commit.
+enum batch_op_type {
+    BATCH_CREATE,
+    BATCH_DELETE,
+    BATCH_RENAME
+};
+
+struct batch_op {
+    enum batch_op_type type;
+    char filename[FS_LONG_FILENAME_LEN];
+    char new_filename[FS_LONG_FILENAME_LEN]; // only used by BATCH_RENAME
+};
+
+static bool batch_active = false;
+static struct batch_op* batch_ops = NULL;
+static size_t batch_count = 0;
+static size_t batch_capacity = 0;
+
+// hashed lookup of filename -> root entry index, kept for the root
+// directory (root_index), and built over its shadow copy by a batch.
+// buckets[] and next[] hold root entry indices, -1 ends a chain.
+// There are at least NAME_INDEX_BUCKETS buckets, a power of 2, and
+// never less than half as many as entries.
+#define NAME_INDEX_BUCKETS 256
+
+struct name_index {
+    int *buckets;
+    size_t bucket_count;
+    int *next; // one per root entry
+};
+
+static struct name_index root_index;
+
+const char *entry_name(const struct root *entry);
+int entry_set_name(struct root *entry, const char *filename, bool compact);
+void entry_clear_name(struct root *entry);
+
+int name_index_build(struct name_index *index,
+                     struct root *entries, size_t count);
+int name_index_grow(struct name_index *index,
+                    struct root *entries, size_t count);
+void name_index_free(struct name_index *index);
+void name_index_insert(struct name_index *index,
+                       struct root *entries, int entry);
+void name_index_remove(struct name_index *index,
+                       struct root *entries, int entry);
+int name_index_lookup(struct name_index *index,
+                      struct root *entries, const char *filename);
+int batch_append(enum batch_op_type type, const char *filename,
+                 const char *new_filename);
+
+// the metadata journal (see FS_FORMAT_JOURNAL) is a header block followed
+// by transactions, each one starting on a block boundary with a
+// journal_txn and holding the redo records of the metadata changes it
+// commits. The header has the sequence number of the first transaction
+// to replay: a mount replays the transactions that follow it for as long
+// as their sequence numbers follow each other and their CRCs match. A
+// checkpoint writes the metadata in place, then empties the journal by
+// moving the header's sequence number past every transaction written.
+#define JOURNAL_MAGIC 0x4c4a5346 // "FSJL"
+#define JOURNAL_TXN_MAGIC 0x4e584a46 // "FJXN"
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t crc; // CRC32C of the header, computed with crc set to 0
+    uint64_t sequence;
+}__attribute__((__packed__));
+
+struct journal_txn {
+    uint32_t magic;
+    uint32_t crc; // CRC32C of the header and records, crc set to 0
+    uint64_t sequence;
+    uint32_t length; // of the records, in bytes
+    uint32_t root_chain; // those of the superblock, as of the commit
+    uint32_t name_chain;
+    uint32_t reserved;
+}__attribute__((__packed__));
+
+// a record holds the new values of consecutive items, the first one
+// being item key: FAT entries, block checksums, root32 entries or
+// bytes of the name heap.
+enum journal_type {
+    JOURNAL_FAT = 1,
+    JOURNAL_CSUM,
+    JOURNAL_ROOT,
+    JOURNAL_NAMES
+};
+
+struct journal_record {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t length; // of the values that follow, in bytes
+    uint64_t key;
+}__attribute__((__packed__));
+
+// a transaction on its way to the log, outside of the library lock
+struct journal_io {
+    uint8_t *buf;
+    size_t length; // of the header and records
+    uint64_t block;
+    size_t blocks;
+    uint64_t sequence;
+};
+
+// the changes not committed yet, as records in journal_buf (after room
+// for the transaction header). A change next to the last record, at
+// journal_last, extends it. Changed root entries and names are only
+// turned into records when the transaction is sealed. journal_seq is
+// the sequence number the transaction will get, and journal_pos the
+// first free block of the log. All of these belong to the library lock.
+static bool journal_active = false;
+static bool journal_sync_ops = false;
+static uint8_t *journal_buf = NULL;
+static size_t journal_len = 0;
+static size_t journal_cap = 0;
+static size_t journal_last = 0; // 0 if none
+static bool journal_overflow = false; // records were dropped
+static uint64_t journal_seq = 0;
+static size_t journal_pos = 0;
+
+// clusters freed by changes that are not durable yet. They stay in use
+// (in memory) until the transaction freeing them is, so that nothing
+// the last commit still references gets overwritten.
+struct journal_freed {
+    uint32_t cluster;
+    uint64_t sequence;
+};
+
+static struct journal_freed *journal_freed = NULL;
+static size_t journal_freed_count = 0;
+static size_t journal_freed_cap = 0;
+
+// group commit: one thread at a time claims the journal to write a
+// transaction (journal_busy), without holding the library lock, while
+// the others wait for journal_durable (the last transaction known to
+// be on stable storage) to reach theirs. Claiming takes the library
+// lock as well, so only a write can be waited for. journal_broken is
+// set when a write fails, and only changes with the journal claimed.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static bool journal_busy = false;
+static uint64_t journal_durable = 0;
+static bool journal_broken = false;
+
+// the records of the transactions a mount replays
+static uint8_t *journal_replay_buf = NULL;
+static size_t journal_replay_len = 0;
+static bool journal_recovering = false;
+
+int journal_load(void);
+int journal_replay(uint16_t type, uint8_t *image, size_t size);
+int journal_start(const struct fs_mount_opts *opts);
+void journal_free(void);
+size_t journal_item_size(uint16_t type);
+void journal_put(uint16_t type, uint64_t key, const void *values,
+                 size_t count);
+void journal_free_cluster(size_t cluster);
+void journal_release_freed(uint64_t durable);
+void root_mark_dirty(size_t entry);
+void entry_changed(size_t entry);
+void name_mark_dirty(size_t lo, size_t hi);
+bool journal_pending(void);
+void journal_seal(void);
+bool journal_prepare(struct journal_io *io);
+int journal_write(struct journal_io *io);
+int journal_header_write(uint64_t sequence);
+uint64_t journal_claim(void);
+void journal_done(uint64_t durable);
+int journal_begin(uint64_t sequence, struct journal_io *io);
+int journal_wait(uint64_t sequence);
+uint64_t journal_ticket(void);
+uint64_t journal_due(void);
+int journal_commit(void);
+int journal_checkpoint(bool clean);
+int journal_reset(void);
+
+int fs_format(const char *diskname, size_t data_blk_count,
+              size_t cluster_size, int flags)
 {
-    sb = malloc(sizeof(struct superblock));
-    if (block_disk_open(diskname) == -1) {
+    FS_LOCK();
+    // formatting goes through the same globals as a mounted disk
+    if (sb) {
         return -1;
     }
-    if (block_read(0, sb) == -1) {
+    if (data_blk_count == 0) {
         return -1;
     }
-    // testing for matching signature
-    if (strncmp((char *)sb->signature, "ECS150FS", 8) != 0) {
-        return -1;
+
+    // checksums and the journal live in the large format only
+    bool fat32 = flags & (FS_FORMAT_LARGE | FS_FORMAT_CHECKSUM
+                          | FS_FORMAT_JOURNAL);
+    if (cluster_size == 0) {
+        cluster_size = BLOCK_SIZE;
     }
-    // testing for matching block count
-    if (block_disk_count() != sb->total_blocks) {
+    // clusters are whole blocks, and only the large format
+    // knows about them (it's 1 block per cluster otherwise)
+    if (cluster_size % BLOCK_SIZE != 0
+        || cluster_size > FS_CLUSTER_MAX_SIZE
+        || (!fat32 && cluster_size != BLOCK_SIZE)) {
         return -1;
     }
 
-    // begin loading metadata for the fat struct
-    fat_array = malloc(sb->total_fat_blocks * sizeof(struct fat_block));
+    // the data region is made of whole clusters, and the
+    // FAT has one entry for each of them
+    uint64_t cluster_blocks = cluster_size / BLOCK_SIZE;
+    uint64_t total_clusters =
+            (data_blk_count + cluster_blocks - 1) / cluster_blocks;
+    data_blk_count = total_clusters * cluster_blocks;
 
-    // fat_array represents the array of fat blocks themselves
-    // entries[i] however is the array of fat block entries,
-    // per fat block.
-    int total_fat_counter = (int)sb->total_fat_blocks;
-    size_t read_counter = 1;
+    size_t fat_entries = fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    uint64_t fat_blocks = (total_clusters + fat_entries - 1) / fat_entries;
+    uint64_t total_blocks = 1 + fat_blocks + 1 + data_blk_count;
 
-    while (total_fat_counter != 0) {
-        if (block_read(read_counter,
-                       fat_array[read_counter-1].entries) == -1) {
-            return -1;
+    // the journal scales with the disk, within reason
+    uint64_t journal_blocks = 0;
+    if (flags & FS_FORMAT_JOURNAL) {
+        journal_blocks = data_blk_count / 64;
+        journal_blocks = journal_blocks < 64 ? 64 : journal_blocks;
+        journal_blocks = journal_blocks > 16384 ? 16384 : journal_blocks;
+        total_blocks += journal_blocks;
+    }
+
+    // the checksum area has a CRC for each block of the disk,
+    // its own blocks included (they are not checked, though)
+    uint64_t csum_blocks = 0;
+    if (flags & FS_FORMAT_CHECKSUM) {
+        size_t per_block = BLOCK_SIZE / sizeof(uint32_t);
+        while (csum_blocks * per_block < total_blocks + csum_blocks) {
+            ++csum_blocks;
         }
-        read_counter++;
-        --total_fat_counter;
+        total_blocks += csum_blocks;
     }
-    // making sure the first entry loaded was 0xFFFF
-    if (fat_array[0].entries[0] != FAT_EOC) {
+
+    // the classic format stores all of these on 16 bits (8 for
+    // the FAT block count), and the end-of-chain value is no
+    // valid data block index in either format.
+    if (!fat32 && (total_blocks > UINT16_MAX || fat_blocks > UINT8_MAX
+                   || total_clusters >= FAT16_EOC)) {
+        return -1;
+    }
+    if (fat32 && (total_clusters >= FAT32_EOC || fat_blocks > UINT32_MAX
+                  || csum_blocks > UINT32_MAX)) {
+        return -1;
+    }
+
+    if (block_disk_create(diskname, total_blocks) == -1) {
+        return -1;
+    }
+    if (block_disk_open(diskname) == -1) {
+        return -1;
+    }
+
+    // build the metadata of an empty file system in memory,
+    // then let flush_metadata() write it in the right format
+    sb = calloc(1, sizeof(struct superblock));
+    if (!sb) {
+        block_disk_close();
+        return -1;
+    }
+    memcpy(sb->raw, fat32 ? FS_SIGNATURE_32 : FS_SIGNATURE, 8);
+    sb->fat32 = fat32;
+    sb->total_blocks = total_blocks;
+    sb->root_dir_index = fat_blocks + 1;
+    sb->data_block_index = fat_blocks + 2 + csum_blocks + journal_blocks;
+    sb->total_data_blocks = data_blk_count;
+    sb->total_fat_blocks = (uint32_t)fat_blocks;
+    sb->cluster_blocks = (uint32_t)cluster_blocks;
+    sb->total_clusters = total_clusters;
+    sb->cluster_size = cluster_size;
+    sb->csum_blocks = (uint32_t)csum_blocks;
+    sb->journal_blocks = (uint32_t)journal_blocks;
+    if (csum_blocks) {
+        sb->csums = malloc(csum_blocks * BLOCK_SIZE);
+    }
+    if ((csum_blocks && !sb->csums) || fat_cache_init(false) == -1) {
+        release_metadata();
+        block_disk_close();
+        return -1;
+    }
+    if (csum_blocks) {
+        // the disk starts out as zeros, which flush_metadata()
+        // then overwrites with the metadata blocks
+        uint8_t zero_block[BLOCK_SIZE] = { 0 };
+        uint32_t zero_csum = crc32c(0, zero_block, BLOCK_SIZE);
+        for (uint64_t i = 0; i < csum_blocks * BLOCK_SIZE / 4; ++i) {
+            sb->csums[i] = zero_csum;
+        }
+    }
+    // the whole FAT gets written
+    for (uint64_t i = 0; i < fat_blocks; ++i) {
+        fat_cache[i].dirty = true;
+    }
+    fat_set(0, FAT_EOC); // cluster 0 is never handed out
+    // the root directory starts as its first block, all zeros
+    // on disk already, like root_disk
+    if (root_resize(1) == -1 || fat_groups_init() == -1) {
+        release_metadata();
+        block_disk_close();
         return -1;
     }
+    summary_rebuild();
 
-    // Now we do the same thing for the root_entries
-    // (32 bytes * 128 entries = 1 whole root block)
-    if (block_read((size_t)sb->root_dir_index, root_entries) == -1) {
+    // and the journal starts out empty
+    int ret = flush_metadata(true);
+    if (ret == 0 && journal_blocks) {
+        ret = journal_header_write(1);
+    }
+    release_metadata();
+    if (block_disk_close() == -1) {
         return -1;
     }
+    return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+    return fs_mount_with(diskname, NULL);
+}
 
-    // finally, assign initial values for the fd table
-    // (maximum fd's it can hold at a time is 32)
-    for(int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-        fd_table[i].id = -1; // set all to -1, b/c none has been opened
-        fd_table[i].offset = 0; //always init as 0
+int fs_mount_with(const char *diskname, const struct fs_mount_opts *opts)
+{
+    FS_LOCK();
+    // only one file system can be mounted at a time
+    if (sb) {
+        return -1;
     }
+    if (opts && (opts->alloc_policy < FS_ALLOC_FIRST_FIT
+                 || opts->alloc_policy > FS_ALLOC_BEST_FIT)) {
+        return -1;
+    }
+    int disk_flags = opts && opts->direct_io ? BLOCK_DISK_DIRECT : 0;
+    if (opts && opts->read_only) {
+        disk_flags |= BLOCK_DISK_READONLY;
+    }
+    if (block_disk_open_flags(diskname, disk_flags) == -1) {
+        return -1;
+    }
+    // superblock, FAT and root directory. On failure, leave
+    // things as if fs_mount() had never been called.
+    if (load_metadata(opts) == -1) {
+        release_metadata();
+        block_disk_close();
+        return -1;
+    }
+
+    // finally, start with an empty fd table, which
+    // grows with the first fs_open()
+    fd_table = NULL;
+    fd_capacity = 0;
+    fd_free_head = -1;
+    fd_open_count = 0;
+    ++dir_version;
     return 0;
 }
 
 int fs_umount(void)
 {
+    FS_LOCK();
     // error check if no disk was mounted to begin with
     if (!sb) {
         return -1;
     }
 
     // error check if there are still open file descriptors
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-        if (fd_table[i].id != -1) {
-            return -1;
-        }
+    if (fd_open_count > 0) {
+        return -1;
     }
 
-    // First one is always the superblock
-    if (block_write(0, sb) == -1) {
+    // a batch has to be committed or aborted first
+    if (batch_active) {
         return -1;
     }
-    // Next is the FAT blocks
-    for (size_t i = 0; i < sb->total_fat_blocks; i++) {
-        if(block_write((i+1), fat_array[i].entries) == -1) {
-            return -1;
-        }
+
+    // and asynchronous requests must all be done
+    if (async_shutdown() == -1) {
+        return -1;
     }
-    // Afterwards is the root.
-    if (block_write(sb->root_dir_index, root_entries) == -1) {
+
+    // write the superblock, the FAT blocks and the root back
+    if (!mount_read_only && flush_metadata(true) == -1) {
         return -1;
     }
     // We then close the disk
@@ -148,18 +915,29 @@ int fs_umount(void)
         return -1;
     }
     // Finally, free/wipe clean the globals
-    free(sb);
-    free(fat_array);
-    memset(root_entries, 0, BLOCK_SIZE);
-    memset(fd_table, 0, sizeof(struct fd)*FS_OPEN_MAX_COUNT);
-    sb = NULL;
-    fat_array = NULL;
+    release_metadata();
+    free(fd_table);
+    fd_table = NULL;
+    fd_capacity = 0;
+    fd_free_head = -1;
 
     return 0;
 }
 
+int fs_sync(void)
+{
+    uint64_t sequence = 0;
+    if (sync_begin(&sequence) == -1) {
+        return -1;
+    }
+    // waiting happens without the library lock, so that the
+    // operations of other threads can join the same commit
+    return sequence ? journal_wait(sequence) : 0;
+}
+
 int fs_info(void)
 {
+    FS_LOCK();
     // sb being NULL means it never changed.
     // if sb never changed, then no virtual disk
     // was opened in the first place.
@@ -167,63 +945,41 @@ int fs_info(void)
         return -1;
     }
 
-    // get the actual amount of occupied fat blocks
-    // by iterating through the fat_array and
-    // incrementing the fat_occupied_count by 1
-    // each time it encounters a non-zero entry
-    int fat_occupied_count = 0;
-
-    for (int i = 0; i < sb->total_fat_blocks; ++i) {
-        for (int j = 0; j < 2048; ++j) { // 2048 entries per FAT block
-            if (fat_array[i].entries[j] != 0) {
-                ++fat_occupied_count;
-            }
-        }
-    }
+    // the actual amount of occupied fat blocks is kept track of
+    uint64_t fat_occupied_count = sb->total_clusters - fat_free_count;
 
-    // now calculate the amount of occupied root entries
-    // by iterating through the root_entries array and
-    // incrementing occupied_root_count by 1 each time
-    // it encounters a null character in each entry's
-    // filename member.
-    int root_entry_free_count = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (root_entries[i].filename[0] == '\0') {
-            ++root_entry_free_count;
-        }
-    }
 
     printf("FS Info:\n");
-    printf("total_blk_count=%d\n", sb->total_blocks);
-    printf("fat_blk_count=%d\n", sb->total_fat_blocks);
-    printf("rdir_blk=%d\n", sb->root_dir_index);
-    printf("data_blk=%d\n", sb->data_block_index);
-    printf("data_blk_count=%d\n", sb->total_data_blocks);
+    printf("total_blk_count=%" PRIu64 "\n", sb->total_blocks);
+    printf("fat_blk_count=%" PRIu32 "\n", sb->total_fat_blocks);
+    printf("rdir_blk=%" PRIu64 "\n", sb->root_dir_index);
+    printf("data_blk=%" PRIu64 "\n", sb->data_block_index);
+    printf("data_blk_count=%" PRIu64 "\n", sb->total_data_blocks);
+
+    printf("fat_free_ratio=%" PRIu64 "/%" PRIu64 "\n",
+           sb->total_clusters - fat_occupied_count, sb->total_clusters);
 
-    printf("fat_free_ratio=%d/%d\n",
-           sb->total_data_blocks - fat_occupied_count, sb->total_data_blocks);
+    printf("rdir_free_ratio=%zu/%zu\n", root_free_count, root_count);
 
-    printf("rdir_free_ratio=%d/%d\n",
-           root_entry_free_count, FS_FILE_MAX_COUNT);
+    // (classic format disks always have 1 block per cluster)
+    if (sb->fat32) {
+        printf("cluster_size=%zu\n", sb->cluster_size);
+    }
 
     return 0;
 }
 
 int fs_create(const char *filename)
 {
-    if (!sb) {
+    FS_LOCK();
+    if (!sb || mount_read_only) {
         return -1;
     }
 
     // error checking for invalid filename
     // we define "invalid" to be filenames with 0 bytes (empty)
-    // or >= the 16 bytes specified
-    if (strlen(filename) >= FS_FILENAME_LEN || strlen(filename) == 0) {
-        return -1;
-    }
-
-    // check if filename is null-terminated
-    if (!strchr(filename, '\0')) {
+    // or too long for the format (see filename_check())
+    if (filename_check(filename) == -1) {
         return -1;
     }
 
@@ -234,44 +990,54 @@ int fs_create(const char *filename)
         return -1;
     }
 
-    // error checking if all root entries are
-    // already populated. i.e. 128 files present; no more can be added.
-    int file_counter = 0; // temporary variable
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (root_entries[i].filename[0] != '\0') {
-            ++file_counter;
-        }
-    }
-    if (file_counter == 128) {
+    // error checking if all root entries are already populated,
+    // in which case the directory has to grow (if it can)
+    if (root_free_count == 0 && root_grow() == -1) {
         return -1;
     }
 
     // find first occurrence of an empty root entry
     // (add file if first filename char is NULL char)
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (root_entries[i].filename[0] == '\0') {
-            strcpy((char *)root_entries[i].filename, filename);
-            root_entries[i].filesize = 0;
-            root_entries[i].first_db_num = FAT_EOC; // fat_EOC
-            break;
-        }
+    size_t i = root_free_hint;
+    while (root_entries[i].filename[0] != '\0') {
+        ++i;
+    }
+    if (entry_set_name(&root_entries[i], filename, true) == -1) {
+        return -1;
+    }
+    root_entries[i].filesize = 0;
+    root_entries[i].first_db_num = FAT_EOC; // fat_EOC
+    root_entries[i].flags = 0;
+    root_entries[i].tail_cluster = 0;
+    name_index_insert(&root_index, root_entries, (int)i);
+    --root_free_count;
+    root_free_hint = i + 1;
+    entry_changed(i);
+    return 0;
+}
+
+int fs_create_compressed(const char *filename)
+{
+    FS_LOCK();
+    if (fs_create(filename) == -1) {
+        return -1;
     }
+    // still empty, so there is nothing to convert
+    int entry = get_root_entry(filename);
+    root_entries[entry].flags |= ROOT_COMPRESSED;
+    entry_changed(entry);
     return 0;
 }
 
 int fs_delete(const char *filename)
 {
+    FS_LOCK();
 
-    if (!sb) {
+    if (!sb || mount_read_only) {
         return -1;
     }
     // Check if file name is invalid
-    if (strlen(filename) >= FS_FILENAME_LEN || strlen(filename) == 0) {
-        return -1;
-    }
-
-    // check if filename is null-terminated
-    if (!strchr(filename, '\0')) {
+    if (filename_check(filename) == -1) {
         return -1;
     }
 
@@ -282,86 +1048,180 @@ int fs_delete(const char *filename)
 
     int entry = get_root_entry(filename);
 
-    // we want a copy of the first db number
-    // for freeing the fat entry.
-    size_t first_db_num = root_entries[entry].first_db_num;
-    size_t db_index = first_db_num;
-    db_index += sb->root_dir_index;
-    ++db_index; // skip over DB #0
-
-    // freeing the associated fat entry/entries
-    // by replacing them with a 0 value
-
-    size_t first_db_num_cpy = first_db_num; // for the while loop below
-    int fat_block_index = 0;
-    if (first_db_num_cpy >= 2048) {
-        while (first_db_num_cpy != 0 && first_db_num_cpy != FAT_EOC) {
-            ++fat_block_index;
-            first_db_num_cpy /= 2048;
-        }
-    }
-
-    int root_index = get_root_entry(filename);
-    int amt_data_blocks = root_entries[root_index].filesize / BLOCK_SIZE + 1;
-    if (amt_data_blocks > 1) {
-        // freeing multiple fat entries
-        // by setting them to 0
-        size_t next_entry = first_db_num;
-        size_t cur_entry = next_entry;
-        while (amt_data_blocks != 0) {
-            next_entry = fat_array[fat_block_index].entries[cur_entry];
-            fat_array[fat_block_index].entries[cur_entry] = 0;
-            cur_entry = next_entry;
-            amt_data_blocks--;
-        }
+    // an open file cannot be deleted
+    if (entry_is_open(entry)) {
+        return -1;
     }
-    else {
-        // freeing a single fat entry pointing to
-        // a single data block
-        if (fat_array[fat_block_index].entries[first_db_num] == FAT_EOC) {
-            fat_array[fat_block_index].entries[first_db_num] = 0;
-        }
 
-    }
+    // freeing the associated fat entry/entries
+    // by replacing them with a 0 value (or its fragment)
+    free_file_data(&root_entries[entry]);
 
     // freeing the root entry
-    memset((char *)root_entries[entry].filename, 0, 16);
-    root_entries[entry].filename[0] = '\0';
+    name_index_remove(&root_index, root_entries, entry);
+    ++root_free_count;
+    if ((size_t)entry < root_free_hint) {
+        root_free_hint = entry;
+    }
+    entry_clear_name(&root_entries[entry]);
     root_entries[entry].first_db_num = 0;
     root_entries[entry].filesize = 0;
+    root_entries[entry].flags = 0;
+    root_entries[entry].pack_unit = 0;
+    root_entries[entry].tail_cluster = 0;
+    entry_changed(entry);
+
+    return 0;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+    FS_LOCK();
+    if (!sb || mount_read_only || filename_check(src) == -1
+        || get_root_entry(src) == -1 || fs_create(dst) == -1) {
+        return -1;
+    }
+    // (creating the copy may have moved the root directory)
+    int from = get_root_entry(src);
+    int to = get_root_entry(dst);
+    struct root *file = &root_entries[from];
 
+    // the files whose data isn't simply in their chain, and those
+    // small enough to be packed, go through the usual reads and writes
+    int ret;
+    if ((file->flags & (ROOT_COMPRESSED | ROOT_PACKED))
+        || (pack_small && file->filesize <= PACK_MAX)) {
+        ret = copy_data(from, to);
+    }
+    else {
+        ret = copy_chain(from, to);
+    }
+    if (ret == -1) {
+        fs_delete(dst);
+        return -1;
+    }
     return 0;
 }
 
 int fs_ls(void)
 {
+    FS_LOCK();
     // sb being NULL implies nothing was mounted,
     // since sb gets populated in fs_mount()
     if (!sb) {
         return -1;
     }
     printf("FS Ls:\n");
-    for (size_t i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+    for (size_t i = 0; i < root_count; ++i) {
         if (root_entries[i].filename[0] != '\0') {
-            printf("file: %s, size: %d, data_blk: %d\n",
-                   root_entries[i].filename, root_entries[i].filesize,
-                   root_entries[i].first_db_num);
+            // empty files show the end-of-chain value of the
+            // on-disk format, like any other FAT16 tool would
+            uint32_t data_blk = root_entries[i].first_db_num;
+            if (data_blk == FAT_EOC && !sb->fat32) {
+                data_blk = FAT16_EOC;
+            }
+            printf("file: %s, size: %" PRIu64 ", data_blk: %" PRIu32 "\n",
+                   entry_name(&root_entries[i]), root_entries[i].filesize,
+                   data_blk);
         }
     }
     return 0;
 }
 
-int fs_open(const char *filename) {
-    if (!sb) {
+int fs_list(struct fs_dirent *entries, size_t max, size_t *pos)
+{
+    FS_LOCK();
+    if (!sb || !entries || !pos) {
         return -1;
     }
-    // Check if file name is invalid
-    if (strlen(filename) > FS_FILENAME_LEN || strlen(filename) == 0) {
+    size_t limit = max < INT_MAX ? max : INT_MAX;
+    size_t count = 0;
+    size_t i = *pos;
+    for (; i < root_count && count < limit; ++i) {
+        struct root *entry = &root_entries[i];
+        if (entry->filename[0] == '\0') {
+            continue;
+        }
+        struct fs_dirent *dirent = &entries[count++];
+        strcpy(dirent->name, entry_name(entry));
+        dirent->size = entry->filesize;
+        // FAT_EOC is FS_NO_BLOCK, whatever the format
+        dirent->first_block = entry->first_db_num;
+    }
+    *pos = i;
+    return (int)count;
+}
+
+uint64_t fs_dir_version(void)
+{
+    FS_LOCK();
+    return sb ? dir_version : 0;
+}
+
+int fs_extents(const char *filename, struct fs_extent *extents, size_t max,
+               uint64_t *pos)
+{
+    FS_LOCK();
+    if (!sb || !extents || !pos || filename_check(filename) == -1) {
+        return -1;
+    }
+    int entry = get_root_entry(filename);
+    if (entry == -1) {
+        return -1;
+    }
+    // @pos is the next cluster to list plus one, so that 0 starts
+    // from the first one (and FAT_EOC + 1 is past the last one)
+    uint64_t cluster = *pos ? *pos - 1 : root_entries[entry].first_db_num;
+    size_t limit = max < INT_MAX ? max : INT_MAX;
+    size_t count = 0;
+    while (count < limit && cluster < sb->total_clusters) {
+        struct fs_extent *extent = &extents[count++];
+        extent->first_block = (uint32_t)cluster;
+        extent->count = 1;
+        uint32_t next = fat_get(cluster);
+        while (next == cluster + 1 && extent->count < UINT32_MAX) {
+            ++extent->count;
+            cluster = next;
+            next = fat_get(cluster);
+        }
+        cluster = next;
+    }
+    *pos = cluster + 1;
+    return (int)count;
+}
+
+int fs_free_extents(struct fs_extent *extents, size_t max, uint64_t *pos)
+{
+    FS_LOCK();
+    if (!sb || !extents || !pos) {
         return -1;
     }
+    size_t limit = max < INT_MAX ? max : INT_MAX;
+    size_t count = 0;
+    uint64_t cluster = *pos;
+    while (count < limit && cluster < sb->total_clusters) {
+        // entry 0 is never free, so 0 means there are no more
+        size_t start = get_next_fat(cluster);
+        if (start == 0) {
+            cluster = sb->total_clusters;
+            break;
+        }
+        struct fs_extent *extent = &extents[count++];
+        extent->first_block = (uint32_t)start;
+        extent->count = (uint32_t)free_run_length(start, UINT32_MAX);
+        cluster = start + extent->count;
+    }
+    *pos = cluster;
+    return (int)count;
+}
 
-    // check if filename is null-terminated
-    if (!strchr(filename, '\0')) {
+int fs_open(const char *filename) {
+    FS_LOCK();
+    if (!sb) {
+        return -1;
+    }
+    // Check if file name is invalid
+    if (filename_check(filename) == -1) {
         return -1;
     }
 
@@ -370,19 +1230,21 @@ int fs_open(const char *filename) {
         return -1;
     }
 
-    //we find the first fd that is not open, and the set a new ID to it.
-    for(int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-        if (fd_table[i].id == -1) {
-            fd_table[i].id = i;
-            fd_table[i].root_entry = get_root_entry(filename);
-            return fd_table[i].id;
-        }
+    // take a free fd from the table, and set a new ID to it.
+    int i = fd_alloc();
+    if (i == -1) {
+        return -1;
     }
-    return -1;
+    fd_table[i].id = i;
+    fd_table[i].offset = 0; // a reused fd starts over
+    fd_table[i].root_entry = get_root_entry(filename);
+    ++root_entries[fd_table[i].root_entry].open_count;
+    return fd_table[i].id;
 }
 
 int fs_close(int fd)
 {
+    FS_LOCK();
     if (!sb) {
         return -1;
     }
@@ -397,12 +1259,44 @@ int fs_close(int fd)
     if (fd_index == -1) {
         return -1; // fd isn't open to begin with
     }
-    fd_table[fd_index].id = -1;
+    // asynchronous requests still need it, and so do mapped views
+    if (async_fd_pending(fd_index) || view_count(fd_index) > 0) {
+        return -1;
+    }
+    int entry = fd_table[fd_index].root_entry;
+
+    // last descriptor of a compressed file: store the chunk still
+    // in cache and the chunk map, and drop them from memory. If they
+    // don't fit on disk, the descriptor stays open (along with what
+    // was written through it) so that closing can be retried once
+    // there is room.
+    if (root_entries[entry].chunks && root_entries[entry].open_count == 1) {
+        if (chunk_flush(entry) == -1) {
+            return -1;
+        }
+        chunk_map_free(entry);
+    }
+    --root_entries[entry].open_count;
+    fd_release(fd_index);
     return 0;
 }
 
 int fs_stat(int fd)
 {
+    FS_LOCK();
+    int64_t filesize = fs_stat64(fd);
+
+    // (files of 2 GiB and more can only exist on the large format,
+    // and their size doesn't fit the return value.)
+    if (filesize > INT_MAX) {
+        return -1;
+    }
+    return (int)filesize;
+}
+
+int64_t fs_stat64(int fd)
+{
+    FS_LOCK();
     if (!sb) {
         return -1;
     }
@@ -416,11 +1310,12 @@ int fs_stat(int fd)
 
     // we get our current root entry in our fd_table, and use that
     // to get the file size in our root_entries array.
-    return root_entries[fd_table[fd_index].root_entry].filesize;
+    return (int64_t)root_entries[fd_table[fd_index].root_entry].filesize;
 }
 
 int fs_lseek(int fd, size_t offset)
 {
+    FS_LOCK();
     if (!sb) {
         return -1;
     }
@@ -440,12 +1335,13 @@ int fs_lseek(int fd, size_t offset)
         return -1;
     }
 
-    fd_table[fd_index].offset = (int)offset;
+    fd_table[fd_index].offset = offset;
     return 0;
 }
 
 int fs_write(int fd, void *buf, size_t count)
 {
+    FS_LOCK();
     if (!sb) {
         return -1;
     }
@@ -460,160 +1356,41 @@ int fs_write(int fd, void *buf, size_t count)
         return 0;
     }
 
-    root_entries[fd_table[fd_index].root_entry].filesize += (uint32_t)count;
-
-    //amount of data we're attempting to write
-    size_t amnt_data_blocks = (count / BLOCK_SIZE) + 1; // due to truncation
-    size_t buf_offset = 0;
-    size_t multi_count = count;
-    void *bounce_buf = malloc(BLOCK_SIZE); //used to hold a temp data block.
-
-    //we have these vars b/c ugly to keep writing them out.
-    size_t first_db_num =
-            root_entries[fd_table[fd_index].root_entry].first_db_num;
-    size_t fd_offset = (size_t)fd_table[fd_index].offset;
-    uint32_t filesize = root_entries[fd_table[fd_index].root_entry].filesize;
-
-    size_t first_db_num_cpy = first_db_num; // for the while loop below
-    int fat_block_index = 0;
-    if (first_db_num_cpy >= 2048 && first_db_num_cpy != FAT_EOC) {
-        while (first_db_num_cpy != 0) {
-            ++fat_block_index;
-            first_db_num_cpy /= 2048;
-        }
+    int written = write_file_data(fd_table[fd_index].root_entry,
+                                  fd_table[fd_index].offset, buf, count);
+    if (written > 0) {
+        fd_table[fd_index].offset += written;
     }
+    return written;
+}
 
-    size_t block_offset = fd_offset/BLOCK_SIZE;
-    size_t byte_offset = fd_offset - (block_offset*BLOCK_SIZE);
-    size_t offset_data_block = amnt_data_blocks - block_offset;
-
-    size_t offset_db_index = block_offset;
-
-
-    // array that holds where fat entries are.
-    uint16_t fat_location[2048 * sb->total_fat_blocks];
-
-    // free_fat represents the first-fit fat entry (or entries)
-    // index (or indices) for the file being added, depending upon the
-    // filesize. in practice, this returns the jth entry of the fat_array.
-    size_t free_fat = 0;
-    if (amnt_data_blocks > 1) {
-        if (set_multi_fat(&first_db_num, offset_data_block) == -1) {
-            return 0; // no more free fat entries to write to
-        }
-        root_entries[fd_table[fd_index].root_entry].first_db_num
-                = (uint16_t)first_db_num;
-
-        fat_location[0] = (uint16_t) first_db_num;
+int fs_append(int fd, const void *buf, size_t count)
+{
+    FS_LOCK();
+    if (!sb) {
+        return -1;
     }
-    else {
-        free_fat = get_and_set_fat(first_db_num);
-        fat_location[0] = (uint16_t) free_fat;
-    }
-
-    // subsequent data blocks are simply
-    // the value in that fat array location
-    for(int i = 1; i < amnt_data_blocks; i++){
-        // we get the index of what the current one is "pointing" to
-        fat_location[i] = fat_array[fat_block_index].entries[fat_location[i-1]];
-    }
-
-
-    if (amnt_data_blocks == 1 && first_db_num == FAT_EOC) {
-        if (free_fat == 0) {
-            return 0; // cannot write; FAT is completely full
-        }
-        // db_index will be the index of the DB we are writing to
-        size_t db_index = free_fat + sb->root_dir_index;
-        ++db_index; // skip over DB #0
-        // update the first data block num
-        root_entries[fd_table[fd_index].root_entry].first_db_num
-                = (uint16_t) free_fat;
-        block_write(db_index, buf);
-    }
-    // so in here we don't need to create new entries in fat array
-    else if (count + fd_offset <= filesize) {
-        while (offset_data_block != 0) {
-            // This condition is if we just happen to write
-            // all that's left of one block
-            if(count <= BLOCK_SIZE - byte_offset){
-                // in the case we offset to the middle of the block, we gotta
-                // block read, then memcpy it,
-                // then block write back the whole block
-                if (block_read(fat_location[offset_db_index]
-                               + sb->root_dir_index + 1,
-                               bounce_buf) == -1) {
-                    return -1;
-                }
-                memcpy(bounce_buf + byte_offset, buf,
-                       BLOCK_SIZE - byte_offset);
-                block_write(fat_location[offset_db_index]
-                            + sb->root_dir_index + 1, bounce_buf);
-                fd_table[fd_index].offset += count;
-                free(bounce_buf);
-                return (int)count;
-            }
-
-            else {
-                if(byte_offset > 0) {
-                    // finish writing to the remaining block. we read a block,
-                    // modify the block after the offset, then write to it
-                    if (block_read(fat_location[offset_db_index]
-                                   + sb->root_dir_index + 1,
-                                   bounce_buf) == -1) {
-                        return -1;
-                    }
-                    memcpy(bounce_buf + byte_offset, buf,
-                           BLOCK_SIZE - byte_offset);
-                    block_write(fat_location[offset_db_index]
-                                + sb->root_dir_index + 1, bounce_buf);
-                    buf_offset = buf_offset + (BLOCK_SIZE - byte_offset);
-                    multi_count = multi_count - (BLOCK_SIZE - byte_offset);
-                    offset_db_index++;
-                    byte_offset = 0; //we'll never use this again
-                    // if multi_count 0, we just return.
-                    if (multi_count == 0) {
-                        fd_table[fd_index].offset += multi_count;
-                        free(bounce_buf);
-                        return (int)multi_count;
-                    }
-                }
-                    // In here, we just write a whole block
-                else if (multi_count > BLOCK_SIZE) {
-                    // we write bounce_buf to block_write
-                    memcpy(bounce_buf, buf+buf_offset, BLOCK_SIZE);
-                    block_write(fat_location[offset_db_index]
-                                + sb->root_dir_index + 1, bounce_buf);
-                    buf_offset = buf_offset + BLOCK_SIZE;
-                    multi_count = multi_count - BLOCK_SIZE;
-                    offset_db_index++;
-                }
-                else {
-                    // we just write what we can now.
-                    // so take the curernt block,
-                    // change the first few values, then write it back
-                    if (block_read(fat_location[offset_db_index]
-                                   + sb->root_dir_index + 1,
-                                   bounce_buf) == -1) {
-                        return -1;
-                    }
-                    memcpy(bounce_buf, buf+buf_offset, multi_count);
-                    block_write(fat_location[offset_db_index]
-                                + sb->root_dir_index + 1, bounce_buf);
-                    fd_table[fd_index].offset += count;
-                    free(bounce_buf);
-                    return (int) count;
-                }
-            }
-            offset_data_block--;
-        }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return -1;
     }
-    fd_table[fd_index].offset += count;
-    return (int)count;
+    if (count == 0) {
+        return 0;
+    }
+    // the end of the chain is known after the first write that gets
+    // there (see write_file_iov()), so no walk from its start
+    int entry = fd_table[fd_index].root_entry;
+    int written = write_file_data(entry, root_entries[entry].filesize, buf,
+                                  count);
+    if (written >= 0) {
+        fd_table[fd_index].offset = root_entries[entry].filesize;
+    }
+    return written;
 }
 
 int fs_read(int fd, void *buf, size_t count)
 {
+    FS_LOCK();
     if (!sb) {
         return -1;
     }
@@ -627,256 +1404,445 @@ int fs_read(int fd, void *buf, size_t count)
         return -1;
     }
 
-    // array that holds where fat blocks are.
-    uint16_t fat_location[2048];
+    int read = read_file_data(fd_table[fd_index].root_entry,
+                              fd_table[fd_index].offset, buf, count);
+    if (read > 0) {
+        fd_table[fd_index].offset += read;
+    }
+    return read;
+}
+
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset)
+{
+    FS_LOCK();
+    if (!sb || fd < 0) {
+        return -1;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    // same as fs_write(), but the fd's offset stays where it is
+    return write_file_data(fd_table[fd_index].root_entry, offset, buf, count);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    FS_LOCK();
+    if (!sb || fd < 0) {
+        return -1;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return -1;
+    }
+    return read_file_data(fd_table[fd_index].root_entry, offset, buf, count);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    FS_LOCK();
+    if (!sb || fd < 0 || iovcnt < 0) {
+        return -1;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return -1;
+    }
+
+    int written = write_file_iov(fd_table[fd_index].root_entry,
+                                 fd_table[fd_index].offset, iov, iovcnt);
+    if (written > 0) {
+        fd_table[fd_index].offset += written;
+    }
+    return written;
+}
 
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    FS_LOCK();
+    if (!sb || fd < 0 || iovcnt < 0) {
+        return -1;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return -1;
+    }
 
-    // We need to get the amount of data blocks
-    // associated with @filename pointed at by fd_index,
-    // Which is the file size/4096 + 1 (b/c div truncates the result).
-    // Ex. if @filename's filesize was 4097 bytes, then
-    // amnt_data_blocks would be 2.
+    int read = read_file_iov(fd_table[fd_index].root_entry,
+                             fd_table[fd_index].offset, iov, iovcnt);
+    if (read > 0) {
+        fd_table[fd_index].offset += read;
+    }
+    return read;
+}
 
-    // Use fd_offset and filesize variables
-    // because it looks ugly to keep on copy/pasting the RHS.
-    size_t fd_offset = (size_t)fd_table[fd_index].offset;
-    uint32_t filesize = root_entries[fd_table[fd_index].root_entry].filesize;
+const void *fs_map(int fd, size_t offset, size_t length)
+{
+    FS_LOCK();
+    if (!sb || fd < 0 || length == 0) {
+        return NULL;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return NULL;
+    }
+    int entry = fd_table[fd_index].root_entry;
+    struct root *file = &root_entries[entry];
+    if (offset > file->filesize || length > file->filesize - offset) {
+        return NULL;
+    }
 
-    // amnt_data_blocks meaning, the number of data blocks
-    // associated with the file pointed to by fd, depending on the filesize.
-    size_t amnt_data_blocks = (filesize/BLOCK_SIZE) + 1;
-    void *bounce_buf = malloc(BLOCK_SIZE); //used to hold a temp data block.
-    memset(bounce_buf, 0, BLOCK_SIZE);
-    uint32_t bytes_in_file = filesize;
+    struct fs_view *view = malloc(sizeof(struct fs_view));
+    if (!view) {
+        return NULL;
+    }
+    view->base = NULL;
+    view->fd_index = fd_index;
+    uint64_t block = 0; // first block of a direct view
 
-    // db_index describes all the data block indices associated with
-    // the file pointed to by fd. db_index will change values as it
-    // is processed in the loops below. At declaration, db_index will
-    // point to the very first data block associated with the file.
-    size_t db_index
-            = root_entries[fd_table[fd_index].root_entry].first_db_num;
-    ++db_index; // because db counts up from 0
-    db_index = db_index + sb->root_dir_index;
+    // the range can be mapped from the disk image as is if the clusters
+    // holding it follow each other (compressed or packed data never can)
+    if (!(file->flags & (ROOT_COMPRESSED | ROOT_PACKED))) {
+        uint64_t first = offset / sb->cluster_size;
+        uint64_t last = (offset + length - 1) / sb->cluster_size;
+        uint32_t start = fat_walk(file->first_db_num, first);
+        uint32_t cluster = start;
+        for (uint64_t i = first; i < last && cluster != FAT_EOC; ++i) {
+            uint32_t next = fat_get(cluster);
+            cluster = next == cluster + 1 ? next : FAT_EOC;
+        }
 
-    // We now populate our fat_location array.
-    size_t first_db_num
-            = root_entries[fd_table[fd_index].root_entry].first_db_num;
-    size_t first_db_num_cpy = first_db_num; // for the while loop below
-    int fat_block_index = 0; //get which FAT block DB is located in
+        if (cluster != FAT_EOC) {
+            block = sb->data_block_index
+                             + (uint64_t)start * sb->cluster_blocks
+                             + offset % sb->cluster_size / BLOCK_SIZE;
+            size_t skip = offset % BLOCK_SIZE;
+            size_t count = (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            view->base = block_map(block, count);
+            view->len = count;
+            view->addr = (char *)view->base + skip;
+        }
+    }
 
-    // we use a cpy of first_db_num since we don't want to modify
-    // first_db_num itself; we will use first_db_num later
-    if (first_db_num_cpy >= 2048) {
-        while (first_db_num_cpy != 0) {
-            ++fat_block_index;
-            first_db_num_cpy /= 2048;
+    if (view->base) {
+        view->direct = true;
+        // nothing will check the blocks when they are accessed
+        for (size_t i = 0; sb->csums && i < view->len; ++i) {
+            const uint8_t *data = (uint8_t *)view->base + i * BLOCK_SIZE;
+            if (crc32c(0, data, BLOCK_SIZE) != sb->csums[block + i]) {
+                block_unmap(view->base, view->len);
+                free(view);
+                return NULL;
+            }
+        }
+    }
+    else {
+        // fragmented: assemble a private copy
+        view->direct = false;
+        view->len = length;
+        view->base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (view->base == MAP_FAILED) {
+            free(view);
+            return NULL;
         }
+        int read = read_file_data(entry, offset, view->base, length);
+        if (read < 0 || (size_t)read != length
+            || mprotect(view->base, length, PROT_READ) == -1) {
+            munmap(view->base, length);
+            free(view);
+            return NULL;
+        }
+        view->addr = view->base;
     }
 
-    //this is how we get the first data block
-    fat_location[0] = (uint16_t)first_db_num;
+    view->next = views;
+    views = view;
+    return view->addr;
+}
 
-    // subsequent data blocks are simply
-    // the value in that fat array location
-    for(int i = 1; i < amnt_data_blocks; i++){
-        // we get the index of what the current one is "pointing" to
-        fat_location[i] = fat_array[fat_block_index].entries[fat_location[i-1]];
+int fs_unmap(const void *addr)
+{
+    FS_LOCK();
+    if (!sb) {
+        return -1;
+    }
+    struct fs_view **link = &views;
+    while (*link && (*link)->addr != addr) {
+        link = &(*link)->next;
+    }
+    struct fs_view *view = *link;
+    if (!view) {
+        return -1;
     }
+    *link = view->next;
 
-    // these two are if we read in multiple blocks.
-    size_t buf_offset = 0;
-    size_t multi_count = count;
+    int ret;
+    if (view->direct) {
+        ret = block_unmap(view->base, view->len);
+    }
+    else {
+        ret = munmap(view->base, view->len);
+    }
+    free(view);
+    return ret;
+}
 
-    // There should be 3 overarching scenarios here.
-    // Each scenario also changes if the offset of the file > 0.
-    // count == size, count < size, or count > size.
-    // If count == size, we just memcpy everything.
-    // if count > size, we only read up to size.
+int fs_batch_begin(void)
+{
+    FS_LOCK();
+    if (!sb || mount_read_only) {
+        return -1;
+    }
+    // batches don't nest
+    if (batch_active) {
+        return -1;
+    }
+    batch_active = true;
+    batch_count = 0;
+    return 0;
+}
 
-    if (filesize == fd_offset) {
-        return 0;
+int fs_batch_create(const char *filename)
+{
+    FS_LOCK();
+    if (!sb || !batch_active) {
+        return -1;
+    }
+    if (filename_check(filename) == -1) {
+        return -1;
     }
+    return batch_append(BATCH_CREATE, filename, NULL);
+}
 
-    // If the file offset > 0:
-    // Calculate what block to start reading from, and where
-    // in the block to read. Ex. if filesize was 10,000 bytes
-    // and count = 2000, but the offset was 5000, then
-    // block_offset would be 1 and byte_offset would be 4.
-    size_t block_offset = fd_offset/BLOCK_SIZE;
-    size_t byte_offset = fd_offset - (block_offset*BLOCK_SIZE);
-    size_t offset_data_block = amnt_data_blocks - block_offset;
-    size_t offset_db_index = block_offset;
-
-    if (fd_offset != 0) {
-        // we reset bytes_in_file to where it's offset to.
-        // in other words, bytes_in_file from here on will
-        // describe the remaining amount of bytes available
-        // to read from the starting point fd_offset.
-        bytes_in_file = bytes_in_file - (uint32_t)fd_offset;
-
-        while (offset_data_block != 0) {
-            if (buf_offset == count) {
-                break;
-            }
+int fs_batch_delete(const char *filename)
+{
+    FS_LOCK();
+    if (!sb || !batch_active) {
+        return -1;
+    }
+    if (filename_check(filename) == -1) {
+        return -1;
+    }
+    return batch_append(BATCH_DELETE, filename, NULL);
+}
 
-            if (block_read(fat_location[offset_db_index]
-                           + sb->root_dir_index + 1,
-                           bounce_buf) == -1) {
-                return -1;
-            }
-            // Now that we have offset'd all the blocks,
-            // we should offset bytes in the block.
-
-            // This condition is if we just happen to read
-            // all that's left of one block
-            if (count <= BLOCK_SIZE - byte_offset) {
-                if (bytes_in_file > count) {
-                    memcpy(buf + buf_offset,
-                           bounce_buf + byte_offset,multi_count);
-                    fd_table[fd_index].offset += count;
-                    free(bounce_buf);
-                    return (int)count;
-                }
-                else {
-                    memcpy(buf, bounce_buf + byte_offset, bytes_in_file);
-                    fd_table[fd_index].offset += bytes_in_file;
-                    free(bounce_buf);
-                    return (int)bytes_in_file;
-                }
-            }
-            else {
-                // If we've offsetted into middle of block,
-                // finish reading that block
-                if (byte_offset > 0) { //should only run this fxn at most ONCE.
-                    memcpy(buf, bounce_buf + byte_offset,
-                           (BLOCK_SIZE- byte_offset));
-                    buf_offset = buf_offset + (BLOCK_SIZE - byte_offset);
-                    multi_count = multi_count - (BLOCK_SIZE - byte_offset);
-                    offset_db_index++;
-                    byte_offset = 0;
-                    //safe to do this now, since we'll never use it again
-
-                    // if multi_count 0, we just return.
-                    if (multi_count == 0) {
-                        fd_table[fd_index].offset += multi_count;
-                        free(bounce_buf);
-                        return (int)multi_count;
-                    }
-                }
-                    // so if multi_count is still greater than BLOCK_SIZE,
-                    // we just memcpy the whole block into buf.
-                else if(multi_count > BLOCK_SIZE) {
-                    memcpy(buf + buf_offset, bounce_buf, BLOCK_SIZE);
-                    buf_offset = buf_offset + BLOCK_SIZE;
-                    multi_count = multi_count - BLOCK_SIZE;
-                    offset_db_index++;
-                }
-                    // multi_count less than BLOCK_SIZE
-                    // we read what's left of the block.
-                else {
-                    memcpy(buf + buf_offset, bounce_buf, multi_count);
-                    fd_table[fd_index].offset += count;
-                    free(bounce_buf);
-                    return (int)count;
-                }
+int fs_batch_rename(const char *filename, const char *new_filename)
+{
+    FS_LOCK();
+    if (!sb || !batch_active) {
+        return -1;
+    }
+    if (filename_check(filename) == -1
+        || filename_check(new_filename) == -1) {
+        return -1;
+    }
+    return batch_append(BATCH_RENAME, filename, new_filename);
+}
+
+int fs_batch_abort(void)
+{
+    FS_LOCK();
+    if (!sb || !batch_active) {
+        return -1;
+    }
+    batch_active = false;
+    batch_count = 0;
+    free(batch_ops);
+    batch_ops = NULL;
+    batch_capacity = 0;
+    return 0;
+}
+
+int fs_batch_commit(void)
+{
+    FS_LOCK();
+    if (!sb || !batch_active) {
+        return -1;
+    }
+
+    // room for every file the batch creates. Not being able to grow
+    // isn't an error yet, the files the batch deletes may make room.
+    // What the directory and the name heap grow by is given back if
+    // the batch fails.
+    size_t root_clusters_before = root_cluster_count;
+    size_t name_clusters_before = name_cluster_count;
+    size_t create_count = 0;
+    for (size_t i = 0; i < batch_count; ++i) {
+        create_count += batch_ops[i].type == BATCH_CREATE;
+    }
+    while (root_free_count < create_count && root_grow() == 0) {
+    }
+
+    // every operation is first applied to a shadow copy of the root
+    // directory, so a failing operation leaves the real one untouched
+    // and the batch is applied either completely or not at all.
+    struct root *shadow = malloc(root_count * sizeof(struct root));
+    int *free_entries = malloc(root_count * sizeof(int));
+    // the deleted files. Their data is only freed once the whole
+    // batch is known to be valid.
+    struct root *freed_files = malloc((batch_count + 1)
+                                      * sizeof(struct root));
+    size_t freed_count = 0;
+    struct name_index index = { 0 };
+    bool valid = shadow && free_entries && freed_files;
+    // the names the batch adds go at the end of the name heap,
+    // and are dropped from there if it fails
+    size_t heap_used = name_heap_used;
+    size_t heap_garbage = name_heap_garbage;
+
+    // single pass over the directory: index every name, and collect
+    // the free entries (lowest index on top, like fs_create() picks
+    // them). Entries held open by a file descriptor cannot be deleted.
+    int free_count = 0;
+    if (valid) {
+        memcpy(shadow, root_entries, root_count * sizeof(struct root));
+        valid = name_index_build(&index, shadow, root_count) == 0;
+        for (size_t i = root_count; valid && i-- > 0;) {
+            if (shadow[i].filename[0] == '\0') {
+                free_entries[free_count++] = (int)i;
             }
-            offset_data_block--;
-        } // end of while loop
-        if (fd_offset + count > filesize) {
-            fd_table[fd_index].offset += bytes_in_file;
-            free(bounce_buf);
-            return (int)bytes_in_file;
-        }
-        else {
-            fd_table[fd_index].offset += count;
-            free(bounce_buf);
-            return (int)count;
-        }
-    } // end of if
-
-    // so we keep on reading in data blocks into bounce_buf
-    // then we write the bounce_buf into buf,
-    // and then increment the offset for buf.
-    int iterator = 0; //used for iterating thru the fat_location
-    while (amnt_data_blocks != 0) {
-        if (buf_offset == count) {
-            break;
         }
+    }
 
-        if (block_read((fat_location[iterator] + sb->root_dir_index + 1),
-                       bounce_buf) == -1) {
-            free(bounce_buf);
-            return -1;
+    for (size_t i = 0; valid && i < batch_count; ++i) {
+        struct batch_op *op = &batch_ops[i];
+        int entry = name_index_lookup(&index, shadow, op->filename);
+
+        if (op->type == BATCH_CREATE) {
+            // file already exists, or the root directory is full
+            if (entry != -1 || free_count == 0) {
+                valid = false;
+                break;
+            }
+            entry = free_entries[--free_count];
+            memset(&shadow[entry], 0, sizeof(struct root));
+            if (entry_set_name(&shadow[entry], op->filename, false) == -1) {
+                valid = false;
+                break;
+            }
+            shadow[entry].filesize = 0;
+            shadow[entry].first_db_num = FAT_EOC;
+            name_index_insert(&index, shadow, entry);
         }
-        // if count < or = BLOCK_SIZE, we just read in everything to buf.
-        if (count <= BLOCK_SIZE) {
-            if (count > bytes_in_file) {
-                // here is if count > file size.
-                memcpy(buf, bounce_buf, bytes_in_file);
-                fd_table[fd_index].offset +=  bytes_in_file;
-                free(bounce_buf);
-                return (int) bytes_in_file;
+        else if (op->type == BATCH_DELETE) {
+            if (entry == -1 || entry_is_open(entry)) {
+                valid = false;
+                break;
             }
-            else {
-                memcpy(buf, bounce_buf, count);
-                //we modify the offset before returning.
-                fd_table[fd_index].offset += count;
-                free(bounce_buf);
-                return (int)count;
+            if (shadow[entry].first_db_num != FAT_EOC) {
+                freed_files[freed_count++] = shadow[entry];
             }
+            name_index_remove(&index, shadow, entry);
+            entry_clear_name(&shadow[entry]);
+            memset(&shadow[entry], 0, sizeof(struct root));
+            free_entries[free_count++] = entry;
         }
-        // if we're reading in multiple blocks, we write to the offset of
-        // buf each time. We still memcpy the BLOCK_SIZE every time.
-        else {
-            // So multicount is for when the amnt of bytes
-            // to be read is for example 4097, so we read in 4096,
-            // decrement multicount by 4096, then we read in the last
-            // byte in the else statement.
-            if (multi_count > BLOCK_SIZE) {
-                if (multi_count > bytes_in_file
-                    && bytes_in_file < BLOCK_SIZE) {
-                    // here, we've read the maximum amount of blocks
-                    // we then read what we can of the last block,
-                    // and then finally return.
-                    memcpy(buf+buf_offset, bounce_buf, bytes_in_file);
-                    buf_offset = buf_offset + bytes_in_file;
-                    fd_table[fd_index].offset += filesize;
-                    free(bounce_buf);
-                    return (int)filesize;
-                }
-                else {
-                    memcpy(buf+buf_offset, bounce_buf, BLOCK_SIZE);
-                    buf_offset = buf_offset + BLOCK_SIZE;
-                    multi_count = multi_count - BLOCK_SIZE;
-                    bytes_in_file = bytes_in_file - BLOCK_SIZE;
-                    db_index++;
-                }
+        else { // BATCH_RENAME
+            if (entry == -1
+                || name_index_lookup(&index, shadow,
+                                     op->new_filename) != -1) {
+                valid = false;
+                break;
             }
-            else {
-                // There are basically two scenarios here.
-                // if multi count is the limiter,
-                // or if filesize is the limiter.
-                if (multi_count < bytes_in_file) {
-                    memcpy(buf+buf_offset, bounce_buf, multi_count);
-                    buf_offset = buf_offset + multi_count;
-                    db_index++;
-                }
-                else if (bytes_in_file <= multi_count) {
-                    memcpy(buf+buf_offset, bounce_buf, bytes_in_file);
-                    fd_table[fd_index].offset += filesize;
-                    free(bounce_buf);
-                    return (int)filesize;
-                }
+            name_index_remove(&index, shadow, entry);
+            entry_clear_name(&shadow[entry]);
+            if (entry_set_name(&shadow[entry], op->new_filename,
+                               false) == -1) {
+                valid = false;
+                break;
             }
+            name_index_insert(&index, shadow, entry);
         }
-        --amnt_data_blocks;
-        iterator++;
-    } // end of while loop
+    }
 
-    // we modify the offset before returning.
-    fd_table[fd_index].offset += count;
-    free(bounce_buf);
-    return (int)count;
+    if (!valid) {
+        name_heap_used = heap_used;
+        name_heap_garbage = heap_garbage;
+        name_heap_shrink(name_clusters_before);
+        root_shrink(root_clusters_before);
+        free(shadow);
+        free(free_entries);
+        free(freed_files);
+        name_index_free(&index);
+        return -1;
+    }
+
+    // the batch is valid: apply the directory and FAT changes,
+    // the index built over the shadow being the directory's now
+    memcpy(root_entries, shadow, root_count * sizeof(struct root));
+    name_index_free(&root_index);
+    root_index = index;
+    root_free_count = (size_t)free_count;
+    root_free_hint = 0;
+    for (size_t i = 0; i < root_count; i += ROOT_BLOCK_ENTRIES) {
+        root_mark_dirty(i);
+    }
+    ++dir_version;
+    for (size_t i = 0; i < freed_count; ++i) {
+        free_file_data(&freed_files[i]);
+    }
+    free(shadow);
+    free(free_entries);
+    free(freed_files);
+
+    fs_batch_abort(); // done with the recorded operations
+
+    // and write all the metadata back in one go (or, with a
+    // journal, commit it as a single transaction)
+    return journal_active ? journal_commit() : flush_metadata(false);
+}
+
+int fs_compress_stats(struct fs_compress_stats *stats)
+{
+    FS_LOCK();
+    if (!sb || !stats) {
+        return -1;
+    }
+    *stats = compress_stats;
+    return 0;
+}
+
+struct fs_request *fs_read_async(int fd, void *buf, size_t count,
+                                 fs_callback_t callback, void *arg)
+{
+    return async_submit(ASYNC_READ, fd, buf, count, callback, arg);
+}
+
+struct fs_request *fs_write_async(int fd, const void *buf, size_t count,
+                                  fs_callback_t callback, void *arg)
+{
+    return async_submit(ASYNC_WRITE, fd, (void *)buf, count, callback, arg);
+}
+
+int fs_poll(struct fs_request *req)
+{
+    if (!req) {
+        return -1;
+    }
+    pthread_mutex_lock(&async_lock);
+    bool done = req->done;
+    pthread_mutex_unlock(&async_lock);
+    return done;
+}
+
+int fs_wait(struct fs_request *req)
+{
+    if (!req) {
+        return -1;
+    }
+    pthread_mutex_lock(&async_lock);
+    while (!req->done) {
+        pthread_cond_wait(&async_done, &async_lock);
+    }
+    int result = req->result;
+    pthread_mutex_unlock(&async_lock);
+    free(req);
+    return result;
 }
 
 /* HELPER FUNCTIONS */
@@ -885,13 +1851,7 @@ int fs_read(int fd, void *buf, size_t count)
  // Return: -1 if filename was not found in the root entries.
  // Otherwise return 0 to indicate file was found.
 int file_search(const char* filename) {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (strncmp( (char*)root_entries[i].filename,
-                     filename, FS_FILENAME_LEN ) == 0) {
-            return 0; // found a match
-        }
-    }
-    return -1; // fail state: could not find file
+    return get_root_entry(filename) == -1 ? -1 : 0;
 }
 
  // Find a file named @filename that exists inside the root entries.
@@ -899,13 +1859,7 @@ int file_search(const char* filename) {
  // Otherwise return the root entry index of where @filename
  // was located in.
 int get_root_entry(const char* filename) {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (strncmp( (char*)root_entries[i].filename,
-                     filename, FS_FILENAME_LEN ) == 0) {
-            return i; // found a match
-        }
-    }
-    return -1; // fail state: could not find file
+    return name_index_lookup(&root_index, root_entries, filename);
 }
 
 
@@ -913,116 +1867,3898 @@ int get_root_entry(const char* filename) {
  // Find a file descriptor named @fd that exists inside
  // the fd table array.
 
- // Return: -1 if @fd was not found in the fd table.
- // Otherwise return the index of where @fd was
- // found in the fd table.
-int get_fd_table_index(int fd) {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-        if (fd_table[i].id == fd) {
-            return i; // found index
-        }
+// takes the library lock, creating it first if needed.
+// Return: the depth of the lock (1 for the outermost call), as the
+// initial value of the FS_LOCK() guard.
+int fs_lock_take(void) {
+    pthread_once(&fs_lock_once, fs_lock_init);
+    pthread_mutex_lock(&fs_lock);
+    return ++fs_lock_depth;
+}
+
+// releases the library lock when an FS_LOCK() guard goes out of scope.
+// The outermost call then commits the journal if it is due.
+void fs_unlock(int *guard) {
+    uint64_t sequence = *guard == 1 ? journal_due() : 0;
+    --fs_lock_depth;
+    pthread_mutex_unlock(&fs_lock);
+    if (sequence) {
+        journal_wait(sequence);
     }
-    return -1; // fail state: could not find opened fd
 }
 
-// sets the FAT entry for a file that is only 1 data block big.
-// returns 0 if it reaches the complete end of the double for loops,
-// meaning no more free fat entries available.
-size_t get_and_set_fat(size_t first_db_num) {
-    for (int i = 0; i < sb->total_fat_blocks; ++i) {
-        for (int j = 0; j < 2048; ++j) { // 2048 entries per FAT block
+void fs_lock_init(void) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
-            if (first_db_num != FAT_EOC
-                && fat_array[i].entries[first_db_num] == FAT_EOC) {
-                return first_db_num;
-            }
+// queues an fs_read() (@op is ASYNC_READ) or fs_write() of @count bytes
+// of @buf on @fd, starting the worker threads if they aren't yet.
+// returns NULL if no disk is mounted, if @fd is not open, or if the
+// request cannot be allocated or no worker can be started.
+struct fs_request *async_submit(int op, int fd, void *buf, size_t count,
+                                fs_callback_t callback, void *arg) {
+    FS_LOCK();
+    if (!sb || fd < 0) {
+        return NULL;
+    }
+    int fd_index = get_fd_table_index(fd);
+    if (fd_index == -1) {
+        return NULL;
+    }
+    struct fs_request *req = calloc(1, sizeof(struct fs_request));
+    if (!req) {
+        return NULL;
+    }
+    req->op = op;
+    req->fd = fd;
+    req->buf = buf;
+    req->count = count;
+    req->callback = callback;
+    req->arg = arg;
 
-            if (fat_array[i].entries[j] == first_db_num
-                    && first_db_num != FAT_EOC) {
-                return first_db_num;
-            }
+    pthread_mutex_lock(&async_lock);
+    while (async_worker_count < ASYNC_WORKERS
+           && pthread_create(&async_workers[async_worker_count], NULL,
+                             async_worker, NULL) == 0) {
+        ++async_worker_count;
+    }
+    if (async_worker_count == 0) {
+        pthread_mutex_unlock(&async_lock);
+        free(req);
+        return NULL;
+    }
+    if (async_queue_tail) {
+        async_queue_tail->next = req;
+    }
+    else {
+        async_queue = req;
+    }
+    async_queue_tail = req;
+    ++fd_table[fd_index].async_pending;
+    ++async_total;
+    pthread_cond_signal(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    return req;
+}
 
-            if (fat_array[i].entries[j] == 0) {
-                // assign the file less than 4096 bytes
-                // to a singular, proper FAT entry, and set that
-                // to 0xFFFF.
-                fat_array[i].entries[j] = FAT_EOC;
-                return (size_t)j;
+// body of the worker threads: performs the oldest queued request whose
+// fd has no request being performed (so that the requests of an fd are
+// performed in order), until async_shutdown() says to stop.
+void *async_worker(void *unused) {
+    pthread_mutex_lock(&async_lock);
+    while (true) {
+        struct fs_request *req = async_queue, *prev = NULL;
+        while (req && fd_table[req->fd].async_running) {
+            prev = req;
+            req = req->next;
+        }
+        if (!req) {
+            if (async_stop) {
+                break;
             }
-        } // end of j loop
-    } // end of i loop
+            pthread_cond_wait(&async_work, &async_lock);
+            continue;
+        }
+        if (prev) {
+            prev->next = req->next;
+        }
+        else {
+            async_queue = req->next;
+        }
+        if (async_queue_tail == req) {
+            async_queue_tail = prev;
+        }
+        int fd = req->fd;
+        fd_table[fd].async_running = true;
+        pthread_mutex_unlock(&async_lock);
 
-    return 0; // no free fat_entries available
-    // => no free data blocks available.
+        int result = req->op == ASYNC_READ
+                     ? fs_read(fd, req->buf, req->count)
+                     : fs_write(fd, req->buf, req->count);
+
+        // the callback may close the fd, but the next request
+        // of the fd waits for it to return
+        pthread_mutex_lock(&async_lock);
+        --fd_table[fd].async_pending;
+        if (req->callback) {
+            pthread_mutex_unlock(&async_lock);
+            req->callback(req, result, req->arg);
+            free(req);
+            pthread_mutex_lock(&async_lock);
+        }
+        else {
+            req->result = result;
+            req->done = true;
+        }
+        fd_table[fd].async_running = false;
+        --async_total;
+        pthread_cond_broadcast(&async_done);
+        pthread_cond_broadcast(&async_work);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
 }
 
-// if the file has n data blocks associated,
-// we use this function to assign n FAT entries
-int set_multi_fat (size_t *first_db_num, size_t offset_data_block) {
+// Return: 1 if the fd at @fd_index has asynchronous
+// requests that aren't performed yet. 0 otherwise.
+int async_fd_pending(int fd_index) {
+    pthread_mutex_lock(&async_lock);
+    int pending = fd_table[fd_index].async_pending > 0;
+    pthread_mutex_unlock(&async_lock);
+    return pending;
+}
 
-    int free_entry_check = 0;
-    for (int i = 0; i < sb->total_fat_blocks; ++i) {
-        if (offset_data_block == 0) {
-            break;
+// Return: the number of views mapped through the fd at @fd_index.
+int view_count(int fd_index) {
+    int count = 0;
+    for (struct fs_view *view = views; view; view = view->next) {
+        if (view->fd_index == fd_index) {
+            ++count;
         }
+    }
+    return count;
+}
 
-        for (int j = 0; j < 2048; ++j) {
-            if (fat_array[i].entries[j] == 0) {
-                // case where we have contiguous free FAT entries
-                if (fat_array[i].entries[j + 1] == 0) {
-                    fat_array[i].entries[j] = (uint16_t) (j+1);
+// stops the worker threads, if there are any.
+// Return: -1 if some requests aren't done yet. 0 otherwise.
+int async_shutdown(void) {
+    pthread_mutex_lock(&async_lock);
+    if (async_total > 0) {
+        pthread_mutex_unlock(&async_lock);
+        return -1;
+    }
+    async_stop = true;
+    pthread_cond_broadcast(&async_work);
+    pthread_mutex_unlock(&async_lock);
 
-                    // means first_db_num hasn't been set yet
-                    if (*first_db_num == FAT_EOC) {
-                        // only enters here once
-                        *first_db_num = (size_t)j;
-                    }
+    for (int i = 0; i < async_worker_count; ++i) {
+        pthread_join(async_workers[i], NULL);
+    }
+    async_worker_count = 0;
+    async_stop = false;
+    return 0;
+}
 
-                    offset_data_block--;
-                }
-                else {
-                    // non-contiguous case
-                    // need some helper function to iterate from
-                    // where we are now until it finds the next
-                    // free fat entry. Then store this in free_entry_check.
-                    free_entry_check = get_next_fat(i, j+1);
-                    if (free_entry_check == -1) {
-                        return -1; // no more free entries
-                    }
-                    fat_array[i].entries[j] = (uint16_t)free_entry_check;
-
-                    // means first_db_num hasn't been set yet
-                    if (*first_db_num == FAT_EOC) {
-                        // only enters here once
-                        *first_db_num = (size_t)j;
-                    }
-
-                    // update j so we don't iterate through unnecessary
-                    // entries (any entry before get_next_fat() )
-                    j = fat_array[i].entries[j] - 1;
-                    --offset_data_block;
-                }
-            }
-            // the last entry should be set to 0xFFFF
-            if (offset_data_block == 0) {
-                fat_array[i].entries[j] = FAT_EOC;
-                break;
-            }
-        } // j loop end
-    } // i loop end
-    return 0; // success condition
-}
-
-// finds the next free fat entry. The first
-// one the function finds, it returns.
-int get_next_fat(int updated_i, int updated_j) {
-    for (int i = updated_i; i < sb->total_fat_blocks; ++i) {
-        for (int j = updated_j; j < 2048; ++j) {
-            if (fat_array[i].entries[j] == 0) {
-                return (uint16_t)j;
-            }
+// Return: -1 if @fd is not an open fd. Otherwise return
+// the index of @fd in the fd table (which is @fd itself).
+int get_fd_table_index(int fd) {
+    if (fd < 0 || fd >= fd_capacity || fd_table[fd].id != fd) {
+        return -1; // fail state: could not find opened fd
+    }
+    return fd;
+}
+
+// takes an entry off the free list of the fd table, doubling the
+// table first if there is none left (up to FS_OPEN_MAX_COUNT).
+// Return: -1 if no fd can be allocated. Otherwise its index.
+int fd_alloc(void) {
+    if (fd_free_head == -1) {
+        if (fd_capacity >= FS_OPEN_MAX_COUNT) {
+            return -1;
+        }
+        int capacity = fd_capacity ? 2 * fd_capacity : 32;
+        if (capacity > FS_OPEN_MAX_COUNT) {
+            capacity = FS_OPEN_MAX_COUNT;
+        }
+        // the workers may be looking at the table
+        pthread_mutex_lock(&async_lock);
+        struct fd *table = realloc(fd_table, capacity * sizeof(struct fd));
+        if (table) {
+            fd_table = table;
+        }
+        pthread_mutex_unlock(&async_lock);
+        if (!table) {
+            return -1;
         }
+        // the new entries go on the free list, lowest first
+        for (int i = capacity - 1; i >= fd_capacity; --i) {
+            memset(&fd_table[i], 0, sizeof(struct fd));
+            fd_table[i].id = -1;
+            fd_table[i].next_free = fd_free_head;
+            fd_free_head = i;
+        }
+        fd_capacity = capacity;
     }
-    return -1; // no free fat_entries available
-    // => no free data blocks available.
+    int fd_index = fd_free_head;
+    fd_free_head = fd_table[fd_index].next_free;
+    ++fd_open_count;
+    return fd_index;
+}
+
+// puts the fd at @fd_index back on the free list.
+void fd_release(int fd_index) {
+    fd_table[fd_index].id = -1;
+    fd_table[fd_index].next_free = fd_free_head;
+    fd_free_head = fd_index;
+    --fd_open_count;
+}
+
+// sets up the FAT cache for the superblock in sb, either with every
+// block in memory (zeroed, for the caller to fill) or with none.
+// Return: -1 if there is not enough memory. 0 otherwise.
+int fat_cache_init(bool lazy) {
+    fat_cache = calloc(sb->total_fat_blocks, sizeof(struct fat_slot));
+    if (!fat_cache) {
+        return -1;
+    }
+    fat_resident = 0;
+    fat_clock = 0;
+    if (lazy) {
+        return 0;
+    }
+    fat_slab = block_buf_get(sb->total_fat_blocks);
+    if (!fat_slab) {
+        return -1;
+    }
+    memset(fat_slab, 0, sb->total_fat_blocks * sizeof(union fat_block));
+    for (size_t i = 0; i < sb->total_fat_blocks; ++i) {
+        fat_cache[i].block = &fat_slab[i];
+    }
+    return 0;
+}
+
+// frees the FAT cache, dirty blocks included.
+void fat_cache_free(void) {
+    if (fat_cache && !fat_slab) {
+        for (size_t i = 0; i < sb->total_fat_blocks; ++i) {
+            block_buf_put(fat_cache[i].block, 1);
+        }
+    }
+    free(fat_cache);
+    if (fat_slab) {
+        block_buf_put(fat_slab, sb->total_fat_blocks);
+    }
+    fat_cache = NULL;
+    fat_slab = NULL;
+}
+
+// gets FAT block @index in memory, reading it from disk if needed.
+// Return: NULL if the block doesn't exist or cannot be read (its
+// entries then read as the end of a chain, and cannot be set).
+// Otherwise the block, valid until the next call.
+union fat_block *fat_block_get(size_t index) {
+    if (index >= sb->total_fat_blocks) {
+        return NULL;
+    }
+    struct fat_slot *slot = &fat_cache[index];
+    if (!slot->block) {
+        if (fat_cache_max && fat_resident >= fat_cache_max) {
+            fat_block_evict();
+        }
+        slot->block = block_buf_get(1);
+        if (!slot->block || checked_read(index + 1, 1, slot->block) == -1) {
+            block_buf_put(slot->block, 1);
+            slot->block = NULL;
+            return NULL;
+        }
+        ++fat_resident;
+    }
+    slot->referenced = true;
+    return slot->block;
+}
+
+// drops a FAT block paged in by a lazy mount from memory, the first one
+// the clock hand finds without its referenced bit (clearing the bits of
+// those it goes by). Dirty blocks are written back first, and stay if
+// that fails. With a journal they always stay: the changes they hold
+// can only reach their place on disk once they are committed, at the
+// next checkpoint.
+void fat_block_evict(void) {
+    for (size_t i = 0; i < 2 * (size_t)sb->total_fat_blocks; ++i) {
+        struct fat_slot *slot = &fat_cache[fat_clock];
+        fat_clock = (fat_clock + 1) % sb->total_fat_blocks;
+        if (!slot->block) {
+            continue;
+        }
+        if (slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+        size_t index = slot - fat_cache;
+        if (slot->dirty && journal_active) {
+            continue;
+        }
+        if (slot->dirty) {
+            if (checked_write(index + 1, 1, slot->block) == -1) {
+                continue;
+            }
+            slot->dirty = false;
+        }
+        block_buf_put(slot->block, 1);
+        slot->block = NULL;
+        --fat_resident;
+        return;
+    }
+}
+
+// writes the dirty FAT blocks back, consecutive ones in a single
+// I/O when they follow each other in memory too (in fat_slab).
+// Return: -1 if a block cannot be written. 0 otherwise.
+int fat_cache_flush(void) {
+    size_t i = 0;
+    while (i < sb->total_fat_blocks) {
+        if (!fat_cache[i].dirty) {
+            ++i;
+            continue;
+        }
+        size_t run = 1;
+        while (fat_slab && i + run < sb->total_fat_blocks
+               && fat_cache[i + run].dirty) {
+            ++run;
+        }
+        if (checked_write(i + 1, run, fat_cache[i].block) == -1) {
+            return -1;
+        }
+        for (size_t j = i; j < i + run; ++j) {
+            fat_cache[j].dirty = false;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// reads FAT entry @entry, whatever the width of the on-disk
+// entries is. The end of a chain always reads as FAT_EOC.
+uint32_t fat_get(size_t entry) {
+    if (sb->fat32) {
+        union fat_block *block = fat_block_get(entry / FAT32_ENTRIES);
+        return block ? block->entries32[entry % FAT32_ENTRIES] : FAT_EOC;
+    }
+    union fat_block *block = fat_block_get(entry / FAT16_ENTRIES);
+    uint16_t value = block ? block->entries[entry % FAT16_ENTRIES]
+                           : FAT16_EOC;
+    return value == FAT16_EOC ? FAT_EOC : value;
+}
+
+// sets FAT entry @entry to @value (FAT_EOC to end a chain), logging
+// the change if there is a journal.
+void fat_set(size_t entry, uint32_t value) {
+    if (journal_active) {
+        journal_put(JOURNAL_FAT, entry, &value, 1);
+    }
+    fat_store(entry, value);
+}
+
+// same as fat_set(), without logging anything.
+void fat_store(size_t entry, uint32_t value) {
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    union fat_block *block = fat_block_get(entry / per_block);
+    if (!block) {
+        return;
+    }
+    fat_cache[entry / per_block].dirty = true;
+
+    // a cluster being freed or taken changes the free counts
+    uint32_t old = sb->fat32 ? block->entries32[entry % per_block]
+                             : block->entries[entry % per_block];
+    if (fat_group_free && (old == 0) != (value == 0)) {
+        size_t group = entry / per_block / fat_group_blocks;
+        if (value == 0) {
+            ++fat_group_free[group];
+            ++fat_free_count;
+        }
+        else {
+            --fat_group_free[group];
+            --fat_free_count;
+        }
+    }
+
+    if (sb->fat32) {
+        block->entries32[entry % FAT32_ENTRIES] = value;
+        return;
+    }
+    block->entries[entry % FAT16_ENTRIES] =
+            value == FAT_EOC ? FAT16_EOC : (uint16_t)value;
+}
+
+// lays out the groups of FAT blocks that free clusters are counted
+// by, as many as the summary has room for in the superblock.
+// Return: -1 if there is not enough memory. 0 otherwise.
+int fat_groups_init(void) {
+    size_t room = sb->fat32 ? sizeof(((struct superblock32 *)0)->padding)
+                            : sizeof(((struct superblock16 *)0)->padding);
+    size_t max_groups = (room - sizeof(struct sb_summary)) / sizeof(uint32_t);
+    fat_group_blocks = (sb->total_fat_blocks + max_groups - 1) / max_groups;
+    fat_group_count = (sb->total_fat_blocks + fat_group_blocks - 1)
+                      / fat_group_blocks;
+    fat_group_free = calloc(fat_group_count, sizeof(uint32_t));
+    return fat_group_free ? 0 : -1;
+}
+
+// Return: where the summary lives in the superblock.
+static struct sb_summary *summary_get(void) {
+    return (struct sb_summary *)(sb->raw + (sb->fat32
+            ? offsetof(struct superblock32, padding)
+            : offsetof(struct superblock16, padding)));
+}
+
+// Return: the CRC32C of the summary in the superblock, whose
+// crc field has to be 0.
+static uint32_t summary_crc(struct sb_summary *summary) {
+    return crc32c(0, summary, sizeof(struct sb_summary)
+                              + fat_group_count * sizeof(uint32_t));
+}
+
+// takes the free counts from the summary in the superblock, which has
+// to have been written by an unmount, and match the FAT and root
+// directory layouts.
+// Return: -1 if the summary cannot be trusted. 0 otherwise.
+int summary_load(void) {
+    struct sb_summary *summary = summary_get();
+    if (summary->magic != SUMMARY_MAGIC
+        || summary->version != SUMMARY_VERSION || !summary->clean
+        || summary->group_blocks != fat_group_blocks
+        || summary->group_count != fat_group_count
+        || summary->free_clusters > sb->total_clusters) {
+        return -1;
+    }
+    uint32_t crc = summary->crc;
+    summary->crc = 0;
+    bool valid = summary_crc(summary) == crc;
+    summary->crc = crc;
+    if (!valid) {
+        return -1;
+    }
+
+    // the root directory is in memory already, as a cross-check
+    uint32_t free_root_entries = (uint32_t)root_free_count;
+    uint64_t free_clusters = 0;
+    for (size_t i = 0; i < fat_group_count; ++i) {
+        free_clusters += summary->group_free[i];
+    }
+    if (free_root_entries != summary->free_root_entries
+        || free_clusters != summary->free_clusters) {
+        return -1;
+    }
+
+    memcpy(fat_group_free, summary->group_free,
+           fat_group_count * sizeof(uint32_t));
+    fat_free_count = free_clusters;
+    return 0;
+}
+
+// counts the free clusters from the FAT itself, reading all of it.
+// A FAT block that cannot be read counts as full.
+void summary_rebuild(void) {
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    memset(fat_group_free, 0, fat_group_count * sizeof(uint32_t));
+    fat_free_count = 0;
+    for (size_t first = 0; first < sb->total_clusters; first += per_block) {
+        size_t count = sb->total_clusters - first < per_block
+                       ? sb->total_clusters - first : per_block;
+        union fat_block *block = fat_block_get(first / per_block);
+        if (!block) {
+            continue;
+        }
+        size_t free = count - (sb->fat32
+                ? fat_scan()->count_nonzero32(block->entries32, count)
+                : fat_scan()->count_nonzero16(block->entries, count));
+        fat_group_free[first / per_block / fat_group_blocks] += free;
+        fat_free_count += free;
+    }
+}
+
+// writes the free counts to the summary in the superblock (in memory),
+// marking it as @clean or not.
+void summary_store(bool clean) {
+    struct sb_summary *summary = summary_get();
+    summary->magic = SUMMARY_MAGIC;
+    summary->version = SUMMARY_VERSION;
+    summary->clean = clean;
+    summary->reserved = 0;
+    summary->free_root_entries = (uint32_t)root_free_count;
+    summary->free_clusters = fat_free_count;
+    summary->group_blocks = (uint32_t)fat_group_blocks;
+    summary->group_count = (uint32_t)fat_group_count;
+    memcpy(summary->group_free, fat_group_free,
+           fat_group_count * sizeof(uint32_t));
+    summary->crc = 0;
+    summary->crc = summary_crc(summary);
+}
+
+// finds a free FAT entry for a single data block, marks it
+// as the end of a chain and links it after @last_db_num
+// (unless @last_db_num is FAT_EOC, i.e. the chain is empty).
+// returns 0 if no more free fat entries are available.
+size_t get_and_set_fat(size_t last_db_num) {
+    size_t free_fat = 0;
+    if (set_multi_fat(last_db_num, 1, &free_fat) == 0) {
+        return 0; // no free fat_entries available
+    }
+    return free_fat;
+}
+
+// if the file needs n more data blocks, we use this function
+// to assign up to n free FAT entries, chained after @last_db_num
+// (or as a new chain if @last_db_num is FAT_EOC). They go where
+// the allocation policy says (see alloc_find()), one run of
+// contiguous entries at a time.
+// @first_new receives the first entry that was assigned, and
+// the last one is set to FAT_EOC.
+// returns how many entries were actually assigned, which is less
+// than @count if the FAT runs out of free entries.
+size_t set_multi_fat(size_t last_db_num, size_t count, size_t *first_new) {
+    size_t assigned = 0;
+    bool scattered = false;
+
+    while (assigned < count) {
+        size_t first_free = get_next_fat(fat_free_hint);
+        // the clusters freed since the last commit come back with the
+        // next, as long as none were assigned (they would be committed
+        // past the end of their file)
+        if (first_free == 0 && assigned == 0 && journal_freed_count > 0
+            && journal_commit() == 0) {
+            first_free = get_next_fat(fat_free_hint);
+        }
+        if (first_free == 0) {
+            break;
+        }
+        fat_free_hint = first_free;
+
+        size_t len = 0;
+        size_t cur_entry = alloc_find(last_db_num, first_free,
+                                      count - assigned, &scattered, &len);
+        for (size_t i = 0; i < len; ++i, ++cur_entry) {
+            fat_set(cur_entry, FAT_EOC);
+            if (last_db_num != FAT_EOC) {
+                fat_set(last_db_num, (uint32_t)cur_entry);
+            }
+            if (assigned == 0) {
+                *first_new = cur_entry; // only enters here once
+            }
+            last_db_num = cur_entry;
+            ++assigned;
+        }
+
+        // everything before cur_entry is in use now, unless
+        // free entries were skipped to get to the run
+        if (cur_entry - len == fat_free_hint) {
+            fat_free_hint = cur_entry;
+        }
+        alloc_cursor = cur_entry;
+    }
+    return assigned;
+}
+
+// picks where up to @want entries go after @last, the end of the chain
+// (FAT_EOC for a new one), given the first free entry @first_free:
+// - first fit: from @first_free;
+// - next fit: from alloc_cursor;
+// - goal: right after @last if that entry is free, otherwise (and for
+//   a new chain) from the group with the most free entries, where the
+//   file has room to grow without running into others;
+// - best fit: in the smallest run that holds them all, or the longest.
+// From where the search starts, the first run of @want free entries is
+// taken, or failing that the first free entry and those right after it.
+// The search wraps around to @first_free at the end of the FAT. Once
+// no run is long enough, *@scattered tells the next calls not to look
+// for one again (they would scan the whole FAT for nothing).
+// Return: the first entry of a run of free entries, whose length goes
+// in @len (from 1 to @want).
+size_t alloc_find(size_t last, size_t first_free, size_t want,
+                  bool *scattered, size_t *len) {
+    size_t from = first_free;
+    switch (alloc_policy) {
+    case FS_ALLOC_NEXT_FIT:
+        from = alloc_cursor;
+        break;
+    case FS_ALLOC_GOAL:
+        if (last != FAT_EOC && last + 1 < sb->total_clusters
+            && fat_get(last + 1) == 0) {
+            *len = free_run_length(last + 1, want);
+            return last + 1;
+        }
+        from = alloc_group_goal();
+        break;
+    case FS_ALLOC_BEST_FIT:
+        if (!*scattered) {
+            size_t run = get_best_run(want, len);
+            *scattered = *len < want;
+            return run;
+        }
+        break;
+    default:
+        break;
+    }
+
+    size_t start = from > first_free ? get_next_fat(from) : 0;
+    if (start == 0) {
+        start = first_free;
+    }
+    if (!*scattered && want > 1) {
+        size_t run = get_free_run(start, want);
+        if (run == 0 && start != first_free) {
+            run = get_free_run(first_free, want);
+        }
+        if (run != 0) {
+            *len = want;
+            return run;
+        }
+        *scattered = true;
+    }
+    *len = free_run_length(start, want);
+    return start;
+}
+
+// Return: where new chains start with the goal policy, the first entry
+// of the group of FAT blocks with the most free entries (the first of
+// them, so that an empty disk still fills from the start).
+size_t alloc_group_goal(void) {
+    size_t best = 0;
+    for (size_t i = 1; i < fat_group_count; ++i) {
+        if (fat_group_free[i] > fat_group_free[best]) {
+            best = i;
+        }
+    }
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    return best ? best * fat_group_blocks * per_block : 1;
+}
+
+// finds the next free fat entry, starting at entry @entry.
+// The first one the function finds, it returns.
+// returns 0 if there is none (entry 0 is never free).
+size_t get_next_fat(size_t entry) {
+    // one FAT block at a time, skipping the groups of them that
+    // are full and those that cannot be read
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    while (entry < sb->total_clusters) {
+        size_t group = entry / per_block / fat_group_blocks;
+        if (fat_group_free[group] == 0) {
+            entry = (group + 1) * fat_group_blocks * per_block;
+            continue;
+        }
+        size_t end = (entry / per_block + 1) * per_block;
+        if (end > sb->total_clusters) {
+            end = sb->total_clusters;
+        }
+        union fat_block *block = fat_block_get(entry / per_block);
+        if (block) {
+            size_t first = entry % per_block;
+            size_t count = end - entry;
+            size_t i = sb->fat32
+                    ? fat_scan()->find_zero32(block->entries32 + first, count)
+                    : fat_scan()->find_zero16(block->entries + first, count);
+            if (i < count) {
+                return entry + i;
+            }
+        }
+        entry = end;
+    }
+    return 0; // no free fat_entries available
+    // => no free data blocks available.
+}
+
+// finds the first run of @count free fat entries in a row,
+// starting at entry @entry, and returns its first entry.
+// returns 0 if there is none.
+size_t get_free_run(size_t entry, size_t count) {
+    if (entry == 0) {
+        return 0;
+    }
+    // one FAT block at a time: @carry free entries end the blocks
+    // before, from @run_start, and may start a run that goes on
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    size_t carry = 0;
+    size_t run_start = 0;
+    while (entry < sb->total_clusters) {
+        // no run goes through a full group
+        size_t group = entry / per_block / fat_group_blocks;
+        if (fat_group_free[group] == 0) {
+            entry = (group + 1) * fat_group_blocks * per_block;
+            carry = 0;
+            continue;
+        }
+        size_t end = (entry / per_block + 1) * per_block;
+        if (end > sb->total_clusters) {
+            end = sb->total_clusters;
+        }
+        if (carry > 0) {
+            while (entry < end && carry < count && fat_get(entry) == 0) {
+                ++carry;
+                ++entry;
+            }
+            if (carry == count) {
+                return run_start;
+            }
+            if (entry == end) {
+                continue;
+            }
+            carry = 0;
+        }
+
+        union fat_block *block = fat_block_get(entry / per_block);
+        if (block) {
+            size_t first = entry % per_block;
+            size_t total = end - entry;
+            size_t i = sb->fat32
+                    ? fat_scan()->find_zero_run32(block->entries32 + first,
+                                                  total, count)
+                    : fat_scan()->find_zero_run16(block->entries + first,
+                                                  total, count);
+            if (i < total) {
+                return entry + i;
+            }
+            while (carry < total && carry < count
+                   && fat_get(end - 1 - carry) == 0) {
+                ++carry;
+            }
+            run_start = end - carry;
+        }
+        entry = end;
+    }
+    return 0;
+}
+
+// counts the free fat entries in a row from entry @entry on, up to
+// @max. FAT blocks with no entry in use are counted in one go.
+size_t free_run_length(size_t entry, size_t max) {
+    size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    size_t len = 0;
+    while (len < max && entry + len < sb->total_clusters) {
+        size_t cur = entry + len;
+        if (cur % per_block == 0) {
+            size_t count = sb->total_clusters - cur < per_block
+                           ? sb->total_clusters - cur : per_block;
+            union fat_block *block = fat_block_get(cur / per_block);
+            if (block && (sb->fat32
+                    ? fat_scan()->count_nonzero32(block->entries32, count)
+                    : fat_scan()->count_nonzero16(block->entries, count))
+                         == 0) {
+                len += count;
+                continue;
+            }
+        }
+        if (fat_get(cur) != 0) {
+            break;
+        }
+        ++len;
+    }
+    return len < max ? len : max;
+}
+
+// finds the smallest run of at least @count free fat entries in a row
+// (the first of them if several have the same length), or failing that
+// the longest run. The whole FAT is scanned, unless a run of exactly
+// @count turns up.
+// Return: the first entry of the run, whose length (at most @count)
+// goes in @len. 0 if no entry is free.
+size_t get_best_run(size_t count, size_t *len) {
+    size_t best = 0;
+    size_t best_len = 0;
+    size_t entry = get_next_fat(fat_free_hint);
+    while (entry != 0) {
+        size_t run = free_run_length(entry, SIZE_MAX);
+        bool better = best_len < count ? run > best_len
+                                       : run >= count && run < best_len;
+        if (better) {
+            best = entry;
+            best_len = run;
+        }
+        if (run == count || entry + run >= sb->total_clusters) {
+            break;
+        }
+        entry = get_next_fat(entry + run);
+    }
+    *len = best_len < count ? best_len : count;
+    return best;
+}
+
+// reads @count blocks starting at block @block into @buf, and checks
+// them against their checksums if the disk has any. While a journal is
+// being replayed, the metadata on disk may be halfway through being
+// written in place, so its checksums are computed again instead (they
+// reach the disk once the replayed metadata does).
+// Return: -1 if a block cannot be read or doesn't match its checksum
+// (i.e. it is corrupted). 0 otherwise.
+int checked_read(uint64_t block, size_t count, void *buf) {
+    if (block_read_range(block, count, buf) == -1) {
+        return -1;
+    }
+    if (!sb->csums) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *data = (const uint8_t *)buf + i * BLOCK_SIZE;
+        if (journal_recovering) {
+            sb->csums[block + i] = crc32c(0, data, BLOCK_SIZE);
+            continue;
+        }
+        if (crc32c(0, data, BLOCK_SIZE) != sb->csums[block + i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// writes @count blocks of @buf starting at block @block, updating
+// their checksums if the disk has any (they reach the disk along
+// with the rest of the metadata, or the journal if there is one).
+// Return: -1 if a block cannot be written. 0 otherwise.
+int checked_write(uint64_t block, size_t count, const void *buf) {
+    if (sb->csums) {
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t *data = (const uint8_t *)buf + i * BLOCK_SIZE;
+            sb->csums[block + i] = crc32c(0, data, BLOCK_SIZE);
+        }
+        if (journal_active) {
+            journal_put(JOURNAL_CSUM, block, &sb->csums[block], count);
+        }
+    }
+    return block_write_range(block, count, buf);
+}
+
+// reads @len bytes at byte @offset of cluster @cluster into @buf.
+// whole blocks are read straight into @buf, in a single I/O for all
+// of them, and only the partial blocks at the edges are bounced.
+// Return: -1 if a block cannot be read. 0 otherwise.
+int cluster_read(uint32_t cluster, size_t offset, void *buf, size_t len) {
+    uint64_t first_block = sb->data_block_index
+                           + (uint64_t)cluster * sb->cluster_blocks;
+    void *bounce_buf = NULL; //used to hold a temp data block.
+
+    while (len > 0) {
+        uint64_t db_index = first_block + offset / BLOCK_SIZE;
+        size_t byte_offset = offset % BLOCK_SIZE;
+        size_t chunk;
+
+        if (byte_offset == 0 && len >= BLOCK_SIZE) {
+            chunk = len - len % BLOCK_SIZE;
+            if (checked_read(db_index, chunk / BLOCK_SIZE, buf) == -1) {
+                block_buf_put(bounce_buf, 1);
+                return -1;
+            }
+        }
+        else {
+            chunk = BLOCK_SIZE - byte_offset;
+            if (chunk > len) {
+                chunk = len;
+            }
+            if (!bounce_buf && !(bounce_buf = block_buf_get(1))) {
+                return -1;
+            }
+            if (checked_read(db_index, 1, bounce_buf) == -1) {
+                block_buf_put(bounce_buf, 1);
+                return -1;
+            }
+            memcpy(buf, (char *)bounce_buf + byte_offset, chunk);
+        }
+
+        buf = (char *)buf + chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    block_buf_put(bounce_buf, 1);
+    return 0;
+}
+
+// writes @len bytes of @buf at byte @offset of cluster @cluster.
+// @valid is how many bytes at the start of the cluster hold file
+// data: partial blocks below it are read, modified and written back,
+// partial blocks past it are simply zero-filled around @buf.
+// Return: -1 if a block cannot be read or written. 0 otherwise.
+int cluster_write(uint32_t cluster, size_t offset, const void *buf,
+                  size_t len, size_t valid) {
+    uint64_t first_block = sb->data_block_index
+                           + (uint64_t)cluster * sb->cluster_blocks;
+    void *bounce_buf = NULL; //used to hold a temp data block.
+
+    while (len > 0) {
+        uint64_t db_index = first_block + offset / BLOCK_SIZE;
+        size_t byte_offset = offset % BLOCK_SIZE;
+        size_t chunk;
+
+        if (byte_offset == 0 && len >= BLOCK_SIZE) {
+            chunk = len - len % BLOCK_SIZE;
+            if (checked_write(db_index, chunk / BLOCK_SIZE, buf) == -1) {
+                block_buf_put(bounce_buf, 1);
+                return -1;
+            }
+        }
+        else {
+            chunk = BLOCK_SIZE - byte_offset;
+            if (chunk > len) {
+                chunk = len;
+            }
+            if (!bounce_buf && !(bounce_buf = block_buf_get(1))) {
+                return -1;
+            }
+            if (offset - byte_offset < valid) {
+                if (checked_read(db_index, 1, bounce_buf) == -1) {
+                    block_buf_put(bounce_buf, 1);
+                    return -1;
+                }
+            }
+            else {
+                memset(bounce_buf, 0, BLOCK_SIZE);
+            }
+            memcpy((char *)bounce_buf + byte_offset, buf, chunk);
+            if (checked_write(db_index, 1, bounce_buf) == -1) {
+                block_buf_put(bounce_buf, 1);
+                return -1;
+            }
+        }
+
+        buf = (const char *)buf + chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    block_buf_put(bounce_buf, 1);
+    return 0;
+}
+
+// cursor over the buffers of an iovec array, consumed from the front
+struct iov_iter {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t skip; // bytes of iov[0] already consumed
+};
+
+// total size of the @iovcnt buffers of @iov, capped at INT_MAX
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > INT_MAX - total) {
+            return INT_MAX;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+// drops the buffers @it is done with
+static void iov_iter_settle(struct iov_iter *it) {
+    while (it->iovcnt > 0 && it->skip == it->iov->iov_len) {
+        it->iov++;
+        it->iovcnt--;
+        it->skip = 0;
+    }
+}
+
+// Return: the next @len bytes of @it, consumed, if a single buffer
+// holds them all. NULL otherwise, and nothing is consumed.
+static void *iov_iter_span(struct iov_iter *it, size_t len) {
+    iov_iter_settle(it);
+    if (it->iovcnt == 0 || it->iov->iov_len - it->skip < len) {
+        return NULL;
+    }
+    void *span = (char *)it->iov->iov_base + it->skip;
+    it->skip += len;
+    return span;
+}
+
+// copies the next @len bytes of @it to @buf (@gather) or the next
+// @len bytes of @buf to @it (!@gather), consuming them
+static void iov_iter_copy(struct iov_iter *it, void *buf, size_t len,
+                          bool gather) {
+    while (len > 0) {
+        iov_iter_settle(it);
+        size_t chunk = it->iov->iov_len - it->skip;
+        if (chunk > len) {
+            chunk = len;
+        }
+        char *base = (char *)it->iov->iov_base + it->skip;
+        if (gather) {
+            memcpy(buf, base, chunk);
+        }
+        else {
+            memcpy(base, buf, chunk);
+        }
+        buf = (char *)buf + chunk;
+        it->skip += chunk;
+        len -= chunk;
+    }
+}
+
+// reads up to @count bytes at @offset of the file held by root entry
+// @entry into @buf, walking its FAT chain one cluster at a time.
+// Return: -1 if a block cannot be read. Otherwise the number of bytes
+// read, which is less than @count if the end of the file is reached.
+int read_file_data(int entry, uint64_t offset, void *buf, size_t count) {
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
+    return read_file_iov(entry, offset, &iov, 1);
+}
+
+// same as read_file_data(), filling the @iovcnt buffers of @iov in turn.
+// A cluster spread over several buffers is read once into a bounce
+// buffer and scattered from there.
+int read_file_iov(int entry, uint64_t offset, const struct iovec *iov,
+                  int iovcnt) {
+    struct root *file = &root_entries[entry];
+
+    if (offset >= file->filesize) {
+        return 0;
+    }
+    // we can't read past the end of the file,
+    // nor return more than an int can hold
+    size_t count = iov_total(iov, iovcnt);
+    if (count > file->filesize - offset) {
+        count = file->filesize - offset;
+    }
+    if (file->flags & ROOT_COMPRESSED) {
+        // the chunk cache already spares us from
+        // decompressing again from one buffer to the next
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && done < count; ++i) {
+            size_t len = iov[i].iov_len < count - done
+                         ? iov[i].iov_len : count - done;
+            int read = read_compressed(entry, offset + done,
+                                       iov[i].iov_base, len);
+            if (read == -1) {
+                return -1;
+            }
+            done += read;
+            if ((size_t)read < len) {
+                break;
+            }
+        }
+        return (int)done;
+    }
+    if (file->flags & ROOT_PACKED) {
+        return read_packed(entry, offset, iov, iovcnt, count);
+    }
+
+    // skip the clusters before the one holding @offset
+    uint64_t cluster_offset = offset / sb->cluster_size;
+    size_t byte_offset = offset % sb->cluster_size;
+    uint32_t cur_entry = file->first_db_num;
+    for (uint64_t i = 0; i < cluster_offset && cur_entry != FAT_EOC; ++i) {
+        cur_entry = fat_get(cur_entry);
+    }
+
+    struct iov_iter it = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+    void *bounce_buf = NULL; // only needed when a cluster spans buffers
+    size_t buf_offset = 0;
+    while (buf_offset < count) {
+        if (cur_entry == FAT_EOC) {
+            break; // chain shorter than the file size says
+        }
+
+        // clusters that follow each other on disk are read in a
+        // single I/O, as long as they go to the same buffer
+        size_t left = count - buf_offset;
+        size_t run = cluster_run(cur_entry, (byte_offset + left - 1)
+                                            / sb->cluster_size + 1);
+        size_t chunk = run * sb->cluster_size - byte_offset;
+        if (chunk > left) {
+            chunk = left;
+        }
+        void *dest = iov_iter_span(&it, chunk);
+        if (!dest && run > 1) {
+            run = 1;
+            chunk = sb->cluster_size - byte_offset;
+            if (chunk > left) {
+                chunk = left;
+            }
+            dest = iov_iter_span(&it, chunk);
+        }
+        if (!dest) {
+            if (!bounce_buf
+                && !(bounce_buf = block_buf_get(sb->cluster_blocks))) {
+                return -1;
+            }
+            dest = bounce_buf;
+        }
+        if (cluster_read(cur_entry, byte_offset, dest, chunk) == -1) {
+            block_buf_put(bounce_buf, sb->cluster_blocks);
+            return -1;
+        }
+        if (dest == bounce_buf) {
+            iov_iter_copy(&it, bounce_buf, chunk, false);
+        }
+
+        buf_offset += chunk;
+        byte_offset = 0; // only the first cluster starts mid-way
+        cur_entry = fat_get(cur_entry + run - 1);
+    }
+
+    block_buf_put(bounce_buf, sb->cluster_blocks);
+    return (int)buf_offset;
+}
+
+// writes @count bytes of @buf at @offset (at most the file size) in the
+// file held by root entry @entry, extending its FAT chain as needed.
+// Return: -1 if a block cannot be read or written. Otherwise the number of
+// bytes written, which is less than @count if the disk ran out of space.
+int write_file_data(int entry, uint64_t offset, const void *buf,
+                    size_t count) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = count };
+    return write_file_iov(entry, offset, &iov, 1);
+}
+
+// same as write_file_data(), writing the @iovcnt buffers of @iov in turn.
+// A cluster spread over several buffers is gathered in a bounce buffer
+// first, so that its blocks are only written once.
+int write_file_iov(int entry, uint64_t offset, const struct iovec *iov,
+                   int iovcnt) {
+    struct root *file = &root_entries[entry];
+
+    // every write of file data ends up here
+    if (mount_read_only || offset > file->filesize) {
+        return -1;
+    }
+    size_t count = iov_total(iov, iovcnt);
+    if (file->flags & ROOT_COMPRESSED) {
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && done < count; ++i) {
+            size_t len = iov[i].iov_len < count - done
+                         ? iov[i].iov_len : count - done;
+            int written = write_compressed(entry, offset + done,
+                                           iov[i].iov_base, len);
+            if (written == -1) {
+                return done > 0 ? (int)done : -1;
+            }
+            done += written;
+            if ((size_t)written < len) {
+                break;
+            }
+        }
+        return (int)done;
+    }
+    // small files go in packs, for as long as they stay small
+    if ((file->flags & ROOT_PACKED)
+        || (pack_small && file->first_db_num == FAT_EOC && count > 0
+            && offset + count <= PACK_MAX)) {
+        return write_packed(entry, offset, iov, iovcnt);
+    }
+
+    // skip the clusters before the one holding @offset, remembering
+    // the last one we went through in case the chain has to grow.
+    // From the tail on, it's known where they are.
+    uint64_t cluster_offset = offset / sb->cluster_size;
+    size_t byte_offset = offset % sb->cluster_size;
+    uint32_t prev_entry = FAT_EOC;
+    uint32_t cur_entry = file->first_db_num;
+    uint64_t i = 0;
+    if (file->tail_cluster != 0 && cluster_offset >= file->tail_index) {
+        prev_entry = file->tail_cluster;
+        cur_entry = fat_get(prev_entry);
+        i = file->tail_index + 1;
+        if (cluster_offset == file->tail_index) {
+            prev_entry = FAT_EOC; // only needed past the tail
+            cur_entry = file->tail_cluster;
+            i = cluster_offset;
+        }
+    }
+    for (; i < cluster_offset; ++i) {
+        if (cur_entry == FAT_EOC) {
+            return -1; // chain shorter than the file size says
+        }
+        prev_entry = cur_entry;
+        cur_entry = fat_get(cur_entry);
+    }
+
+    struct iov_iter it = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+    void *bounce_buf = NULL; // only needed when a cluster spans buffers
+    size_t buf_offset = 0;
+    while (buf_offset < count) {
+        if (cur_entry == FAT_EOC) {
+            // end of the chain: allocate all the clusters
+            // that are still needed in one go
+            size_t first_new = FAT_EOC;
+            size_t needed = (byte_offset + count - buf_offset
+                             + sb->cluster_size - 1) / sb->cluster_size;
+            if (set_multi_fat(prev_entry, needed, &first_new) == 0) {
+                break; // no more space on disk
+            }
+            if (prev_entry == FAT_EOC) {
+                file->first_db_num = (uint32_t)first_new;
+                entry_changed(entry);
+            }
+            cur_entry = (uint32_t)first_new;
+        }
+
+        // same as reads, consecutive clusters are written at once
+        size_t left = count - buf_offset;
+        size_t run = cluster_run(cur_entry, (byte_offset + left - 1)
+                                            / sb->cluster_size + 1);
+        size_t chunk = run * sb->cluster_size - byte_offset;
+        if (chunk > left) {
+            chunk = left;
+        }
+        const void *src = iov_iter_span(&it, chunk);
+        if (!src && run > 1) {
+            run = 1;
+            chunk = sb->cluster_size - byte_offset;
+            if (chunk > left) {
+                chunk = left;
+            }
+            src = iov_iter_span(&it, chunk);
+        }
+        if (!src) {
+            if (!bounce_buf
+                && !(bounce_buf = block_buf_get(sb->cluster_blocks))) {
+                break;
+            }
+            iov_iter_copy(&it, bounce_buf, chunk, true);
+            src = bounce_buf;
+        }
+
+        // how much of these clusters already holds file data,
+        // which the partial blocks written must keep
+        uint64_t cluster_start = offset + buf_offset - byte_offset;
+        size_t valid = 0;
+        if (file->filesize > cluster_start) {
+            valid = file->filesize - cluster_start < run * sb->cluster_size
+                    ? file->filesize - cluster_start
+                    : run * sb->cluster_size;
+        }
+        if (cluster_write(cur_entry, byte_offset, src, chunk, valid) == -1) {
+            block_buf_put(bounce_buf, sb->cluster_blocks);
+            return -1;
+        }
+
+        buf_offset += chunk;
+        byte_offset = 0; // only the first cluster starts mid-way
+        prev_entry = cur_entry + run - 1;
+        cur_entry = fat_get(prev_entry);
+        cluster_offset += run;
+    }
+
+    block_buf_put(bounce_buf, sb->cluster_blocks);
+    // the write went up to the end of the chain: that's the tail now
+    if (cur_entry == FAT_EOC && prev_entry != FAT_EOC) {
+        file->tail_cluster = prev_entry;
+        file->tail_index = cluster_offset - 1;
+    }
+    // the file only grows if we wrote past its end
+    if (offset + buf_offset > file->filesize) {
+        file->filesize = offset + buf_offset;
+        entry_changed(entry);
+    }
+
+    return (int)buf_offset;
+}
+
+// copies the data of the file held by root entry @from to the empty
+// file @to, in a chain allocated in one go. Both chains are gone
+// through together, COPY_BATCH_BLOCKS blocks at most at a time: as
+// long as the clusters of both follow each other, that's a single read
+// and a single write.
+// Return: -1 if the disk runs out of space, or if a block cannot be read
+// or written (the clusters of @to being left in its chain). 0 otherwise.
+int copy_chain(int from, int to) {
+    struct root *src = &root_entries[from];
+    struct root *dst = &root_entries[to];
+    if (src->filesize == 0) {
+        return 0;
+    }
+    size_t clusters = (src->filesize + sb->cluster_size - 1)
+                      / sb->cluster_size;
+    size_t first_new = FAT_EOC;
+    size_t assigned = set_multi_fat(FAT_EOC, clusters, &first_new);
+    if (assigned > 0) {
+        dst->first_db_num = (uint32_t)first_new;
+        entry_changed(to);
+    }
+    void *buf = block_buf_get(COPY_BATCH_BLOCKS);
+    if (assigned < clusters || !buf) {
+        block_buf_put(buf, COPY_BATCH_BLOCKS);
+        return -1;
+    }
+
+    // both files are at the same block of their current cluster
+    uint64_t left = (src->filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t src_cluster = src->first_db_num;
+    uint32_t dst_cluster = dst->first_db_num;
+    size_t block = 0;
+    while (left > 0) {
+        if (src_cluster >= sb->total_clusters) {
+            block_buf_put(buf, COPY_BATCH_BLOCKS);
+            return -1; // chain shorter than the file size says
+        }
+        size_t count = left < COPY_BATCH_BLOCKS ? left : COPY_BATCH_BLOCKS;
+        size_t max = (block + count + sb->cluster_blocks - 1)
+                     / sb->cluster_blocks;
+        size_t src_run = cluster_run(src_cluster, max);
+        size_t dst_run = cluster_run(dst_cluster, max);
+        size_t run = src_run < dst_run ? src_run : dst_run;
+        if (count > run * sb->cluster_blocks - block) {
+            count = run * sb->cluster_blocks - block;
+        }
+
+        uint64_t src_block = sb->data_block_index + block
+                             + (uint64_t)src_cluster * sb->cluster_blocks;
+        uint64_t dst_block = sb->data_block_index + block
+                             + (uint64_t)dst_cluster * sb->cluster_blocks;
+        if (checked_read(src_block, count, buf) == -1
+            || checked_write(dst_block, count, buf) == -1) {
+            block_buf_put(buf, COPY_BATCH_BLOCKS);
+            return -1;
+        }
+
+        left -= count;
+        block += count;
+        size_t done = block / sb->cluster_blocks; // clusters finished
+        block %= sb->cluster_blocks;
+        if (done > 0) {
+            src_cluster = fat_get(src_cluster + done - 1);
+            dst_cluster = fat_get(dst_cluster + done - 1);
+        }
+    }
+    block_buf_put(buf, COPY_BATCH_BLOCKS);
+
+    dst->filesize = src->filesize;
+    entry_changed(to);
+    return 0;
+}
+
+// copy_chain() for the other files: the data of root entry @from is
+// read and written to @to by batches, the way fs_read() and fs_write()
+// would. A copy of a compressed file is compressed as well.
+// Return: -1 if the disk runs out of space, or if a block cannot be read
+// or written. 0 otherwise.
+int copy_data(int from, int to) {
+    if (root_entries[from].flags & ROOT_COMPRESSED) {
+        root_entries[to].flags |= ROOT_COMPRESSED;
+        entry_changed(to);
+    }
+    size_t len = COPY_BATCH_BLOCKS * BLOCK_SIZE;
+    void *buf = block_buf_get(COPY_BATCH_BLOCKS);
+    int ret = buf ? 0 : -1;
+    for (uint64_t offset = 0;
+         ret == 0 && offset < root_entries[from].filesize;) {
+        int read = read_file_data(from, offset, buf, len);
+        if (read <= 0 || write_file_data(to, offset, buf, read) != read) {
+            ret = -1;
+        }
+        offset += read > 0 ? read : 0;
+    }
+    block_buf_put(buf, COPY_BATCH_BLOCKS);
+
+    // the chunks of compressed files are only kept while they are open
+    if (!entry_is_open(from)) {
+        chunk_map_free(from);
+    }
+    if (root_entries[to].chunks && chunk_flush(to) == -1) {
+        ret = -1;
+    }
+    chunk_map_free(to);
+    return ret;
+}
+
+// counts the clusters from @cluster that follow each other both in
+// their chain and on disk, up to @max (at least 1, for @cluster).
+size_t cluster_run(uint32_t cluster, size_t max) {
+    size_t run = 1;
+    while (run < max && fat_get(cluster + run - 1) == cluster + run) {
+        ++run;
+    }
+    return run;
+}
+
+// follows the chain from @cluster for @steps links.
+// Return: the cluster reached, or FAT_EOC if the chain ends first.
+uint32_t fat_walk(uint32_t cluster, uint64_t steps) {
+    for (uint64_t i = 0; i < steps && cluster != FAT_EOC; ++i) {
+        cluster = fat_get(cluster);
+    }
+    return cluster;
+}
+
+// allocates @count clusters and links them in the chain right
+// after cluster @after, in front of whatever followed it.
+// Return: -1 if there aren't @count free clusters, in which case
+// nothing is allocated. 0 otherwise.
+int insert_clusters(uint32_t after, size_t count) {
+    size_t first_new = FAT_EOC;
+    size_t assigned = set_multi_fat(FAT_EOC, count, &first_new);
+    if (assigned < count) {
+        if (assigned > 0) {
+            free_fat_chain(first_new);
+        }
+        return -1;
+    }
+    uint32_t last_new = fat_walk((uint32_t)first_new, count - 1);
+    fat_set(last_new, fat_get(after));
+    fat_set(after, (uint32_t)first_new);
+    return 0;
+}
+
+// unlinks the @count clusters that follow cluster @after
+// from the chain, and frees them.
+void remove_clusters(uint32_t after, size_t count) {
+    uint32_t first = fat_get(after);
+    uint32_t last = fat_walk(first, count - 1);
+    fat_set(after, fat_get(last));
+    fat_set(last, FAT_EOC);
+    free_fat_chain(first);
+}
+
+// size of the chunks of compressed files, and number of
+// clusters a chunk stored in @len bytes takes
+static size_t chunk_size(void) {
+    return sb->cluster_size > COMPRESS_CHUNK_SIZE
+           ? sb->cluster_size : COMPRESS_CHUNK_SIZE;
+}
+
+static size_t chunk_clusters(uint32_t len) {
+    len &= ~CHUNK_RAW;
+    return (len + sb->cluster_size - 1) / sb->cluster_size;
+}
+
+// uncompressed size of chunk @chunk of file @file
+static size_t chunk_length(struct root *file, uint64_t chunk) {
+    uint64_t start = chunk * chunk_size();
+    if (file->filesize <= start) {
+        return 0;
+    }
+    return file->filesize - start < chunk_size()
+           ? file->filesize - start : chunk_size();
+}
+
+static uint64_t elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000
+           + now.tv_nsec - start->tv_nsec;
+}
+
+// reads (or writes) @len bytes from (or to) the clusters of the chain
+// starting at @cluster, @len being at most what these clusters hold.
+static int chain_io(uint32_t cluster, void *buf, size_t len, bool write) {
+    while (len > 0) {
+        size_t chunk = len < sb->cluster_size ? len : sb->cluster_size;
+        int ret = write ? cluster_write(cluster, 0, buf, chunk, 0)
+                        : cluster_read(cluster, 0, buf, chunk);
+        if (ret == -1 || cluster == FAT_EOC) {
+            return -1;
+        }
+        buf = (char *)buf + chunk;
+        len -= chunk;
+        cluster = fat_get(cluster);
+    }
+    return 0;
+}
+
+// returns the chunk map of compressed file @entry, reading
+// it from the head of its chain the first time.
+// returns NULL if out of memory or if the map is corrupted.
+struct chunk_map *chunk_map_get(int entry) {
+    struct root *file = &root_entries[entry];
+    if (file->chunks) {
+        return file->chunks;
+    }
+
+    struct chunk_map *map = calloc(1, sizeof(struct chunk_map));
+    if (!map || !(map->cache = malloc(chunk_size()))) {
+        free(map);
+        return NULL;
+    }
+    file->chunks = map;
+    map->stored_size = file->filesize;
+    if (file->first_db_num == FAT_EOC) {
+        return map; // nothing stored yet
+    }
+
+    // the header says how many chunks, hence how big the map is
+    struct chunk_header header;
+    if (cluster_read(file->first_db_num, 0, &header, sizeof(header)) == -1
+        || header.magic != CHUNK_MAGIC) {
+        chunk_map_free(entry);
+        return NULL;
+    }
+    size_t map_len = sizeof(header) + header.count * sizeof(uint32_t);
+    map->map_clusters = (map_len + sb->cluster_size - 1) / sb->cluster_size;
+    map->count = map->capacity = header.count;
+    map->lengths = malloc((header.count + 1) * sizeof(uint32_t));
+    map->first_cluster = malloc((header.count + 1) * sizeof(uint32_t));
+    uint8_t *map_buf = malloc(map_len);
+    if (!map->lengths || !map->first_cluster || !map_buf
+        || chain_io(file->first_db_num, map_buf, map_len, false) == -1) {
+        free(map_buf);
+        chunk_map_free(entry);
+        return NULL;
+    }
+    memcpy(map->lengths, map_buf + sizeof(header),
+           header.count * sizeof(uint32_t));
+    free(map_buf);
+
+    // one walk down the chain finds where every chunk starts
+    uint32_t cluster = fat_walk(file->first_db_num, map->map_clusters);
+    for (uint32_t i = 0; i < map->count; ++i) {
+        map->first_cluster[i] = cluster;
+        cluster = fat_walk(cluster, chunk_clusters(map->lengths[i]));
+    }
+    return map;
+}
+
+// writes the chunk map of compressed file @entry at the head of
+// its chain, growing the map's part of the chain if needed.
+// Return: -1 if out of space or if the map cannot be written.
+// 0 otherwise.
+int chunk_map_store(int entry) {
+    struct root *file = &root_entries[entry];
+    struct chunk_map *map = file->chunks;
+    if (!map->dirty) {
+        return 0;
+    }
+
+    size_t map_len = sizeof(struct chunk_header)
+                     + map->count * sizeof(uint32_t);
+    size_t needed = (map_len + sb->cluster_size - 1) / sb->cluster_size;
+    if (needed > map->map_clusters) {
+        uint32_t last = fat_walk(file->first_db_num, map->map_clusters - 1);
+        if (insert_clusters(last, needed - map->map_clusters) == -1) {
+            return -1;
+        }
+        map->map_clusters = needed;
+    }
+
+    uint8_t *map_buf = malloc(map_len);
+    if (!map_buf) {
+        return -1;
+    }
+    struct chunk_header header = { CHUNK_MAGIC, map->count };
+    memcpy(map_buf, &header, sizeof(header));
+    memcpy(map_buf + sizeof(header), map->lengths,
+           map->count * sizeof(uint32_t));
+    int ret = chain_io(file->first_db_num, map_buf, map_len, true);
+    free(map_buf);
+    if (ret == 0) {
+        map->dirty = false;
+    }
+    return ret;
+}
+
+// puts chunk @chunk of compressed file @entry in the cache, storing
+// the chunk that was there first if it was written to. A chunk that
+// isn't stored yet (the one right after the last) starts as zeros.
+// Return: -1 if a chunk cannot be stored, read or decompressed.
+// 0 otherwise.
+int chunk_load(int entry, uint64_t chunk) {
+    struct root *file = &root_entries[entry];
+    struct chunk_map *map = file->chunks;
+    if (map->cache_valid && map->cache_chunk == chunk) {
+        return 0;
+    }
+    if (map->cache_dirty && chunk_store(entry) == -1) {
+        return -1;
+    }
+
+    map->cache_valid = false;
+    memset(map->cache, 0, chunk_size());
+    if (chunk < map->count) {
+        uint32_t stored = map->lengths[chunk];
+        uint32_t len = stored & ~CHUNK_RAW;
+        if (stored & CHUNK_RAW) {
+            if (chain_io(map->first_cluster[chunk], map->cache,
+                         len, false) == -1) {
+                return -1;
+            }
+        }
+        else {
+            uint8_t *packed = malloc(len);
+            if (!packed || chain_io(map->first_cluster[chunk], packed,
+                                    len, false) == -1) {
+                free(packed);
+                return -1;
+            }
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            long unpacked = lz_decompress(packed, len,
+                                          map->cache, chunk_size());
+            compress_stats.decompress_ns += elapsed_ns(&start);
+            free(packed);
+            if (unpacked < 0) {
+                return -1; // corrupted chunk
+            }
+            compress_stats.decompressed_bytes += unpacked;
+        }
+    }
+    map->cache_chunk = chunk;
+    map->cache_valid = true;
+    return 0;
+}
+
+// compresses the chunk held in cache by compressed file @entry and
+// stores it in place of its previous version, resizing its part of
+// the chain to the number of clusters it needs now.
+// Return: -1 if out of space or if the chunk cannot be written.
+// 0 otherwise.
+int chunk_store(int entry) {
+    struct root *file = &root_entries[entry];
+    struct chunk_map *map = file->chunks;
+    uint64_t chunk = map->cache_chunk;
+    size_t len = chunk_length(file, chunk);
+
+    // compress, keeping the raw data if it doesn't get any smaller
+    uint8_t *packed = malloc(len);
+    if (!packed) {
+        return -1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t packed_len = lz_compress(map->cache, len, packed, len);
+    compress_stats.compress_ns += elapsed_ns(&start);
+    compress_stats.bytes_in += len;
+
+    uint32_t stored = (uint32_t)packed_len;
+    const void *data = packed;
+    if (packed_len == 0 || packed_len >= len) {
+        stored = (uint32_t)len | CHUNK_RAW;
+        data = map->cache;
+    }
+    compress_stats.bytes_out += stored & ~CHUNK_RAW;
+
+    // the map needs its first cluster before any chunk follows it
+    if (file->first_db_num == FAT_EOC) {
+        size_t head = get_and_set_fat(FAT_EOC);
+        if (head == 0) {
+            free(packed);
+            return -1;
+        }
+        file->first_db_num = (uint32_t)head;
+        entry_changed(entry);
+        map->map_clusters = 1;
+        map->dirty = true;
+    }
+
+    size_t needed = chunk_clusters(stored);
+    if (chunk == map->count) {
+        // new chunk, goes after the last one (or the map)
+        if (map->count == map->capacity) {
+            uint32_t capacity = map->capacity ? map->capacity * 2 : 16;
+            uint32_t *lengths = realloc(map->lengths,
+                                        capacity * sizeof(uint32_t));
+            if (lengths) {
+                map->lengths = lengths;
+            }
+            uint32_t *first = realloc(map->first_cluster,
+                                      capacity * sizeof(uint32_t));
+            if (first) {
+                map->first_cluster = first;
+            }
+            if (!lengths || !first) {
+                free(packed);
+                return -1;
+            }
+            map->capacity = capacity;
+        }
+        uint32_t last = chunk == 0
+                ? fat_walk(file->first_db_num, map->map_clusters - 1)
+                : fat_walk(map->first_cluster[chunk - 1],
+                           chunk_clusters(map->lengths[chunk - 1]) - 1);
+        if (insert_clusters(last, needed) == -1) {
+            free(packed);
+            return -1;
+        }
+        map->first_cluster[chunk] = fat_get(last);
+        map->lengths[chunk] = 0;
+        map->count++;
+    }
+    else {
+        // existing chunk, grows or shrinks at its end
+        size_t had = chunk_clusters(map->lengths[chunk]);
+        if (needed > had) {
+            uint32_t last = fat_walk(map->first_cluster[chunk], had - 1);
+            if (insert_clusters(last, needed - had) == -1) {
+                free(packed);
+                return -1;
+            }
+        }
+        else if (needed < had) {
+            uint32_t last = fat_walk(map->first_cluster[chunk], needed - 1);
+            remove_clusters(last, had - needed);
+        }
+    }
+
+    int ret = chain_io(map->first_cluster[chunk], (void *)data,
+                       stored & ~CHUNK_RAW, true);
+    free(packed);
+    if (ret == -1) {
+        return -1;
+    }
+    map->lengths[chunk] = stored;
+    map->dirty = true;
+    map->cache_dirty = false;
+    return 0;
+}
+
+// stores whatever compressed file @entry still holds in memory. Its
+// root entry only gets the new size once all of it is stored, so that
+// a commit in the meantime cannot make the size durable without the
+// data.
+// Return: -1 if anything cannot be stored. 0 otherwise.
+int chunk_flush(int entry) {
+    struct root *file = &root_entries[entry];
+    struct chunk_map *map = file->chunks;
+    if ((map->cache_dirty && chunk_store(entry) == -1)
+        || chunk_map_store(entry) == -1) {
+        return -1;
+    }
+    if (map->stored_size != file->filesize) {
+        map->stored_size = file->filesize;
+        entry_changed(entry);
+    }
+    return 0;
+}
+
+// chunk_flush() for every compressed file that has a chunk map in
+// memory (which are the open ones).
+// Return: -1 if anything cannot be stored. 0 otherwise.
+int chunk_flush_open(void) {
+    int ret = 0;
+    for (size_t i = 0; i < root_count; ++i) {
+        if (root_entries[i].chunks && chunk_flush(i) == -1) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// drops the in-memory chunk map of root entry @entry, if any.
+void chunk_map_free(int entry) {
+    struct chunk_map *map = root_entries[entry].chunks;
+    if (!map) {
+        return;
+    }
+    free(map->lengths);
+    free(map->first_cluster);
+    free(map->cache);
+    free(map);
+    root_entries[entry].chunks = NULL;
+}
+
+// read_file_data() for compressed files: decompress the chunks
+// covering the range one at a time, and copy from the cache.
+int read_compressed(int entry, uint64_t offset, void *buf, size_t count) {
+    struct chunk_map *map = chunk_map_get(entry);
+    if (!map) {
+        return -1;
+    }
+
+    size_t buf_offset = 0;
+    while (buf_offset < count) {
+        uint64_t pos = offset + buf_offset;
+        size_t in_chunk = pos % chunk_size();
+        size_t len = chunk_size() - in_chunk;
+        if (len > count - buf_offset) {
+            len = count - buf_offset;
+        }
+        if (chunk_load(entry, pos / chunk_size()) == -1) {
+            return -1;
+        }
+        memcpy((char *)buf + buf_offset, map->cache + in_chunk, len);
+        buf_offset += len;
+    }
+    return (int)buf_offset;
+}
+
+// write_file_data() for compressed files: the data goes in the cached
+// chunk, which is only compressed and stored when another chunk is
+// needed, or when the file gets closed.
+int write_compressed(int entry, uint64_t offset, const void *buf,
+                     size_t count) {
+    struct root *file = &root_entries[entry];
+    struct chunk_map *map = chunk_map_get(entry);
+    if (!map) {
+        return -1;
+    }
+
+    size_t buf_offset = 0;
+    while (buf_offset < count) {
+        uint64_t pos = offset + buf_offset;
+        size_t in_chunk = pos % chunk_size();
+        size_t len = chunk_size() - in_chunk;
+        if (len > count - buf_offset) {
+            len = count - buf_offset;
+        }
+        if (chunk_load(entry, pos / chunk_size()) == -1) {
+            // (most likely, the previous chunk didn't fit on disk)
+            break;
+        }
+        memcpy(map->cache + in_chunk, (const char *)buf + buf_offset, len);
+        map->cache_dirty = true;
+        buf_offset += len;
+        if (pos + len > file->filesize) {
+            file->filesize = pos + len;
+            entry_changed(entry);
+        }
+    }
+    return buf_offset || count == 0 ? (int)buf_offset : -1;
+}
+
+// number of units a packed file of @size bytes takes
+static size_t pack_units(uint64_t size) {
+    return (size_t)((size + PACK_UNIT - 1) / PACK_UNIT);
+}
+
+// read_file_iov() for packed files, @count being what's left to read
+// from @offset: the fragment is in a single block, read in one I/O.
+int read_packed(int entry, uint64_t offset, const struct iovec *iov,
+                int iovcnt, size_t count) {
+    struct root *file = &root_entries[entry];
+    struct iov_iter it = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+    uint8_t data[PACK_MAX];
+
+    void *dest = iov_iter_span(&it, count);
+    size_t start = (size_t)file->pack_unit * PACK_UNIT + offset;
+    if (cluster_read(file->first_db_num, start, dest ? dest : data,
+                     count) == -1) {
+        return -1;
+    }
+    if (!dest) {
+        iov_iter_copy(&it, data, count, false);
+    }
+    return (int)count;
+}
+
+// write_file_iov() for packed files, and for the empty files that get
+// packed: the fragment is written in place if it keeps its number of
+// units, and moves to a new one otherwise (in a single write either
+// way). Past PACK_MAX, the file gets a chain instead.
+int write_packed(int entry, uint64_t offset, const struct iovec *iov,
+                 int iovcnt) {
+    struct root *file = &root_entries[entry];
+    bool packed = file->flags & ROOT_PACKED;
+    size_t count = iov_total(iov, iovcnt);
+    if (offset + count > PACK_MAX) {
+        return unpack_write(entry, offset, iov, iovcnt);
+    }
+    uint64_t size = offset + count > file->filesize ? offset + count
+                                                   : file->filesize;
+    size_t old_units = packed ? pack_units(file->filesize) : 0;
+    size_t units = pack_units(size);
+    struct iov_iter it = { .iov = iov, .iovcnt = iovcnt, .skip = 0 };
+    uint8_t data[PACK_MAX];
+
+    if (units == old_units) {
+        iov_iter_copy(&it, data, count, true);
+        size_t start = (size_t)file->pack_unit * PACK_UNIT + offset;
+        if (cluster_write(file->first_db_num, start, data, count,
+                          sb->cluster_size) == -1) {
+            return -1;
+        }
+    }
+    else {
+        // the whole file goes to its new fragment
+        if (packed && cluster_read(file->first_db_num,
+                                   (size_t)file->pack_unit * PACK_UNIT,
+                                   data, file->filesize) == -1) {
+            return -1;
+        }
+        iov_iter_copy(&it, data + offset, count, true);
+        uint32_t cluster;
+        uint16_t unit;
+        if (pack_alloc(units, &cluster, &unit) == -1) {
+            return 0; // no more space on disk
+        }
+        if (pack_store(cluster, unit, units, data, size) == -1) {
+            pack_free(cluster, unit, units);
+            return -1;
+        }
+        if (packed) {
+            pack_free(file->first_db_num, file->pack_unit, old_units);
+        }
+        file->first_db_num = cluster;
+        file->pack_unit = unit;
+        file->flags |= ROOT_PACKED;
+        entry_changed(entry);
+    }
+    if (size > file->filesize) {
+        file->filesize = size;
+        entry_changed(entry);
+    }
+    return (int)count;
+}
+
+// moves packed file @entry to a chain of its own, along with the
+// @iovcnt buffers of @iov written at @offset, which make it too big
+// for a pack. The fragment is only freed once its data is in the
+// chain: until then, the file stays as it was if anything fails.
+// Return: same as write_file_iov().
+int unpack_write(int entry, uint64_t offset, const struct iovec *iov,
+                 int iovcnt) {
+    struct root *file = &root_entries[entry];
+    struct root packed = *file;
+    uint8_t data[PACK_MAX];
+
+    // what the file keeps is before @offset, the rest being rewritten
+    if (cluster_read(file->first_db_num, (size_t)file->pack_unit * PACK_UNIT,
+                     data, offset) == -1) {
+        return -1;
+    }
+    struct iovec *all = malloc((iovcnt + 1) * sizeof(struct iovec));
+    if (!all) {
+        return -1;
+    }
+    all[0].iov_base = data;
+    all[0].iov_len = offset;
+    memcpy(all + 1, iov, iovcnt * sizeof(struct iovec));
+
+    file->flags &= ~ROOT_PACKED;
+    file->first_db_num = FAT_EOC;
+    file->pack_unit = 0;
+    file->filesize = 0;
+    int written = write_file_iov(entry, 0, all, iovcnt + 1);
+    free(all);
+    if (written < 0 || (size_t)written < offset) {
+        free_fat_chain(file->first_db_num);
+        *file = packed;
+        file->tail_cluster = 0;
+        entry_changed(entry);
+        return -1;
+    }
+    pack_free(packed.first_db_num, packed.pack_unit,
+              pack_units(packed.filesize));
+    entry_changed(entry);
+    return written - (int)offset;
+}
+
+// writes the @len bytes of @buf to the fragment of @units units at unit
+// @unit of pack cluster @cluster, which must be in use. The rest of its
+// block is kept if other fragments use it, zeroed otherwise.
+// Return: -1 if the block cannot be read or written. 0 otherwise.
+int pack_store(uint32_t cluster, uint16_t unit, size_t units,
+               const void *buf, size_t len) {
+    size_t start = (size_t)unit * PACK_UNIT;
+    size_t valid = start - start % BLOCK_SIZE;
+    if (pack_block_shared(pack_find(cluster), unit, units)) {
+        valid = sb->cluster_size;
+    }
+    return cluster_write(cluster, start, buf, len, valid);
+}
+
+// reads the superblock, the FAT and the root directory of the disk
+// that was just opened, converting them to their in-memory versions.
+// Return: -1 if the disk doesn't hold a valid file system. 0 otherwise.
+int load_metadata(const struct fs_mount_opts *opts) {
+    sb = calloc(1, sizeof(struct superblock));
+    if (!sb) {
+        return -1;
+    }
+    if (block_read(0, sb->raw) == -1) {
+        return -1;
+    }
+
+    // testing for matching signature, which tells the format
+    struct superblock16 *sb16 = (struct superblock16 *)sb->raw;
+    struct superblock32 *sb32 = (struct superblock32 *)sb->raw;
+    if (memcmp(sb->raw, FS_SIGNATURE, 8) == 0) {
+        sb->fat32 = false;
+        sb->total_blocks = sb16->total_blocks;
+        sb->root_dir_index = sb16->root_dir_index;
+        sb->data_block_index = sb16->data_block_index;
+        sb->total_data_blocks = sb16->total_data_blocks;
+        sb->total_fat_blocks = sb16->total_fat_blocks;
+        sb->cluster_blocks = 1;
+    }
+    else if (memcmp(sb->raw, FS_SIGNATURE_32, 8) == 0) {
+        sb->fat32 = true;
+        sb->total_blocks = sb32->total_blocks;
+        sb->root_dir_index = sb32->root_dir_index;
+        sb->data_block_index = sb32->data_block_index;
+        sb->total_data_blocks = sb32->total_data_blocks;
+        sb->total_fat_blocks = sb32->total_fat_blocks;
+        sb->cluster_blocks = sb32->cluster_blocks ? sb32->cluster_blocks : 1;
+        sb->csum_blocks = sb32->csum_blocks;
+        sb->journal_blocks = sb32->journal_blocks;
+    }
+    else {
+        return -1;
+    }
+
+    // testing for matching block count
+    if ((uint64_t)block_disk_count() != sb->total_blocks) {
+        return -1;
+    }
+    // and for a layout that makes sense: the FAT has to have
+    // room for every cluster, which has to fit on the disk
+    if (sb->cluster_blocks > FS_CLUSTER_MAX_SIZE / BLOCK_SIZE) {
+        return -1;
+    }
+    sb->cluster_size = (size_t)sb->cluster_blocks * BLOCK_SIZE;
+    sb->total_clusters = sb->total_data_blocks / sb->cluster_blocks;
+    size_t fat_entries = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+    if (sb->total_fat_blocks == 0
+        || (uint64_t)sb->total_fat_blocks * fat_entries
+           < sb->total_clusters
+        || sb->root_dir_index != (uint64_t)sb->total_fat_blocks + 1
+        || sb->data_block_index != sb->root_dir_index + 1 + sb->csum_blocks
+                                   + sb->journal_blocks
+        || sb->data_block_index + sb->total_data_blocks > sb->total_blocks
+        || (uint64_t)sb->csum_blocks * BLOCK_SIZE / 4
+           < (sb->csum_blocks ? sb->total_blocks : 0)
+        || sb->journal_blocks == 1) {
+        return -1;
+    }
+
+    // the checksums come first, so that all the other
+    // metadata can be checked as it gets read
+    if (sb->csum_blocks) {
+        sb->csums = malloc((size_t)sb->csum_blocks * BLOCK_SIZE);
+        if (!sb->csums
+            || block_read_range(sb->root_dir_index + 1, sb->csum_blocks,
+                                sb->csums) == -1) {
+            return -1;
+        }
+    }
+    // then what the journal has to replay, if anything. The replayed
+    // changes are applied to each piece of metadata as it gets loaded.
+    if (sb->journal_blocks
+        && (journal_load() == -1
+            || journal_replay(JOURNAL_CSUM, NULL, 0) == -1)) {
+        return -1;
+    }
+    if (sb->csums && !journal_recovering
+        && crc32c(0, sb->raw, BLOCK_SIZE) != sb->csums[0]) {
+        return -1;
+    }
+
+    // begin loading metadata for the fat struct: all of it in a
+    // single I/O, unless it is to be paged in as it gets used (which
+    // a replay cannot wait for)
+    bool lazy = opts && opts->lazy_fat && !journal_recovering;
+    fat_cache_max = lazy ? opts->fat_cache_blocks : 0;
+    if (fat_cache_init(lazy) == -1) {
+        return -1;
+    }
+    if (!lazy && checked_read(1, sb->total_fat_blocks, fat_slab) == -1) {
+        return -1;
+    }
+    if (journal_replay(JOURNAL_FAT, NULL, 0) == -1) {
+        return -1;
+    }
+    // making sure the first entry loaded was 0xFFFF
+    if (fat_get(0) != FAT_EOC) {
+        return -1;
+    }
+    fat_free_hint = 1;
+    alloc_cursor = 1;
+    alloc_policy = opts ? opts->alloc_policy : FS_ALLOC_FIRST_FIT;
+    mount_read_only = opts && opts->read_only;
+    pack_small = opts && opts->pack_small_files;
+    pack_current = 0;
+    pack_scan = 0;
+    memset(&compress_stats, 0, sizeof(compress_stats));
+
+    // Now we do the same thing for the root_entries: its first
+    // block, and the chain that follows on the large format (along
+    // with the name heap, which has its long names)
+    if (name_heap_load() == -1
+        || journal_replay(JOURNAL_NAMES, name_heap,
+                          name_cluster_count * sb->cluster_size) == -1
+        || root_load() == -1 || pack_load() == -1) {
+        return -1;
+    }
+    bool recovered = journal_recovering;
+    journal_recovering = false;
+    free(journal_replay_buf);
+    journal_replay_buf = NULL;
+    journal_replay_len = 0;
+
+    // the free counts are in the summary after a clean unmount,
+    // they have to be found from the FAT otherwise
+    if (fat_groups_init() == -1) {
+        return -1;
+    }
+    if (recovered || summary_load() == -1) {
+        summary_rebuild();
+    }
+    // the first group with free clusters is where they start
+    for (size_t i = 0; i < fat_group_count; ++i) {
+        if (fat_group_free[i] > 0) {
+            size_t per_block = sb->fat32 ? FAT32_ENTRIES : FAT16_ENTRIES;
+            fat_free_hint = i ? i * fat_group_blocks * per_block : 1;
+            break;
+        }
+    }
+
+    // a read-only mount changes nothing on disk, a replay included
+    if (mount_read_only) {
+        return 0;
+    }
+    // until fs_umount() writes it back, the summary on disk
+    // is not to be trusted (along with the superblock's checksum)
+    summary_store(false);
+    if (!recovered
+        && (checked_write(0, 1, sb->raw) == -1
+            || (sb->csums && block_write_range(sb->root_dir_index + 1, 1,
+                                               sb->csums) == -1))) {
+        return -1;
+    }
+    if (sb->journal_blocks && journal_start(opts) == -1) {
+        return -1;
+    }
+    // a replay ends with a checkpoint, which puts the replayed
+    // metadata in place (the summary along) and empties the journal
+    return recovered ? flush_metadata(false) : 0;
+}
+
+// frees and wipes clean the globals holding the metadata,
+// which puts us back in the not-mounted state.
+void release_metadata(void) {
+    for (size_t i = 0; i < root_count; ++i) {
+        chunk_map_free(i);
+    }
+    journal_free();
+    pack_release();
+    free(root_entries);
+    free(root_disk);
+    free(root_dirty);
+    free(root_logged);
+    free(root_clusters);
+    name_index_free(&root_index);
+    root_entries = NULL;
+    root_disk = NULL;
+    root_dirty = NULL;
+    root_logged = NULL;
+    root_clusters = NULL;
+    root_count = 0;
+    root_cluster_count = 0;
+    free(name_heap);
+    free(name_disk);
+    free(name_clusters);
+    name_heap = NULL;
+    name_disk = NULL;
+    name_clusters = NULL;
+    name_cluster_count = 0;
+    name_heap_used = 0;
+    name_heap_garbage = 0;
+    free(fat_group_free);
+    fat_group_free = NULL;
+    if (sb) {
+        fat_cache_free();
+        free(sb->csums);
+    }
+    free(sb);
+    sb = NULL;
+}
+
+// collects the clusters of the chain of metadata starting at cluster
+// @first (0 for an empty one) into a new array @clusters, of @count.
+// Return: -1 if the chain is corrupted or out of memory. 0 otherwise.
+int chain_load(uint32_t first, uint32_t **clusters, size_t *count) {
+    // a chain longer than the FAT can hold is a loop
+    size_t length = 0;
+    for (uint32_t c = first; c != 0 && c != FAT_EOC; c = fat_get(c)) {
+        if (c >= sb->total_clusters || length == sb->total_clusters) {
+            return -1;
+        }
+        ++length;
+    }
+    *clusters = malloc((length ? length : 1) * sizeof(uint32_t));
+    if (!*clusters) {
+        return -1;
+    }
+    *count = length;
+    uint32_t cluster = first;
+    for (size_t i = 0; i < length; ++i) {
+        (*clusters)[i] = cluster;
+        cluster = fat_get(cluster);
+    }
+    return 0;
+}
+
+// adds a cluster to the chain of metadata @clusters (@count of them),
+// after its last one. The cluster is zeroed on disk right away, so
+// that only the blocks that get used have to be written later.
+// Return: -1 if there is no free cluster, or it cannot be written.
+// 0 otherwise.
+int chain_grow(uint32_t **clusters, size_t *count) {
+    uint32_t *grown = realloc(*clusters, (*count + 1) * sizeof(uint32_t));
+    if (!grown) {
+        return -1;
+    }
+    *clusters = grown;
+
+    size_t last = *count ? grown[*count - 1] : FAT_EOC;
+    size_t cluster = 0;
+    uint8_t *zeros = calloc(1, sb->cluster_size);
+    if (!zeros
+        || set_multi_fat(last, 1, &cluster) == 0
+        || checked_write(sb->data_block_index
+                         + (uint64_t)cluster * sb->cluster_blocks,
+                         sb->cluster_blocks, zeros) == -1) {
+        if (cluster) {
+            fat_set(cluster, 0);
+            if (last != FAT_EOC) {
+                fat_set(last, FAT_EOC);
+            }
+        }
+        free(zeros);
+        return -1;
+    }
+    free(zeros);
+    grown[(*count)++] = (uint32_t)cluster;
+    return 0;
+}
+
+// cuts the chain of metadata @clusters (@count of them) back to its
+// first @new_count clusters, freeing the others.
+void chain_shrink(uint32_t *clusters, size_t *count, size_t new_count) {
+    if (new_count >= *count) {
+        return;
+    }
+    if (new_count) {
+        fat_set(clusters[new_count - 1], FAT_EOC);
+    }
+    free_fat_chain(clusters[new_count]);
+    *count = new_count;
+}
+
+// Return: the disk block holding block @block of the root directory.
+uint64_t root_block_index(size_t block) {
+    if (block == 0) {
+        return sb->root_dir_index;
+    }
+    size_t cluster = (block - 1) / sb->cluster_blocks;
+    return sb->data_block_index
+           + (uint64_t)root_clusters[cluster] * sb->cluster_blocks
+           + (block - 1) % sb->cluster_blocks;
+}
+
+// converts block @block of the root directory, as stored
+// on disk in @buf, to its in-memory entries. Long names
+// are looked up in the name heap, which has to be loaded.
+// Return: -1 if a long name isn't in the heap. 0 otherwise.
+int root_block_decode(size_t block, const uint8_t *buf) {
+    for (size_t i = 0; i < ROOT_BLOCK_ENTRIES; ++i) {
+        struct root *entry = &root_entries[block * ROOT_BLOCK_ENTRIES + i];
+        if (sb->fat32) {
+            const struct root32 *disk_entry = (const struct root32 *)buf + i;
+            memcpy(entry->filename, disk_entry->filename, FS_FILENAME_LEN);
+            entry->filesize = disk_entry->filesize;
+            entry->first_db_num = disk_entry->first_db_num;
+            entry->flags = disk_entry->flags & ~ROOT_LONG_NAME;
+            entry->pack_unit = disk_entry->pack_unit;
+        }
+        else {
+            const struct root16 *disk_entry = (const struct root16 *)buf + i;
+            memcpy(entry->filename, disk_entry->filename, FS_FILENAME_LEN);
+            entry->filesize = disk_entry->filesize;
+            entry->first_db_num = disk_entry->first_db_num == FAT16_EOC
+                                  ? FAT_EOC : disk_entry->first_db_num;
+            entry->flags = disk_entry->flags;
+            entry->pack_unit = disk_entry->pack_unit;
+        }
+        entry->name_len = 0;
+        entry->name_offset = 0;
+        entry->tail_cluster = 0;
+
+        if (sb->fat32 && (((const struct root32 *)buf)[i].flags
+                          & ROOT_LONG_NAME)) {
+            struct root32_long_name long_name;
+            memcpy(&long_name, ((const struct root32 *)buf)[i].filename,
+                   sizeof(long_name));
+            size_t capacity = name_cluster_count * sb->cluster_size;
+            if (long_name.length < FS_FILENAME_LEN
+                || long_name.length >= FS_LONG_FILENAME_LEN
+                || (size_t)long_name.offset + long_name.length >= capacity) {
+                return -1;
+            }
+            const char *name = (const char *)name_heap + long_name.offset;
+            if (strnlen(name, long_name.length + 1) != long_name.length
+                || filename_hash(name) != long_name.hash) {
+                return -1;
+            }
+            entry->name_len = long_name.length;
+            entry->name_offset = long_name.offset;
+            memcpy(entry->filename, name, FS_FILENAME_LEN - 1);
+            entry->filename[FS_FILENAME_LEN - 1] = '\0';
+        }
+        else {
+            entry->filename[FS_FILENAME_LEN - 1] = '\0';
+        }
+        entry->name_hash = filename_hash(entry_name(entry));
+    }
+    return 0;
+}
+
+// converts the in-memory entries of block @block of
+// the root directory to their on-disk version, in @buf.
+void root_block_encode(size_t block, uint8_t *buf) {
+    memset(buf, 0, BLOCK_SIZE);
+    for (size_t i = 0; i < ROOT_BLOCK_ENTRIES; ++i) {
+        struct root *entry = &root_entries[block * ROOT_BLOCK_ENTRIES + i];
+        // an open compressed file may have grown in memory only
+        uint64_t filesize = entry->chunks ? entry->chunks->stored_size
+                                          : entry->filesize;
+        if (sb->fat32) {
+            struct root32 *disk_entry = (struct root32 *)buf + i;
+            memcpy(disk_entry->filename, entry->filename, FS_FILENAME_LEN);
+            disk_entry->filesize = filesize;
+            disk_entry->first_db_num = entry->first_db_num;
+            disk_entry->flags = entry->flags;
+            disk_entry->pack_unit = entry->pack_unit;
+            if (entry->name_len) {
+                struct root32_long_name long_name;
+                memcpy(long_name.prefix, entry->filename,
+                       sizeof(long_name.prefix));
+                long_name.length = entry->name_len;
+                long_name.hash = entry->name_hash;
+                long_name.offset = entry->name_offset;
+                memset(disk_entry->filename, 0, FS_FILENAME_LEN);
+                memcpy(disk_entry->filename, &long_name, sizeof(long_name));
+                disk_entry->flags |= ROOT_LONG_NAME;
+            }
+        }
+        else {
+            struct root16 *disk_entry = (struct root16 *)buf + i;
+            memcpy(disk_entry->filename, entry->filename, FS_FILENAME_LEN);
+            disk_entry->filesize = (uint32_t)filesize;
+            disk_entry->first_db_num = entry->first_db_num == FAT_EOC
+                                       ? FAT16_EOC
+                                       : (uint16_t)entry->first_db_num;
+            disk_entry->flags = entry->flags;
+            disk_entry->pack_unit = entry->pack_unit;
+        }
+    }
+}
+
+// makes room for @blocks blocks of root directory, the new ones
+// being empty (in memory, and in root_disk as they are on disk, like
+// in root_logged with a journal).
+// Return: -1 if there is not enough memory. 0 otherwise.
+int root_resize(size_t blocks) {
+    size_t old_count = root_count;
+    size_t old_blocks = old_count / ROOT_BLOCK_ENTRIES;
+    size_t count = blocks * ROOT_BLOCK_ENTRIES;
+    struct root *entries = realloc(root_entries, count * sizeof(struct root));
+    if (!entries) {
+        return -1;
+    }
+    root_entries = entries;
+    uint8_t *disk = realloc(root_disk, blocks * BLOCK_SIZE);
+    if (!disk) {
+        return -1;
+    }
+    root_disk = disk;
+    if (sb->journal_blocks) {
+        bool *dirty = realloc(root_dirty, blocks * sizeof(bool));
+        if (!dirty) {
+            return -1;
+        }
+        root_dirty = dirty;
+        uint8_t *logged = realloc(root_logged, blocks * BLOCK_SIZE);
+        if (!logged) {
+            return -1;
+        }
+        root_logged = logged;
+        memset(root_dirty + old_blocks, 0,
+               (blocks - old_blocks) * sizeof(bool));
+        memset(root_logged + old_blocks * BLOCK_SIZE, 0,
+               (blocks - old_blocks) * BLOCK_SIZE);
+    }
+    memset(root_entries + old_count, 0,
+           (count - old_count) * sizeof(struct root));
+    memset(root_disk + old_blocks * BLOCK_SIZE, 0,
+           (blocks - old_blocks) * BLOCK_SIZE);
+    root_count = count;
+    root_free_count += count - old_count;
+    return 0;
+}
+
+// reads the root directory: its first block, then (on the large
+// format) the chain of clusters the superblock points to, one
+// cluster per I/O. Builds root_index over it. The entries a journal
+// replays are patched in before decoding (root_disk keeping the
+// blocks as they are on disk).
+// Return: -1 if the directory cannot be read. 0 otherwise.
+int root_load(void) {
+    uint32_t first = 0;
+    if (sb->fat32) {
+        first = ((struct superblock32 *)sb->raw)->root_chain;
+    }
+    if (chain_load(first, &root_clusters, &root_cluster_count) == -1) {
+        return -1;
+    }
+    size_t clusters = root_cluster_count;
+    size_t blocks = 1 + clusters * sb->cluster_blocks;
+    if (root_resize(blocks) == -1) {
+        return -1;
+    }
+
+    if (checked_read(sb->root_dir_index, 1, root_disk) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < clusters; ++i) {
+        uint8_t *buf = root_disk + (1 + i * sb->cluster_blocks) * BLOCK_SIZE;
+        if (checked_read(root_block_index(1 + i * sb->cluster_blocks),
+                         sb->cluster_blocks, buf) == -1) {
+            return -1;
+        }
+    }
+    uint8_t *image = root_disk;
+    if (journal_recovering) {
+        image = malloc(blocks * BLOCK_SIZE);
+        if (!image) {
+            return -1;
+        }
+        memcpy(image, root_disk, blocks * BLOCK_SIZE);
+        if (journal_replay(JOURNAL_ROOT, image, blocks * BLOCK_SIZE) == -1) {
+            free(image);
+            return -1;
+        }
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+        if (root_block_decode(b, image + b * BLOCK_SIZE) == -1) {
+            if (image != root_disk) {
+                free(image);
+            }
+            return -1;
+        }
+    }
+    if (image != root_disk) {
+        free(image);
+    }
+    // the heap ends with the last name in use, the other
+    // names before it (if any) being garbage
+    root_free_count = 0;
+    name_heap_used = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < root_count; ++i) {
+        struct root *entry = &root_entries[i];
+        root_free_count += entry->filename[0] == '\0';
+        if (entry->filename[0] != '\0' && entry->name_len) {
+            live += entry->name_len + 1;
+            if (entry->name_offset + entry->name_len + 1u > name_heap_used) {
+                name_heap_used = entry->name_offset + entry->name_len + 1;
+            }
+        }
+    }
+    name_heap_garbage = name_heap_used - live;
+    root_free_hint = 0;
+    return name_index_build(&root_index, root_entries, root_count);
+}
+
+// adds a cluster of empty entries to the root directory, chained
+// after its last one. Only the large format can do this (the classic
+// one keeps its single block).
+// Return: -1 if the directory cannot grow. 0 otherwise.
+int root_grow(void) {
+    if (!sb->fat32 || chain_grow(&root_clusters, &root_cluster_count) == -1) {
+        return -1;
+    }
+    // (on failure, the cluster stays in the chain for the next attempt)
+    size_t old_count = root_count;
+    if (root_resize(1 + root_cluster_count * sb->cluster_blocks) == -1) {
+        return -1;
+    }
+    if (name_index_grow(&root_index, root_entries, root_count) == -1) {
+        root_free_count -= root_count - old_count;
+        root_count = old_count;
+        return -1;
+    }
+    return 0;
+}
+
+// gives back the clusters root_grow() added after the first
+// @cluster_count, whose entries must all be empty.
+void root_shrink(size_t cluster_count) {
+    if (cluster_count >= root_cluster_count) {
+        return;
+    }
+    chain_shrink(root_clusters, &root_cluster_count, cluster_count);
+    size_t count = (1 + cluster_count * sb->cluster_blocks)
+                   * ROOT_BLOCK_ENTRIES;
+    root_free_count -= root_count - count;
+    root_count = count;
+}
+
+// writes back the blocks of the root directory that changed
+// since they were last read or written.
+// Return: -1 if a block cannot be written. 0 otherwise.
+int root_flush(void) {
+    uint8_t root_block[BLOCK_SIZE];
+    for (size_t b = 0; b < root_count / ROOT_BLOCK_ENTRIES; ++b) {
+        uint8_t *on_disk = root_disk + b * BLOCK_SIZE;
+        root_block_encode(b, root_block);
+        if (memcmp(root_block, on_disk, BLOCK_SIZE) == 0) {
+            continue;
+        }
+        if (checked_write(root_block_index(b), 1, root_block) == -1) {
+            return -1;
+        }
+        memcpy(on_disk, root_block, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// Return: the name of root entry @entry, wherever it is.
+const char *entry_name(const struct root *entry) {
+    if (entry->name_len) {
+        return (const char *)name_heap + entry->name_offset;
+    }
+    return (const char *)entry->filename;
+}
+
+// names root entry @entry (which has no name) @filename, putting it
+// in the name heap if it doesn't fit the entry. The heap is only
+// compacted to make room if @compact is set (the offsets of the
+// entries it holds the names of change).
+// Return: -1 if the heap is full. 0 otherwise.
+int entry_set_name(struct root *entry, const char *filename, bool compact) {
+    size_t len = strlen(filename);
+    uint32_t offset = 0;
+    if (len >= FS_FILENAME_LEN) {
+        if (name_heap_add(filename, len, compact) == -1) {
+            return -1;
+        }
+        offset = (uint32_t)(name_heap_used - len - 1);
+    }
+    memset(entry->filename, 0, FS_FILENAME_LEN);
+    memcpy(entry->filename, filename,
+           len < FS_FILENAME_LEN ? len : FS_FILENAME_LEN - 1);
+    entry->name_len = len < FS_FILENAME_LEN ? 0 : (uint16_t)len;
+    entry->name_offset = offset;
+    entry->name_hash = filename_hash(filename);
+    return 0;
+}
+
+// takes the name of root entry @entry away, its
+// copy in the name heap (if any) becoming garbage.
+void entry_clear_name(struct root *entry) {
+    if (entry->name_len) {
+        name_heap_garbage += entry->name_len + 1;
+    }
+    memset(entry->filename, 0, FS_FILENAME_LEN);
+    entry->name_len = 0;
+    entry->name_offset = 0;
+    entry->name_hash = 0;
+}
+
+// reads the name heap (on the large format), one cluster per I/O.
+// How much of it is used is only known once the root directory is.
+// Return: -1 if the heap cannot be read. 0 otherwise.
+int name_heap_load(void) {
+    if (!sb->fat32) {
+        return 0;
+    }
+    uint32_t first = ((struct superblock32 *)sb->raw)->name_chain;
+    if (chain_load(first, &name_clusters, &name_cluster_count) == -1) {
+        return -1;
+    }
+    size_t capacity = name_cluster_count * sb->cluster_size;
+    name_heap = malloc(capacity ? capacity : 1);
+    name_disk = malloc(capacity ? capacity : 1);
+    if (!name_heap || !name_disk) {
+        return -1;
+    }
+    for (size_t i = 0; i < name_cluster_count; ++i) {
+        if (checked_read(sb->data_block_index
+                         + (uint64_t)name_clusters[i] * sb->cluster_blocks,
+                         sb->cluster_blocks,
+                         name_disk + i * sb->cluster_size) == -1) {
+            return -1;
+        }
+    }
+    memcpy(name_heap, name_disk, capacity);
+    return 0;
+}
+
+// appends @filename (of @len bytes, and its NULL character) to the
+// name heap. If there isn't enough room, the heap is compacted first
+// when @compact is set and at least half of it is garbage, and grows
+// by as many clusters as needed otherwise.
+// Return: -1 if the heap cannot grow. 0 otherwise.
+int name_heap_add(const char *filename, size_t len, bool compact) {
+    size_t capacity = name_cluster_count * sb->cluster_size;
+    if (name_heap_used + len + 1 > capacity && compact
+        && name_heap_garbage >= name_heap_used / 2) {
+        name_heap_compact();
+    }
+    while (name_heap_used + len + 1 > capacity) {
+        uint8_t *heap = realloc(name_heap, capacity + sb->cluster_size);
+        if (!heap) {
+            return -1;
+        }
+        name_heap = heap;
+        uint8_t *disk = realloc(name_disk, capacity + sb->cluster_size);
+        if (!disk) {
+            return -1;
+        }
+        name_disk = disk;
+        if (chain_grow(&name_clusters, &name_cluster_count) == -1) {
+            return -1;
+        }
+        memset(name_heap + capacity, 0, sb->cluster_size);
+        memset(name_disk + capacity, 0, sb->cluster_size);
+        capacity += sb->cluster_size;
+    }
+    memcpy(name_heap + name_heap_used, filename, len + 1);
+    name_mark_dirty(name_heap_used, name_heap_used + len + 1);
+    name_heap_used += len + 1;
+    return 0;
+}
+
+// gives back the clusters name_heap_add() added after the first
+// @cluster_count, which must hold none of the names in use.
+void name_heap_shrink(size_t cluster_count) {
+    if (cluster_count >= name_cluster_count) {
+        return;
+    }
+    chain_shrink(name_clusters, &name_cluster_count, cluster_count);
+    size_t capacity = cluster_count * sb->cluster_size;
+    name_dirty_hi = name_dirty_hi < capacity ? name_dirty_hi : capacity;
+}
+
+// packs the names in use at the start of the name heap, in the order
+// of their root entries, and drops the garbage. Nothing changes if
+// there isn't enough memory to do so.
+void name_heap_compact(void) {
+    size_t capacity = name_cluster_count * sb->cluster_size;
+    uint8_t *packed = calloc(1, capacity ? capacity : 1);
+    if (!packed) {
+        return;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < root_count; ++i) {
+        struct root *entry = &root_entries[i];
+        if (entry->filename[0] != '\0' && entry->name_len) {
+            memcpy(packed + used, name_heap + entry->name_offset,
+                   entry->name_len + 1);
+            entry->name_offset = (uint32_t)used;
+            used += entry->name_len + 1;
+            root_mark_dirty(i);
+        }
+    }
+    name_mark_dirty(0, name_heap_used);
+    free(name_heap);
+    name_heap = packed;
+    name_heap_used = used;
+    name_heap_garbage = 0;
+}
+
+// writes back the blocks of the name heap that changed since they
+// were last read or written, compacting it first if most of it
+// is garbage.
+// Return: -1 if a block cannot be written. 0 otherwise.
+int name_heap_flush(void) {
+    if (name_heap_garbage > name_heap_used / 2) {
+        name_heap_compact();
+    }
+    size_t blocks = name_cluster_count * sb->cluster_blocks;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint8_t *in_memory = name_heap + b * BLOCK_SIZE;
+        uint8_t *on_disk = name_disk + b * BLOCK_SIZE;
+        if (memcmp(in_memory, on_disk, BLOCK_SIZE) == 0) {
+            continue;
+        }
+        uint64_t block = sb->data_block_index
+                         + (uint64_t)name_clusters[b / sb->cluster_blocks]
+                           * sb->cluster_blocks
+                         + b % sb->cluster_blocks;
+        if (checked_write(block, 1, in_memory) == -1) {
+            return -1;
+        }
+        memcpy(on_disk, in_memory, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// checks that @filename is a usable file name: non-empty and short
+// enough for the format, along with its NULL character (the classic
+// format only has the room of a root entry, the large one can put
+// longer names in the name heap).
+// Return: -1 if @filename is invalid. 0 otherwise.
+int filename_check(const char *filename) {
+    if (!filename) {
+        return -1;
+    }
+    size_t max_len = sb->fat32 ? FS_LONG_FILENAME_LEN : FS_FILENAME_LEN;
+    size_t len = strnlen(filename, max_len);
+    if (len >= max_len || len == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Return: 1 if root entry @entry is referenced by an open
+// file descriptor. 0 otherwise.
+int entry_is_open(int entry) {
+    return root_entries[entry].open_count > 0;
+}
+
+// frees every FAT entry of the chain starting at @first_db_num
+// by setting it back to 0. Stops at FAT_EOC, or at anything that
+// can't be a valid entry in case the chain is corrupted. With a
+// journal, the clusters are only handed out again once that is
+// committed (see journal_free_cluster()).
+void free_fat_chain(size_t first_db_num) {
+    size_t cur_entry = first_db_num;
+
+    while (cur_entry != FAT_EOC && cur_entry != 0
+           && cur_entry < sb->total_clusters) {
+        size_t next_entry = fat_get(cur_entry);
+        if (journal_active) {
+            journal_free_cluster(cur_entry);
+            cur_entry = next_entry;
+            continue;
+        }
+        fat_set(cur_entry, 0);
+        if (cur_entry < fat_free_hint) {
+            fat_free_hint = cur_entry;
+        }
+        cur_entry = next_entry;
+    }
+}
+
+// frees the data of @file: its chain, or its fragment if it's packed.
+void free_file_data(const struct root *file) {
+    if (file->flags & ROOT_PACKED) {
+        pack_free(file->first_db_num, file->pack_unit,
+                  pack_units(file->filesize));
+        return;
+    }
+    free_fat_chain(file->first_db_num);
+}
+
+static int cluster_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// builds packs[] from the packed files of the root directory.
+// Return: -1 if a fragment doesn't fit in a block of a cluster
+// of the disk, or if there is not enough memory. 0 otherwise.
+int pack_load(void) {
+    size_t units_max = sb->cluster_size / PACK_UNIT;
+    size_t count = 0;
+    for (size_t i = 0; i < root_count; ++i) {
+        struct root *file = &root_entries[i];
+        if (file->filename[0] == '\0' || !(file->flags & ROOT_PACKED)) {
+            continue;
+        }
+        size_t units = pack_units(file->filesize);
+        if (file->filesize == 0 || file->filesize > PACK_MAX
+            || file->first_db_num >= sb->total_clusters
+            || file->pack_unit + units > units_max
+            || file->pack_unit % PACK_BLOCK_UNITS + units
+               > PACK_BLOCK_UNITS) {
+            return -1;
+        }
+        ++count;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // every pack cluster, once
+    uint32_t *clusters = malloc(count * sizeof(uint32_t));
+    if (!clusters) {
+        return -1;
+    }
+    count = 0;
+    for (size_t i = 0; i < root_count; ++i) {
+        if (root_entries[i].filename[0] != '\0'
+            && (root_entries[i].flags & ROOT_PACKED)) {
+            clusters[count++] = root_entries[i].first_db_num;
+        }
+    }
+    qsort(clusters, count, sizeof(uint32_t), cluster_compare);
+    packs = calloc(count, sizeof(struct pack));
+    if (!packs) {
+        free(clusters);
+        return -1;
+    }
+    pack_cap = count;
+    size_t words = (units_max + 63) / 64;
+    for (size_t i = 0; i < count; ++i) {
+        if (pack_count > 0 && packs[pack_count - 1].cluster == clusters[i]) {
+            continue;
+        }
+        struct pack *pack = &packs[pack_count++];
+        pack->cluster = clusters[i];
+        pack->free_units = (uint32_t)units_max;
+        pack->used = calloc(words, sizeof(uint64_t));
+        if (!pack->used) {
+            free(clusters);
+            return -1;
+        }
+    }
+    free(clusters);
+
+    for (size_t i = 0; i < root_count; ++i) {
+        struct root *file = &root_entries[i];
+        if (file->filename[0] != '\0' && (file->flags & ROOT_PACKED)) {
+            struct pack *pack = pack_find(file->first_db_num);
+            pack_mark(pack, file->pack_unit, pack_units(file->filesize),
+                      true);
+            ++pack->fragments;
+        }
+    }
+    return 0;
+}
+
+// frees packs[] and the fragments waiting to be freed.
+void pack_release(void) {
+    for (size_t i = 0; i < pack_count; ++i) {
+        free(packs[i].used);
+    }
+    free(packs);
+    free(pack_freed);
+    packs = NULL;
+    pack_count = 0;
+    pack_cap = 0;
+    pack_current = 0;
+    pack_freed = NULL;
+    pack_freed_count = 0;
+    pack_freed_cap = 0;
+}
+
+// Return: the index of pack cluster @cluster in packs[], or where
+// it would go if it's not there.
+size_t pack_index(uint32_t cluster) {
+    size_t lo = 0;
+    size_t hi = pack_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (packs[mid].cluster < cluster) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Return: pack cluster @cluster, or NULL if there is none.
+struct pack *pack_find(uint32_t cluster) {
+    size_t i = pack_index(cluster);
+    return i < pack_count && packs[i].cluster == cluster ? &packs[i] : NULL;
+}
+
+// allocates an empty pack cluster.
+// Return: NULL if there is no space left or not enough memory.
+// Otherwise the new pack.
+struct pack *pack_new(void) {
+    if (pack_count == pack_cap) {
+        size_t cap = pack_cap ? pack_cap * 2 : 64;
+        struct pack *grown = realloc(packs, cap * sizeof(struct pack));
+        if (!grown) {
+            return NULL;
+        }
+        packs = grown;
+        pack_cap = cap;
+    }
+    size_t units_max = sb->cluster_size / PACK_UNIT;
+    uint64_t *used = calloc((units_max + 63) / 64, sizeof(uint64_t));
+    size_t cluster = FAT_EOC;
+    if (!used || set_multi_fat(FAT_EOC, 1, &cluster) == 0) {
+        free(used);
+        return NULL;
+    }
+
+    size_t i = pack_index((uint32_t)cluster);
+    memmove(&packs[i + 1], &packs[i], (pack_count - i) * sizeof(struct pack));
+    ++pack_count;
+    packs[i].cluster = (uint32_t)cluster;
+    packs[i].fragments = 0;
+    packs[i].free_units = (uint32_t)units_max;
+    packs[i].used = used;
+    return &packs[i];
+}
+
+// frees @pack, which no fragment uses anymore, and its cluster.
+void pack_drop(struct pack *pack) {
+    uint32_t cluster = pack->cluster;
+    // its fragments waiting to be freed go with it
+    size_t kept = 0;
+    for (size_t i = 0; i < pack_freed_count; ++i) {
+        if (pack_freed[i].cluster != cluster) {
+            pack_freed[kept++] = pack_freed[i];
+        }
+    }
+    pack_freed_count = kept;
+
+    free(pack->used);
+    size_t i = (size_t)(pack - packs);
+    memmove(&packs[i], &packs[i + 1],
+            (pack_count - i - 1) * sizeof(struct pack));
+    --pack_count;
+    if (pack_current == cluster) {
+        pack_current = 0;
+    }
+    free_fat_chain(cluster);
+}
+
+// looks for @units free units in a row in a single block of @pack.
+// Return: true if there are, the first one going in @unit.
+bool pack_fit(const struct pack *pack, size_t units, uint16_t *unit) {
+    if (pack->free_units < units) {
+        return false;
+    }
+    size_t units_max = sb->cluster_size / PACK_UNIT;
+    size_t run = 0;
+    for (size_t u = 0; u < units_max; ++u) {
+        if (u % PACK_BLOCK_UNITS == 0) {
+            run = 0; // fragments don't cross blocks
+        }
+        if (u % 64 == 0 && pack->used[u / 64] == UINT64_MAX) {
+            run = 0;
+            u += 63;
+            continue;
+        }
+        if (pack->used[u / 64] >> (u % 64) & 1) {
+            run = 0;
+        }
+        else if (++run == units) {
+            *unit = (uint16_t)(u + 1 - units);
+            return true;
+        }
+    }
+    return false;
+}
+
+// marks the @units units from unit @unit of @pack as @used or free.
+void pack_mark(struct pack *pack, size_t unit, size_t units, bool used) {
+    for (size_t u = unit; u < unit + units; ++u) {
+        if (used) {
+            pack->used[u / 64] |= (uint64_t)1 << (u % 64);
+        }
+        else {
+            pack->used[u / 64] &= ~((uint64_t)1 << (u % 64));
+        }
+    }
+    if (used) {
+        pack->free_units -= (uint32_t)units;
+    }
+    else {
+        pack->free_units += (uint32_t)units;
+    }
+}
+
+// Return: whether units of the block holding the @units units from
+// unit @unit of @pack are in use, besides those.
+bool pack_block_shared(const struct pack *pack, size_t unit, size_t units) {
+    size_t first = unit - unit % PACK_BLOCK_UNITS;
+    for (size_t u = first; u < first + PACK_BLOCK_UNITS; ++u) {
+        if ((u < unit || u >= unit + units)
+            && (pack->used[u / 64] >> (u % 64) & 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// finds room for a fragment of @units units (at most PACK_BLOCK_UNITS):
+// in the pack the previous one went to, or in one of the PACK_SCAN
+// packs after pack_scan, or else in a new pack.
+// Return: -1 if there is no space left or not enough memory. 0 otherwise,
+// the fragment at unit @unit of cluster @cluster being in use.
+int pack_alloc(size_t units, uint32_t *cluster, uint16_t *unit) {
+    struct pack *pack = pack_current ? pack_find(pack_current) : NULL;
+    if (pack && !pack_fit(pack, units, unit)) {
+        pack = NULL;
+    }
+    for (size_t i = 0; !pack && i < PACK_SCAN && i < pack_count; ++i) {
+        if (pack_scan >= pack_count) {
+            pack_scan = 0;
+        }
+        struct pack *candidate = &packs[pack_scan++];
+        if (pack_fit(candidate, units, unit)) {
+            pack = candidate;
+        }
+    }
+    if (!pack) {
+        pack = pack_new();
+        if (!pack) {
+            return -1;
+        }
+        pack_fit(pack, units, unit);
+    }
+    pack_mark(pack, *unit, units, true);
+    ++pack->fragments;
+    *cluster = pack->cluster;
+    pack_current = pack->cluster;
+    return 0;
+}
+
+// frees the fragment of @units units at unit @unit of pack cluster
+// @cluster, and the cluster along with its last fragment. With a
+// journal, the units are only handed out again once that's committed
+// (if there is no memory to remember that, they are freed right away).
+void pack_free(uint32_t cluster, size_t unit, size_t units) {
+    struct pack *pack = pack_find(cluster);
+    if (!pack) {
+        return;
+    }
+    if (--pack->fragments == 0) {
+        pack_drop(pack);
+        return;
+    }
+    if (journal_active) {
+        if (pack_freed_count == pack_freed_cap) {
+            size_t cap = pack_freed_cap ? pack_freed_cap * 2 : 256;
+            struct pack_freed *freed =
+                    realloc(pack_freed, cap * sizeof(struct pack_freed));
+            if (freed) {
+                pack_freed = freed;
+                pack_freed_cap = cap;
+            }
+        }
+        if (pack_freed_count < pack_freed_cap) {
+            struct pack_freed *freed = &pack_freed[pack_freed_count++];
+            freed->cluster = cluster;
+            freed->unit = (uint16_t)unit;
+            freed->units = (uint16_t)units;
+            freed->sequence = journal_seq;
+            return;
+        }
+    }
+    pack_mark(pack, unit, units, false);
+}
+
+// frees the fragments whose freeing is durable, as of transaction
+// @durable (see journal_release_freed()).
+void pack_release_freed(uint64_t durable) {
+    size_t i = 0;
+    for (; i < pack_freed_count && pack_freed[i].sequence <= durable; ++i) {
+        struct pack *pack = pack_find(pack_freed[i].cluster);
+        if (pack) {
+            pack_mark(pack, pack_freed[i].unit, pack_freed[i].units, false);
+        }
+    }
+    if (i > 0) {
+        memmove(pack_freed, pack_freed + i,
+                (pack_freed_count - i) * sizeof(struct pack_freed));
+        pack_freed_count -= i;
+    }
+}
+
+// writes the in-memory metadata back to the disk, in place or (with a
+// journal) through a checkpoint. The summary in the superblock is
+// marked @clean (on unmount) or not.
+// Return: -1 if any of the writes failed. 0 otherwise.
+int flush_metadata(bool clean) {
+    return journal_active ? journal_checkpoint(clean) : metadata_write(clean);
+}
+
+// writes the in-memory metadata in place: the FAT blocks first, then
+// the root directory, and finally the superblock, each converted back
+// to the on-disk format it was loaded from. The summary only reaches
+// the disk once the FAT and root directory it sums up have.
+// Return: -1 if any of the writes failed. 0 otherwise.
+int metadata_write(bool clean) {
+    if (sb->fat32) {
+        struct superblock32 *sb32 = (struct superblock32 *)sb->raw;
+        sb32->total_blocks = sb->total_blocks;
+        sb32->root_dir_index = sb->root_dir_index;
+        sb32->data_block_index = sb->data_block_index;
+        sb32->total_data_blocks = sb->total_data_blocks;
+        sb32->total_fat_blocks = sb->total_fat_blocks;
+        sb32->cluster_blocks = sb->cluster_blocks;
+        sb32->csum_blocks = sb->csum_blocks;
+        sb32->journal_blocks = sb->journal_blocks;
+        sb32->root_chain = root_cluster_count ? root_clusters[0] : 0;
+        sb32->name_chain = name_cluster_count ? name_clusters[0] : 0;
+    }
+    else {
+        struct superblock16 *sb16 = (struct superblock16 *)sb->raw;
+        sb16->total_blocks = (uint16_t)sb->total_blocks;
+        sb16->root_dir_index = (uint16_t)sb->root_dir_index;
+        sb16->data_block_index = (uint16_t)sb->data_block_index;
+        sb16->total_data_blocks = (uint16_t)sb->total_data_blocks;
+        sb16->total_fat_blocks = (uint8_t)sb->total_fat_blocks;
+    }
+    summary_store(clean);
+
+    if (fat_cache_flush() == -1) {
+        return -1;
+    }
+
+    // the names, then the entries that point to them
+    if (name_heap_flush() == -1 || root_flush() == -1) {
+        return -1;
+    }
+    if (checked_write(0, 1, sb->raw) == -1) {
+        return -1;
+    }
+
+    // last, the checksums of everything written so far
+    if (sb->csum_blocks
+        && block_write_range(sb->root_dir_index + 1, sb->csum_blocks,
+                             sb->csums) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the header of the journal of the disk being mounted, then the
+// transactions that follow it, keeping their records in
+// journal_replay_buf (journal_recovering is set if there are any). The
+// chain pointers of the last one replace those of the superblock.
+// Return: -1 if the journal cannot be read or its header is invalid.
+// 0 otherwise.
+int journal_load(void) {
+    uint64_t first = sb->data_block_index - sb->journal_blocks;
+    uint8_t *buf = malloc(BLOCK_SIZE);
+    if (!buf || block_read_range(first, 1, buf) == -1) {
+        free(buf);
+        return -1;
+    }
+    struct journal_header header;
+    memcpy(&header, buf, sizeof(header));
+    uint32_t crc = header.crc;
+    header.crc = 0;
+    if (header.magic != JOURNAL_MAGIC
+        || crc32c(0, &header, sizeof(header)) != crc) {
+        free(buf);
+        return -1;
+    }
+    journal_seq = header.sequence;
+
+    size_t pos = 1;
+    while (pos < sb->journal_blocks) {
+        if (block_read_range(first + pos, 1, buf) == -1) {
+            free(buf);
+            return -1;
+        }
+        struct journal_txn txn;
+        memcpy(&txn, buf, sizeof(txn));
+        size_t room = (sb->journal_blocks - pos) * BLOCK_SIZE - sizeof(txn);
+        if (txn.magic != JOURNAL_TXN_MAGIC || txn.sequence != journal_seq
+            || txn.length > room) {
+            break;
+        }
+        size_t length = sizeof(txn) + txn.length;
+        size_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint8_t *grown = realloc(buf, blocks * BLOCK_SIZE);
+        if (!grown) {
+            free(buf);
+            return -1;
+        }
+        buf = grown;
+        if (blocks > 1 && block_read_range(first + pos + 1, blocks - 1,
+                                           buf + BLOCK_SIZE) == -1) {
+            free(buf);
+            return -1;
+        }
+        memset(buf + offsetof(struct journal_txn, crc), 0, sizeof(uint32_t));
+        if (crc32c(0, buf, length) != txn.crc) {
+            break;
+        }
+
+        // a transaction with a record that makes no sense is
+        // as good as torn, and so are the ones that follow
+        bool valid = true;
+        for (size_t at = sizeof(txn); valid && at < length;) {
+            struct journal_record record;
+            if (length - at < sizeof(record)) {
+                valid = false;
+                break;
+            }
+            memcpy(&record, buf + at, sizeof(record));
+            size_t item = journal_item_size(record.type);
+            valid = item && record.length % item == 0
+                    && record.length <= length - at - sizeof(record);
+            at += sizeof(record) + record.length;
+        }
+        if (!valid) {
+            break;
+        }
+        uint8_t *replay = realloc(journal_replay_buf,
+                                  journal_replay_len + txn.length);
+        if (!replay) {
+            free(buf);
+            return -1;
+        }
+        journal_replay_buf = replay;
+        memcpy(journal_replay_buf + journal_replay_len, buf + sizeof(txn),
+               txn.length);
+        journal_replay_len += txn.length;
+
+        struct superblock32 *sb32 = (struct superblock32 *)sb->raw;
+        sb32->root_chain = txn.root_chain;
+        sb32->name_chain = txn.name_chain;
+        journal_recovering = true;
+        pos += blocks;
+        ++journal_seq;
+    }
+    free(buf);
+    return 0;
+}
+
+// applies the replayed records of type @type: those of the FAT and of
+// the checksums go straight there, the others patch @image (the root
+// directory as on disk, or the name heap), of @size bytes.
+// Return: -1 if a record is out of bounds. 0 otherwise.
+int journal_replay(uint16_t type, uint8_t *image, size_t size) {
+    size_t at = 0;
+    while (at < journal_replay_len) {
+        struct journal_record record;
+        memcpy(&record, journal_replay_buf + at, sizeof(record));
+        const uint8_t *values = journal_replay_buf + at + sizeof(record);
+        at += sizeof(record) + record.length;
+        if (record.type != type) {
+            continue;
+        }
+        uint64_t count = record.length / journal_item_size(type);
+        if (type == JOURNAL_FAT) {
+            if (record.key > sb->total_clusters
+                || count > sb->total_clusters - record.key) {
+                return -1;
+            }
+            for (uint64_t i = 0; i < count; ++i) {
+                uint32_t value;
+                memcpy(&value, values + i * sizeof(value), sizeof(value));
+                fat_store(record.key + i, value);
+            }
+        }
+        else if (type == JOURNAL_CSUM) {
+            if (!sb->csums || record.key > sb->total_blocks
+                || count > sb->total_blocks - record.key) {
+                return -1;
+            }
+            memcpy(&sb->csums[record.key], values, record.length);
+        }
+        else {
+            uint64_t offset = record.key * journal_item_size(type);
+            if (record.key > size || offset > size
+                || record.length > size - offset) {
+                return -1;
+            }
+            memcpy(image + offset, values, record.length);
+        }
+    }
+    return 0;
+}
+
+// starts journaling the changes to the metadata just loaded, whose
+// root directory is as logged. The journal is empty from
+// journal_seq on, up to the next commit.
+// Return: -1 if there is not enough memory. 0 otherwise.
+int journal_start(const struct fs_mount_opts *opts) {
+    journal_buf = malloc(BLOCK_SIZE);
+    if (!journal_buf) {
+        return -1;
+    }
+    journal_cap = BLOCK_SIZE;
+    journal_len = sizeof(struct journal_txn);
+    journal_last = 0;
+    journal_overflow = false;
+    journal_pos = 1;
+    memcpy(root_logged, root_disk, root_count / ROOT_BLOCK_ENTRIES
+                                   * BLOCK_SIZE);
+    journal_sync_ops = opts && opts->journal_sync;
+    pthread_mutex_lock(&journal_lock);
+    journal_durable = journal_seq - 1;
+    journal_broken = false;
+    pthread_mutex_unlock(&journal_lock);
+    journal_active = true;
+    return 0;
+}
+
+// frees what journaling and replaying hold, and stops journaling.
+void journal_free(void) {
+    free(journal_buf);
+    free(journal_freed);
+    free(journal_replay_buf);
+    journal_buf = NULL;
+    journal_cap = 0;
+    journal_len = 0;
+    journal_freed = NULL;
+    journal_freed_count = 0;
+    journal_freed_cap = 0;
+    journal_replay_buf = NULL;
+    journal_replay_len = 0;
+    journal_recovering = false;
+    journal_active = false;
+    root_dirty_any = false;
+    name_dirty_lo = SIZE_MAX;
+    name_dirty_hi = 0;
+}
+
+// Return: the size of the items of the records of type @type,
+// or 0 if there is no such type.
+size_t journal_item_size(uint16_t type) {
+    switch (type) {
+    case JOURNAL_FAT:
+    case JOURNAL_CSUM:
+        return sizeof(uint32_t);
+    case JOURNAL_ROOT:
+        return sizeof(struct root32);
+    case JOURNAL_NAMES:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// logs the new values of @count consecutive items of type @type, from
+// item @key on, in @values. They overwrite or extend the last record
+// when they are within it or right after it. Past the capacity of the
+// journal, or if there is not enough memory, the records are dropped
+// (journal_overflow), and the next commit is a checkpoint.
+void journal_put(uint16_t type, uint64_t key, const void *values,
+                 size_t count) {
+    if (journal_overflow) {
+        return;
+    }
+    size_t item = journal_item_size(type);
+    size_t len = count * item;
+    struct journal_record last = { 0 };
+    if (journal_last) {
+        memcpy(&last, journal_buf + journal_last, sizeof(last));
+    }
+    uint64_t last_count = last.length / item;
+    bool extend = journal_last && last.type == type && key >= last.key
+                  && key <= last.key + last_count;
+    size_t grow = extend ? (key + count > last.key + last_count
+                            ? (key + count - last.key - last_count) * item
+                            : 0)
+                         : sizeof(last) + len;
+
+    if (journal_len + grow > journal_cap) {
+        size_t limit = (size_t)(sb->journal_blocks - 1) * BLOCK_SIZE;
+        size_t cap = journal_cap ? journal_cap : BLOCK_SIZE;
+        while (cap < journal_len + grow) {
+            cap *= 2;
+        }
+        uint8_t *buf = journal_len + grow <= limit
+                       ? realloc(journal_buf, cap) : NULL;
+        if (!buf) {
+            journal_overflow = true;
+            return;
+        }
+        journal_buf = buf;
+        journal_cap = cap;
+    }
+
+    if (extend) {
+        size_t at = journal_last + sizeof(last) + (key - last.key) * item;
+        memcpy(journal_buf + at, values, len);
+        last.length += grow;
+        memcpy(journal_buf + journal_last, &last, sizeof(last));
+        journal_len += grow;
+        return;
+    }
+    struct journal_record record = {
+        .type = type,
+        .length = (uint32_t)len,
+        .key = key
+    };
+    journal_last = journal_len;
+    memcpy(journal_buf + journal_len, &record, sizeof(record));
+    memcpy(journal_buf + journal_len + sizeof(record), values, len);
+    journal_len += sizeof(record) + len;
+}
+
+// frees cluster @cluster as far as the journal is concerned, but keeps
+// it in use until the change is durable (if there is no memory to
+// remember that, it is freed right away).
+void journal_free_cluster(size_t cluster) {
+    uint32_t free_value = 0;
+    journal_put(JOURNAL_FAT, cluster, &free_value, 1);
+    if (journal_freed_count == journal_freed_cap) {
+        size_t cap = journal_freed_cap ? journal_freed_cap * 2 : 256;
+        struct journal_freed *freed =
+                realloc(journal_freed, cap * sizeof(struct journal_freed));
+        if (!freed) {
+            fat_store(cluster, 0);
+            if (cluster < fat_free_hint) {
+                fat_free_hint = cluster;
+            }
+            return;
+        }
+        journal_freed = freed;
+        journal_freed_cap = cap;
+    }
+    fat_store(cluster, FAT_EOC);
+    journal_freed[journal_freed_count].cluster = (uint32_t)cluster;
+    journal_freed[journal_freed_count].sequence = journal_seq;
+    ++journal_freed_count;
+}
+
+// frees the clusters (and fragments) whose freeing is durable, as of
+// transaction @durable (they are already free in the journal).
+void journal_release_freed(uint64_t durable) {
+    pack_release_freed(durable);
+    size_t i = 0;
+    for (; i < journal_freed_count && journal_freed[i].sequence <= durable;
+         ++i) {
+        uint32_t cluster = journal_freed[i].cluster;
+        fat_store(cluster, 0);
+        if (cluster < fat_free_hint) {
+            fat_free_hint = cluster;
+        }
+    }
+    if (i > 0) {
+        memmove(journal_freed, journal_freed + i,
+                (journal_freed_count - i) * sizeof(struct journal_freed));
+        journal_freed_count -= i;
+    }
+}
+
+// notes that root entry @entry changed, for the next commit.
+void root_mark_dirty(size_t entry) {
+    if (journal_active) {
+        root_dirty[entry / ROOT_BLOCK_ENTRIES] = true;
+        root_dirty_any = true;
+    }
+}
+
+// notes that root entry @entry changed in a way fs_list() shows.
+void entry_changed(size_t entry) {
+    root_mark_dirty(entry);
+    ++dir_version;
+}
+
+// notes that bytes @lo to @hi (excluded) of the name
+// heap changed, for the next commit.
+void name_mark_dirty(size_t lo, size_t hi) {
+    if (journal_active) {
+        name_dirty_lo = lo < name_dirty_lo ? lo : name_dirty_lo;
+        name_dirty_hi = hi > name_dirty_hi ? hi : name_dirty_hi;
+    }
+}
+
+// Return: true if there are changes that are not committed yet.
+bool journal_pending(void) {
+    return journal_len > sizeof(struct journal_txn) || journal_overflow
+           || root_dirty_any || name_dirty_hi > name_dirty_lo;
+}
+
+// turns the root entries and names that changed since the last
+// commit into records: one per run of changed entries, compared to
+// what the journal has, and one for the changed part of the heap.
+void journal_seal(void) {
+    uint8_t root_block[BLOCK_SIZE];
+    for (size_t b = 0; root_dirty_any && b < root_count / ROOT_BLOCK_ENTRIES;
+         ++b) {
+        if (!root_dirty[b]) {
+            continue;
+        }
+        root_dirty[b] = false;
+        uint8_t *logged = root_logged + b * BLOCK_SIZE;
+        root_block_encode(b, root_block);
+        for (size_t i = 0; i < ROOT_BLOCK_ENTRIES; ++i) {
+            size_t at = i * sizeof(struct root32);
+            if (memcmp(root_block + at, logged + at,
+                       sizeof(struct root32)) != 0) {
+                journal_put(JOURNAL_ROOT, b * ROOT_BLOCK_ENTRIES + i,
+                            root_block + at, 1);
+            }
+        }
+        memcpy(logged, root_block, BLOCK_SIZE);
+    }
+    root_dirty_any = false;
+    if (name_dirty_hi > name_dirty_lo) {
+        journal_put(JOURNAL_NAMES, name_dirty_lo,
+                    name_heap + name_dirty_lo, name_dirty_hi - name_dirty_lo);
+    }
+    name_dirty_lo = SIZE_MAX;
+    name_dirty_hi = 0;
+}
+
+// makes a transaction of the sealed records, at the current position
+// of the log, and starts collecting the next one.
+// Return: false if it doesn't fit in the log, or records were dropped.
+// true otherwise, @io then owning the transaction.
+bool journal_prepare(struct journal_io *io) {
+    size_t blocks = (journal_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (journal_overflow || blocks > sb->journal_blocks - journal_pos) {
+        return false;
+    }
+    if (blocks * BLOCK_SIZE > journal_cap) {
+        uint8_t *buf = realloc(journal_buf, blocks * BLOCK_SIZE);
+        if (!buf) {
+            return false;
+        }
+        journal_buf = buf;
+        journal_cap = blocks * BLOCK_SIZE;
+    }
+    memset(journal_buf + journal_len, 0, blocks * BLOCK_SIZE - journal_len);
+    struct journal_txn txn = {
+        .magic = JOURNAL_TXN_MAGIC,
+        .sequence = journal_seq,
+        .length = (uint32_t)(journal_len - sizeof(txn)),
+        .root_chain = root_cluster_count ? root_clusters[0] : 0,
+        .name_chain = name_cluster_count ? name_clusters[0] : 0
+    };
+    memcpy(journal_buf, &txn, sizeof(txn));
+
+    io->buf = journal_buf;
+    io->length = journal_len;
+    io->block = sb->data_block_index - sb->journal_blocks + journal_pos;
+    io->blocks = blocks;
+    io->sequence = journal_seq++;
+    journal_pos += blocks;
+    journal_buf = NULL;
+    journal_cap = 0;
+    journal_len = sizeof(struct journal_txn);
+    journal_last = 0;
+    return true;
+}
+
+// writes the transaction of @io to the log and waits for it (and
+// whatever was written before it) to reach stable storage. Doesn't
+// need the library lock.
+// Return: -1 if writing fails. 0 otherwise.
+int journal_write(struct journal_io *io) {
+    uint32_t crc = crc32c(0, io->buf, io->length);
+    memcpy(io->buf + offsetof(struct journal_txn, crc), &crc, sizeof(crc));
+    int ret = block_write_range(io->block, io->blocks, io->buf);
+    free(io->buf);
+    io->buf = NULL;
+    return ret == -1 ? -1 : block_sync();
+}
+
+// writes the header of the journal, transaction @sequence being
+// the first one to replay.
+// Return: -1 if writing fails. 0 otherwise.
+int journal_header_write(uint64_t sequence) {
+    uint8_t block[BLOCK_SIZE] = { 0 };
+    struct journal_header header = {
+        .magic = JOURNAL_MAGIC,
+        .sequence = sequence
+    };
+    header.crc = crc32c(0, &header, sizeof(header));
+    memcpy(block, &header, sizeof(header));
+    return block_write_range(sb->data_block_index - sb->journal_blocks, 1,
+                             block);
+}
+
+// waits for the journal to be free, and claims it.
+// Return: the last durable transaction.
+uint64_t journal_claim(void) {
+    pthread_mutex_lock(&journal_lock);
+    while (journal_busy) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    journal_busy = true;
+    uint64_t durable = journal_durable;
+    pthread_mutex_unlock(&journal_lock);
+    return durable;
+}
+
+// gives the journal back, transactions up to @durable
+// having reached stable storage.
+void journal_done(uint64_t durable) {
+    pthread_mutex_lock(&journal_lock);
+    if (durable > journal_durable) {
+        journal_durable = durable;
+    }
+    journal_busy = false;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// becomes the one writing the next transaction, which takes every
+// change so far, unless transaction @sequence is durable already. When
+// the log is close to full, a checkpoint is made instead.
+// Return: -1 if the checkpoint fails. 1 if @io holds a transaction to
+// write, the journal being claimed. 0 otherwise.
+int journal_begin(uint64_t sequence, struct journal_io *io) {
+    FS_LOCK();
+    uint64_t durable = journal_claim();
+    if (durable >= sequence || !journal_active) {
+        journal_done(0);
+        return durable >= sequence ? 0 : -1;
+    }
+    journal_release_freed(durable);
+    journal_seal();
+    if (!journal_pending()) {
+        journal_done(journal_seq - 1);
+        return 0;
+    }
+    // a quarter of the log is kept for the checkpoint's transaction
+    size_t blocks = (journal_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t room = sb->journal_blocks - journal_pos;
+    if (journal_broken || blocks + (sb->journal_blocks - 1) / 4 > room
+        || !journal_prepare(io)) {
+        journal_done(0);
+        return flush_metadata(false);
+    }
+    return 1;
+}
+
+// waits until transaction @sequence is durable, writing it if no other
+// thread is. Must not be called with the journal claimed.
+// Return: -1 if writing fails. 0 otherwise.
+int journal_wait(uint64_t sequence) {
+    for (;;) {
+        pthread_mutex_lock(&journal_lock);
+        while (journal_busy && journal_durable < sequence) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+        bool durable = journal_durable >= sequence;
+        pthread_mutex_unlock(&journal_lock);
+        if (durable) {
+            return 0;
+        }
+
+        struct journal_io io;
+        int ret = journal_begin(sequence, &io);
+        if (ret == 1) {
+            ret = journal_write(&io);
+            journal_broken = ret == -1;
+            journal_done(ret == 0 ? io.sequence : 0);
+        }
+        if (ret == -1) {
+            return -1;
+        }
+    }
+}
+
+// Return: the transaction that the changes so far belong to.
+uint64_t journal_ticket(void) {
+    return journal_pending() ? journal_seq : journal_seq - 1;
+}
+
+// tells whether the journal has to be committed once the library lock
+// is released: after every operation with the journal_sync option, and
+// whenever an eighth of the log's worth of records is pending.
+// Return: the transaction to wait for, or 0 if none.
+uint64_t journal_due(void) {
+    if (!journal_active || !journal_pending()) {
+        return 0;
+    }
+    size_t threshold = (size_t)(sb->journal_blocks - 1) * BLOCK_SIZE / 8;
+    if (!journal_sync_ops && journal_len < threshold && !journal_overflow) {
+        return 0;
+    }
+    return journal_seq;
+}
+
+// commits the changes so far and waits for them to be durable, then
+// frees the clusters that were waiting for it.
+// Return: -1 if writing fails. 0 otherwise.
+int journal_commit(void) {
+    if (journal_wait(journal_ticket()) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&journal_lock);
+    uint64_t durable = journal_durable;
+    pthread_mutex_unlock(&journal_lock);
+    journal_release_freed(durable);
+    return 0;
+}
+
+// writes the metadata in place, the changes pending being committed to
+// the log first, then empties the log. The heap is compacted before
+// that if it needs to be, so that the compaction is logged too. If the
+// pending changes don't fit in the log (or a write to it failed), the
+// log is emptied first instead, and the metadata written in place
+// without the journal's protection.
+// Return: -1 if any of the writes failed. 0 otherwise.
+int journal_checkpoint(bool clean) {
+    journal_claim();
+    if (name_heap_garbage > name_heap_used / 2) {
+        name_heap_compact();
+    }
+    journal_seal();
+
+    int ret = 0;
+    if (journal_pending()) {
+        struct journal_io io;
+        if (!journal_broken && journal_prepare(&io)) {
+            ret = journal_write(&io);
+        }
+        else {
+            journal_len = sizeof(struct journal_txn);
+            journal_last = 0;
+            journal_overflow = false;
+            ++journal_seq;
+            ret = journal_header_write(journal_seq);
+            if (ret == 0) {
+                ret = block_sync();
+            }
+        }
+    }
+    // everything is durable (or about to be in place)
+    journal_release_freed(UINT64_MAX);
+    if (ret == 0) {
+        ret = metadata_write(clean);
+    }
+    if (ret == 0) {
+        ret = block_sync();
+    }
+    if (ret == 0) {
+        ret = journal_reset();
+    }
+    journal_broken = ret == -1;
+    journal_done(ret == 0 ? journal_seq - 1 : 0);
+    return ret;
+}
+
+// empties the log once the metadata is in place, by moving the header
+// past every transaction written so far. The records written along
+// with the metadata are dropped.
+// Return: -1 if writing fails. 0 otherwise.
+int journal_reset(void) {
+    if (journal_header_write(journal_seq) == -1 || block_sync() == -1) {
+        return -1;
+    }
+    journal_pos = 1;
+    journal_len = sizeof(struct journal_txn);
+    journal_last = 0;
+    journal_overflow = false;
+    size_t blocks = root_count / ROOT_BLOCK_ENTRIES;
+    memset(root_dirty, 0, blocks * sizeof(bool));
+    memcpy(root_logged, root_disk, blocks * BLOCK_SIZE);
+    root_dirty_any = false;
+    name_dirty_lo = SIZE_MAX;
+    name_dirty_hi = 0;
+    return 0;
+}
+
+// without a journal, writes the metadata in place. With one, finds
+// out which transaction has the changes so far. Both happen under the
+// library lock, so that fs_umount() cannot release the metadata in the
+// meantime; waiting for the transaction is left to the caller.
+// Return: -1 if nothing is mounted or writing fails, 0 otherwise, and
+// the transaction to wait for in @sequence (0 if none).
+int sync_begin(uint64_t *sequence) {
+    FS_LOCK();
+    if (!sb) {
+        return -1;
+    }
+    if (mount_read_only) {
+        return 0;
+    }
+    // what compressed files hold in memory has to be stored first
+    if (chunk_flush_open() == -1) {
+        return -1;
+    }
+    if (!journal_active) {
+        return flush_metadata(false) == -1 ? -1 : block_sync();
+    }
+    *sequence = journal_ticket();
+    pthread_mutex_lock(&journal_lock);
+    bool durable = journal_durable >= *sequence;
+    pthread_mutex_unlock(&journal_lock);
+    if (durable) {
+        // only data could be left to sync
+        *sequence = 0;
+        return block_sync();
+    }
+    return 0;
+}
+
+// appends one operation to the pending batch, growing
+// batch_ops as needed. Return: -1 if out of memory, 0 otherwise.
+int batch_append(enum batch_op_type type, const char *filename,
+                 const char *new_filename) {
+    if (batch_count == batch_capacity) {
+        size_t new_capacity = batch_capacity ? batch_capacity * 2 : 64;
+        struct batch_op *new_ops =
+                realloc(batch_ops, new_capacity * sizeof(struct batch_op));
+        if (!new_ops) {
+            return -1;
+        }
+        batch_ops = new_ops;
+        batch_capacity = new_capacity;
+    }
+
+    struct batch_op *op = &batch_ops[batch_count++];
+    memset(op, 0, sizeof(struct batch_op));
+    op->type = type;
+    strcpy(op->filename, filename);
+    if (new_filename) {
+        strcpy(op->new_filename, new_filename);
+    }
+    return 0;
+}
+
+// (re)builds @index over the @count entries of @entries.
+// Return: -1 if there is not enough memory. 0 otherwise.
+int name_index_build(struct name_index *index,
+                     struct root *entries, size_t count) {
+    size_t bucket_count = NAME_INDEX_BUCKETS;
+    while (bucket_count < count / 2) {
+        bucket_count *= 2;
+    }
+    int *buckets = malloc(bucket_count * sizeof(int));
+    int *next = malloc((count ? count : 1) * sizeof(int));
+    if (!buckets || !next) {
+        free(buckets);
+        free(next);
+        return -1;
+    }
+    name_index_free(index);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+    index->next = next;
+    memset(buckets, -1, bucket_count * sizeof(int));
+    for (size_t i = count; i-- > 0;) {
+        if (entries[i].filename[0] != '\0') {
+            name_index_insert(index, entries, (int)i);
+        }
+    }
+    return 0;
+}
+
+// makes room in @index for @entries having grown to @count entries
+// (the new ones being empty), rebuilding it if it needs more buckets.
+// Return: -1 if there is not enough memory. 0 otherwise.
+int name_index_grow(struct name_index *index,
+                    struct root *entries, size_t count) {
+    if (count / 2 > index->bucket_count) {
+        return name_index_build(index, entries, count);
+    }
+    int *next = realloc(index->next, count * sizeof(int));
+    if (!next) {
+        return -1;
+    }
+    index->next = next;
+    return 0;
+}
+
+void name_index_free(struct name_index *index) {
+    free(index->buckets);
+    free(index->next);
+    index->buckets = NULL;
+    index->next = NULL;
+    index->bucket_count = 0;
+}
+
+// FNV-1a hash of @filename, looking at no more
+// than the FS_LONG_FILENAME_LEN bytes a name can have.
+uint32_t filename_hash(const char *filename) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < FS_LONG_FILENAME_LEN && filename[i] != '\0'; ++i) {
+        hash ^= (uint8_t)filename[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// adds root entry @entry of @entries to @index under its filename.
+void name_index_insert(struct name_index *index,
+                       struct root *entries, int entry) {
+    uint32_t bucket = entries[entry].name_hash % index->bucket_count;
+    index->next[entry] = index->buckets[bucket];
+    index->buckets[bucket] = entry;
+}
+
+// removes root entry @entry of @entries from @index. Must be called
+// before the entry's filename changes, since it picks the bucket.
+void name_index_remove(struct name_index *index,
+                       struct root *entries, int entry) {
+    uint32_t bucket = entries[entry].name_hash % index->bucket_count;
+    int *link = &index->buckets[bucket];
+    while (*link != -1) {
+        if (*link == entry) {
+            *link = index->next[entry];
+            return;
+        }
+        link = &index->next[*link];
+    }
+}
+
+// the entries' hashes are compared first, so that only
+// a match has its name looked at (in the heap if it is long).
+// Return: -1 if no entry of @entries named @filename is in @index.
+// Otherwise return the root entry index of @filename.
+int name_index_lookup(struct name_index *index,
+                      struct root *entries, const char *filename) {
+    uint32_t hash = filename_hash(filename);
+    uint32_t bucket = hash % index->bucket_count;
+    for (int i = index->buckets[bucket]; i != -1; i = index->next[i]) {
+        if (entries[i].name_hash == hash
+            && strcmp(entry_name(&entries[i]), filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
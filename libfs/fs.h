@@ -1,17 +1,80 @@
 #ifndef _FS_H
 #define _FS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/**
+ * Maximum filename length on the large format (including the NULL character).
+ * Names that don't fit %FS_FILENAME_LEN are kept in a heap of names, which
+ * their directory entries point to.
+ */
+#define FS_LONG_FILENAME_LEN 256
+
+/**
+ * Maximum number of files in the root directory of the classic format (that of
+ * the large format grows as needed, as long as there are free clusters)
+ */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/** Maximum number of open files (the descriptor table grows up to it) */
+#define FS_OPEN_MAX_COUNT 65536
+
+/** fs_format() flag: use the large format (32-bit FAT entries, 64-bit sizes) */
+#define FS_FORMAT_LARGE 0x1
+
+/** fs_format() flag: keep a checksum of every block (implies large format) */
+#define FS_FORMAT_CHECKSUM 0x2
+
+/** fs_format() flag: keep a journal of the metadata (implies large format) */
+#define FS_FORMAT_JOURNAL 0x4
+
+/** Maximum cluster size in bytes (see fs_format()) */
+#define FS_CLUSTER_MAX_SIZE (1024 * 1024)
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks of the file system
+ * @cluster_size: Size in bytes of the allocation unit, or 0 for one block
+ * @flags: Format flags
+ *
+ * Create virtual disk file @diskname and write an empty file system with
+ * @data_blk_count data blocks in it. By default, the classic format is used,
+ * with 16-bit FAT entries and 32-bit file sizes, which limits the disk to 65535
+ * blocks in total. With %FS_FORMAT_LARGE in @flags, the large format is used
+ * instead, with 32-bit FAT entries and 64-bit file sizes. fs_mount() recognizes
+ * both formats by their signature.
+ *
+ * With %FS_FORMAT_CHECKSUM in @flags, a CRC32C checksum of every block of the
+ * disk is kept in a checksum area after the root directory. Every block read
+ * is then checked against its checksum, and a mismatch makes the operation
+ * fail as if the block could not be read. Checksums are only supported by the
+ * large format, which %FS_FORMAT_CHECKSUM selects.
+ *
+ * With %FS_FORMAT_JOURNAL in @flags, a journal region is reserved after the
+ * checksum area (1/64th of @data_blk_count, between 64 and 16384 blocks), and
+ * the changes to the metadata are logged there when they are committed, see
+ * fs_sync(). The journal is also only supported by the large format.
+ *
+ * Files are allocated by clusters of @cluster_size bytes, each one using a
+ * single FAT entry. Bigger clusters make for smaller FATs, shorter chains and
+ * larger I/Os, at the cost of more space lost at the end of small files. The
+ * classic format only supports clusters of %BLOCK_SIZE bytes. @data_blk_count is
+ * rounded up to a whole number of clusters.
+ *
+ * Return: -1 if a file system is currently mounted, if @data_blk_count is 0 or
+ * too big for the requested format, if @cluster_size is not a multiple of
+ * %BLOCK_SIZE up to %FS_CLUSTER_MAX_SIZE, or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count,
+              size_t cluster_size, int flags);
 
 /**
  * fs_mount - Mount a file system
@@ -21,11 +84,94 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * The free space is known from the summary that fs_umount() leaves in the
+ * superblock. If the file system was not unmounted cleanly, it is counted from
+ * the whole FAT instead.
+ *
+ * With a journal, the transactions committed since the metadata was last
+ * written in place are replayed first, which brings the file system back to
+ * its state as of the last commit.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * file system can be located (including when its metadata doesn't match its
+ * checksums). 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * enum fs_alloc_policy - Where the clusters a file grows with go
+ * @FS_ALLOC_FIRST_FIT: The first free clusters of the disk, in a row when
+ *	enough of them are
+ * @FS_ALLOC_NEXT_FIT: Same, but searching from where the previous allocation
+ *	ended, and wrapping around at the end of the disk
+ * @FS_ALLOC_GOAL: Right after the last cluster of the file when it is free.
+ *	Otherwise, and for new files, in the part of the disk with the most free
+ *	space, which leaves the file room to grow there
+ * @FS_ALLOC_BEST_FIT: The smallest run of free clusters that holds all that
+ *	is written at once, which keeps the long runs for large writes. Each
+ *	allocation scans the whole FAT
+ */
+enum fs_alloc_policy {
+	FS_ALLOC_FIRST_FIT,
+	FS_ALLOC_NEXT_FIT,
+	FS_ALLOC_GOAL,
+	FS_ALLOC_BEST_FIT,
+};
+
+/**
+ * struct fs_mount_opts - Options of fs_mount_with()
+ * @lazy_fat: Read each FAT block the first time it is needed instead of reading
+ *	the whole FAT at mount time
+ * @fat_cache_blocks: With @lazy_fat, maximum number of FAT blocks kept in memory,
+ *	or 0 for no limit. Past it, blocks that were not used lately are dropped
+ *	(after being written back if they were modified) to make room
+ * @journal_sync: With a journal, commit every operation before it returns, as
+ *	if it was followed by fs_sync()
+ * @direct_io: Open the virtual disk with O_DIRECT, so that file data goes
+ *	between the disk and the buffers of the library without going through
+ *	the page cache of the host
+ * @alloc_policy: Where to allocate new clusters
+ * @read_only: Leave the virtual disk as it is: the file system can be read,
+ *	but creating, deleting and writing files fail. A journal that needs to be
+ *	replayed is only replayed in memory
+ * @pack_small_files: Store the data of small files (up to half a block) in
+ *	blocks that they share, instead of a cluster each
+ */
+struct fs_mount_opts {
+	bool lazy_fat;
+	size_t fat_cache_blocks;
+	bool journal_sync;
+	bool direct_io;
+	enum fs_alloc_policy alloc_policy;
+	bool read_only;
+	bool pack_small_files;
+};
+
+/**
+ * fs_mount_with - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount(), with the options in @opts. With a lazy FAT, mounting
+ * takes the same time whatever the size of the FAT, but a FAT block that
+ * doesn't match its checksum is only noticed once it is needed, and then acts
+ * as if all its entries were in use and ended their chain.
+ *
+ * Direct I/O suits large streaming workloads, whose data would only evict more
+ * useful pages from the host cache. Small transfers get slower, as each one
+ * goes to the disk.
+ *
+ * A packed file is a fragment of a block that other small files use as well,
+ * so reading it takes a single block read. It gets a cluster of its own once
+ * it grows past half a block. Files that were packed stay readable whatever
+ * the options of later mounts.
+ *
+ * Return: -1 if @alloc_policy is not a valid policy, if virtual disk file
+ * @diskname cannot be opened (or doesn't support direct I/O, with @direct_io),
+ * or if no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_with(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -33,10 +179,34 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+ * cannot be closed, or if there are still open file descriptors, or if a batch
+ * started with fs_batch_begin() is still in progress, or if asynchronous
+ * requests are not done yet. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Make the changes so far durable
+ *
+ * Wait until the operations that returned before the call (in any thread) have
+ * reached stable storage, data and metadata alike, including the data that
+ * open compressed files still hold in memory. Without a journal, the
+ * metadata is written in place, like at fs_umount(). With a journal, the
+ * metadata changes that were not committed yet are appended to it as a single
+ * transaction instead: the threads that call fs_sync() at the same time share
+ * the same log write and the same disk synchronization. The journal is also
+ * committed when it has accumulated enough changes, and the metadata is written
+ * in place (checkpointed) when the journal fills up.
+ *
+ * Until then, the size that the disk records for an open compressed file is the
+ * one its stored data covers, whatever commits happen in the meantime.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing fails
+ * (the data of an open compressed file not fitting on disk, in particular). 0
+ * otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -53,11 +223,12 @@ int fs_info(void);
  * Create a new and empty file named @filename in the root directory of the
  * mounted file system. String @filename must be NULL-terminated and its total
  * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * character), or %FS_LONG_FILENAME_LEN characters on the large format.
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * or if string @filename is too long, or if the root directory is full (i.e.
+ * contains %FS_FILE_MAX_COUNT files on the classic format, or cannot grow on
+ * the large one). 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -73,6 +244,24 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_copy - Copy a file
+ * @src: Name of the file to copy
+ * @dst: Name of the copy
+ *
+ * Create file @dst with the same content as file @src, without the data going
+ * through any buffer of the caller. The clusters of the copy are allocated all
+ * at once (following each other, as long as the disk has a long enough run of
+ * free clusters), and the data is moved by batches of up to 1 MiB, each one a
+ * single read and a single write when the clusters of both files are
+ * contiguous. A copy of a compressed file is compressed as well.
+ *
+ * Return: -1 if @src or @dst is invalid, if there is no file named @src, if
+ * @dst cannot be created (see fs_create()), or if the disk runs out of space,
+ * in which case @dst is not created. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +271,101 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** fs_dirent first block of an empty file */
+#define FS_NO_BLOCK 0xFFFFFFFF
+
+/**
+ * struct fs_dirent - A file of the root directory, as fs_list() returns it
+ * @name: File name, NULL-terminated
+ * @size: Size of the file in bytes
+ * @first_block: First data block (cluster, on the large format) of the file,
+ *	or %FS_NO_BLOCK if the file is empty
+ */
+struct fs_dirent {
+	char name[FS_LONG_FILENAME_LEN];
+	uint64_t size;
+	uint32_t first_block;
+};
+
+/**
+ * fs_list - List files on file system, without formatting them
+ * @entries: Array of directory entries to fill
+ * @max: Number of entries in @entries
+ * @pos: Position in the root directory, 0 to start from its beginning
+ *
+ * Fill @entries with up to @max files of the root directory, in the order
+ * fs_ls() shows them, starting at position @pos which is then moved past them.
+ * Calling fs_list() again with the same @pos goes on with the next files, until
+ * it returns 0.
+ *
+ * Files that are created or deleted between two calls may or may not be listed
+ * (see fs_dir_version()).
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @entries or @pos
+ * is NULL. Otherwise return the number of entries filled, 0 once the whole
+ * directory is listed.
+ */
+int fs_list(struct fs_dirent *entries, size_t max, size_t *pos);
+
+/**
+ * fs_dir_version - Get the change counter of the root directory
+ *
+ * The counter changes whenever anything fs_list() returns may have changed: a
+ * file being created, deleted or renamed, or growing, and also when a file
+ * system is mounted. A listing can be kept for as long as the counter doesn't
+ * change.
+ *
+ * Return: 0 if no underlying virtual disk was opened. Otherwise return the
+ * value of the counter.
+ */
+uint64_t fs_dir_version(void);
+
+/**
+ * struct fs_extent - Data blocks that follow each other on disk
+ * @first_block: First data block (cluster, on the large format)
+ * @count: Number of data blocks (clusters)
+ */
+struct fs_extent {
+	uint32_t first_block;
+	uint32_t count;
+};
+
+/**
+ * fs_extents - List where a file lies on disk
+ * @filename: File name
+ * @extents: Array of extents to fill
+ * @max: Number of entries in @extents
+ * @pos: Position in the data blocks of the file, 0 to start from its first one
+ *
+ * Fill @extents with up to @max extents of file @filename, in file order,
+ * starting at position @pos which is then moved past them. Calling fs_extents()
+ * again with the same @pos goes on with the next extents, until it returns 0.
+ * The data blocks of a compressed file include those of its chunk map.
+ *
+ * A file that is written between two calls may be listed inconsistently.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if there is no file
+ * called @filename, or if @extents or @pos is NULL. Otherwise return the number
+ * of extents filled, 0 once the whole file is listed.
+ */
+int fs_extents(const char *filename, struct fs_extent *extents, size_t max,
+	       uint64_t *pos);
+
+/**
+ * fs_free_extents - List the free space on disk
+ * @extents: Array of extents to fill
+ * @max: Number of entries in @extents
+ * @pos: Position on disk, 0 to start from its beginning
+ *
+ * Same as fs_extents(), for the free data blocks, in disk order. Each extent
+ * is as long as the free blocks in a row are.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @extents or @pos
+ * is NULL. Otherwise return the number of extents filled, 0 once the whole
+ * disk is listed.
+ */
+int fs_free_extents(struct fs_extent *extents, size_t max, uint64_t *pos);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -106,8 +390,14 @@ int fs_open(const char *filename);
  *
  * Close file descriptor @fd.
  *
+ * Closing the last file descriptor of a compressed file stores the data still
+ * held in memory (see fs_create_compressed()). If it doesn't fit on disk, @fd
+ * stays open, and closing it can be retried once there is room.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), if asynchronous requests on @fd are not performed yet, if views
+ * mapped with fs_map() through @fd are not unmapped yet, or if the data of a
+ * compressed file cannot be stored. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -118,10 +408,22 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * open), or if the size of the file doesn't fit an int (see fs_stat64()).
+ * Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat64 - Get file status
+ * @fd: File descriptor
+ *
+ * Same as fs_stat(), for files that can be larger than an int can hold.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the current size of file.
+ */
+int64_t fs_stat64(int fd);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -158,6 +460,22 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_append - Append to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write at the end of the file
+ * @count: Number of bytes of data to be written
+ *
+ * Same as fs_write(), at the end of the file whatever the offset of @fd, which
+ * is then moved to the new end of the file. The last data block of a file is
+ * remembered once a write reaches it, so appending doesn't depend on the size
+ * of the file: at most one partial block is read back and written again.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually written.
+ */
+int fs_append(int fd, const void *buf, size_t count);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -174,8 +492,301 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if the data cannot be read or doesn't match its checksums.
+ * Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of @fd,
+ * which is left unchanged. Threads sharing @fd can therefore use fs_pwrite() and
+ * fs_pread() without coordinating their accesses to the file offset.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is beyond the end of the file. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_pwrite(int fd, const void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read at
+ *
+ * Same as fs_read(), but read at @offset instead of the file offset of @fd,
+ * which is left unchanged.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the data cannot be read. Otherwise return the number of bytes
+ * actually read (0 if @offset is at or beyond the end of the file).
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_write() with the concatenation of the @iovcnt buffers described by
+ * @iov, without having to copy them into a single buffer first. The FAT chain
+ * is only walked once, and each block is written once whatever the number of
+ * buffers covering it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iovcnt is negative. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of entries in @iov
+ *
+ * Same as fs_read(), but fill the @iovcnt buffers described by @iov one after
+ * the other. The FAT chain is only walked once, and each block is read once
+ * whatever the number of buffers covering it.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @iovcnt is negative, or if the data cannot be read. Otherwise return
+ * the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_map - Map part of a file in memory
+ * @fd: File descriptor
+ * @offset: File offset of the start of the view
+ * @length: Number of bytes in the view
+ *
+ * Get a read-only view of the @length bytes of the file at @offset, without
+ * copying them through a buffer. If the data blocks holding them are contiguous
+ * on disk, the view maps them straight from the virtual disk file, and reflects
+ * later writes to that part of the file. Otherwise (and always for compressed
+ * files), the view is a private copy of the data taken by this call. Writing
+ * to the view is not allowed, whichever kind it is.
+ *
+ * Views must be unmapped with fs_unmap() before @fd can be closed.
+ *
+ * Return: NULL if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @length is 0, if the view goes past the end of the file, or if the
+ * data cannot be read or mapped. Otherwise the address of the view.
+ */
+const void *fs_map(int fd, size_t offset, size_t length);
+
+/**
+ * fs_unmap - Unmap a view of a file
+ * @addr: Address of the view, as returned by fs_map()
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if @addr is not the
+ * address of a view currently mapped. 0 otherwise.
+ */
+int fs_unmap(const void *addr);
+
+/**
+ * fs_batch_begin - Start a batch of metadata operations
+ *
+ * Start recording a batch of file creations, deletions and renames. The
+ * operations recorded with fs_batch_create(), fs_batch_delete() and
+ * fs_batch_rename() are not applied until fs_batch_commit() is called, and are
+ * then applied all together or not at all.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if a batch is already
+ * in progress. 0 otherwise.
+ */
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_create - Record the creation of a file in the current batch
+ * @filename: File name
+ *
+ * Same as fs_create(), but only performed when the batch is committed.
+ *
+ * Return: -1 if no batch is in progress, if @filename is invalid or too long,
+ * or if there is not enough memory to record the operation. 0 otherwise.
+ */
+int fs_batch_create(const char *filename);
+
+/**
+ * fs_batch_delete - Record the deletion of a file in the current batch
+ * @filename: File name
+ *
+ * Same as fs_delete(), but only performed when the batch is committed.
+ *
+ * Return: -1 if no batch is in progress, if @filename is invalid or too long,
+ * or if there is not enough memory to record the operation. 0 otherwise.
+ */
+int fs_batch_delete(const char *filename);
+
+/**
+ * fs_batch_rename - Record the renaming of a file in the current batch
+ * @filename: Current file name
+ * @new_filename: New file name
+ *
+ * Rename file @filename to @new_filename when the batch is committed. Open
+ * file descriptors of the file remain valid.
+ *
+ * Return: -1 if no batch is in progress, if either name is invalid or too long,
+ * or if there is not enough memory to record the operation. 0 otherwise.
+ */
+int fs_batch_rename(const char *filename, const char *new_filename);
+
+/**
+ * fs_batch_commit - Apply the current batch
+ *
+ * Validate every recorded operation in order, as if each had been performed
+ * on its own, then apply all the resulting directory and FAT changes at once
+ * and write the file system metadata to disk. If any operation is invalid (file
+ * to create or new name already exists, file to delete missing or open, file to
+ * rename missing, root directory full...), nothing is applied, not even the
+ * growth of the root directory the batch may have needed, and the batch stays
+ * in progress so it can be aborted.
+ *
+ * Return: -1 if no batch is in progress, if an operation of the batch is
+ * invalid, or if the metadata cannot be written. 0 otherwise.
+ */
+int fs_batch_commit(void);
+
+/**
+ * fs_batch_abort - Discard the current batch
+ *
+ * Return: -1 if no batch is in progress. 0 otherwise.
+ */
+int fs_batch_abort(void);
+
+/**
+ * fs_create_compressed - Create a new compressed file
+ * @filename: File name
+ *
+ * Same as fs_create(), but the data of the file is compressed transparently:
+ * it is cut in chunks of 64 KiB (or one cluster, if clusters are bigger), each
+ * compressed on its own, so that any part of the file can be read or written
+ * without going through the rest. The chunk being accessed is kept in memory
+ * and only compressed and written when another chunk is needed or when the
+ * file is closed, so writes may not reach the disk before fs_close() or
+ * fs_sync().
+ *
+ * Compressed files can only be read through this library.
+ *
+ * Return: -1 if @filename cannot be created (see fs_create()). 0 otherwise.
+ */
+int fs_create_compressed(const char *filename);
+
+/** Codec activity since the file system was mounted */
+struct fs_compress_stats {
+	uint64_t bytes_in;		/* bytes given to the compressor */
+	uint64_t bytes_out;		/* bytes written to disk in their place */
+	uint64_t compress_ns;		/* time spent compressing */
+	uint64_t decompressed_bytes;	/* bytes produced by the decompressor */
+	uint64_t decompress_ns;		/* time spent decompressing */
+};
+
+/**
+ * fs_compress_stats - Get compression statistics
+ * @stats: Filled with the statistics
+ *
+ * The compression ratio is @stats->bytes_in / @stats->bytes_out, and codec
+ * throughputs follow from the byte counts and times.
+ *
+ * Return: -1 if no FS is currently mounted or if @stats is NULL. 0 otherwise.
+ */
+int fs_compress_stats(struct fs_compress_stats *stats);
+
+/**
+ * struct fs_request - Asynchronous request (opaque)
+ *
+ * All the functions of this API can be called from several threads at once,
+ * in which case they are performed one after the other. Asynchronous requests
+ * let a single thread keep several reads and writes in flight instead: they are
+ * queued and performed by a pool of worker threads, while the thread that
+ * submitted them goes on.
+ *
+ * The workers perform the requests with fs_read() and fs_write(), and so take
+ * the same library lock: requests of different file descriptors still run one
+ * at a time, and what they overlap with is the work of the calling thread, not
+ * each other.
+ */
+struct fs_request;
+
+/**
+ * fs_callback_t - Completion callback of an asynchronous request
+ * @req: Request that completed
+ * @result: What fs_read() or fs_write() returned for the request
+ * @arg: Argument given when submitting the request
+ *
+ * Called by a worker thread. The next request of the same file descriptor is
+ * only performed once the callback returns. @req is freed right after.
+ */
+typedef void (*fs_callback_t)(struct fs_request *req, int result, void *arg);
+
+/**
+ * fs_read_async - Submit an asynchronous read
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @callback: Function to call on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Queue an fs_read() of @count bytes from file descriptor @fd into @buf. The
+ * requests of a file descriptor are performed in the order they were submitted
+ * and move its offset as fs_read() and fs_write() do; @buf must stay valid
+ * until the request completes.
+ *
+ * Without @callback, the request must be collected with fs_wait() (and can be
+ * checked with fs_poll()). With @callback, it is freed after @callback returns,
+ * and the handle returned can only be compared to the @req argument of
+ * @callback.
+ *
+ * Return: NULL if no FS is currently mounted, if @fd is invalid, or if the
+ * request cannot be queued. Otherwise a handle of the request.
+ */
+struct fs_request *fs_read_async(int fd, void *buf, size_t count,
+                                 fs_callback_t callback, void *arg);
+
+/**
+ * fs_write_async - Submit an asynchronous write
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @callback: Function to call on completion, or NULL
+ * @arg: Argument of @callback
+ *
+ * Same as fs_read_async(), for an fs_write() of @count bytes of @buf.
+ *
+ * Return: NULL if no FS is currently mounted, if @fd is invalid, or if the
+ * request cannot be queued. Otherwise a handle of the request.
+ */
+struct fs_request *fs_write_async(int fd, const void *buf, size_t count,
+                                  fs_callback_t callback, void *arg);
+
+/**
+ * fs_poll - Check whether an asynchronous request is done
+ * @req: Request submitted without a callback
+ *
+ * Return: -1 if @req is NULL, 1 if the request is done (fs_wait() won't block),
+ * 0 otherwise.
+ */
+int fs_poll(struct fs_request *req);
+
+/**
+ * fs_wait - Wait for an asynchronous request and release it
+ * @req: Request submitted without a callback
+ *
+ * Block until the request is done, then free it.
+ *
+ * Return: -1 if @req is NULL. Otherwise what fs_read() or fs_write() returned
+ * for the request.
+ */
+int fs_wait(struct fs_request *req);
+
 #endif /* _FS_H */
@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+// The compressed data is a series of sequences, each made of:
+//  - a token byte: number of literals in the high nibble, match
+//    length minus LZ_MIN_MATCH in the low nibble. A nibble of 15
+//    means that more length bytes follow (255 means keep going);
+//  - the extra literal length bytes, then the literals themselves;
+//  - the match offset on 2 bytes (little endian), then the extra
+//    match length bytes.
+// The last sequence stops right after its literals.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+// reads 4 bytes at @p, whatever its alignment
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the 255-bytes extension of a length that didn't fit
+// its nibble. Return: the new output position, or NULL if the
+// output buffer is full.
+static uint8_t *write_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// emits one sequence of @lit_len literals at @lit followed by a
+// match of @match_len bytes at @offset (no match if @match_len is 0).
+static uint8_t *write_sequence(uint8_t *op, uint8_t *oend,
+                               const uint8_t *lit, size_t lit_len,
+                               size_t offset, size_t match_len)
+{
+    if (op >= oend) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15 && !(op = write_length(op, oend, lit_len - 15))) {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < lit_len) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (!match_len) {
+        return op;
+    }
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (ml >= 15 && !(op = write_length(op, oend, ml - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+size_t lz_compress_bound(size_t len)
+{
+    // all literals: a token and one extra length byte per 255 of them
+    return len + len / 255 + 16;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    const uint8_t *anchor = ip; // start of the pending literals
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_len;
+    // last position + 1 of each hash, 0 when not seen yet
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    memset(table, 0, sizeof(table));
+
+    while (len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+        uint32_t sequence = read32(ip);
+        uint32_t h = lz_hash(sequence);
+        uint32_t pos = table[h];
+        table[h] = (uint32_t)(ip - (const uint8_t *)src) + 1;
+
+        const uint8_t *ref = (const uint8_t *)src + (pos ? pos - 1 : 0);
+        if (pos == 0 || ip - ref > LZ_MAX_OFFSET
+            || read32(ref) != sequence) {
+            ++ip;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < iend && ref[match_len] == ip[match_len]) {
+            ++match_len;
+        }
+
+        op = write_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                            match_len);
+        if (!op) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    // whatever is left goes out as literals
+    op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (!op) {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
+
+// reads the extension of a length nibble that was 15. Return: the
+// full length, or -1 if the input ends in the middle of it.
+static long read_length(const uint8_t **ip, const uint8_t *iend, size_t len)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        len += byte;
+    } while (byte == 255);
+    return (long)len;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        long lit_len = token >> 4;
+        if (lit_len == 15 && (lit_len = read_length(&ip, iend, 15)) < 0) {
+            return -1;
+        }
+        if (iend - ip < lit_len || oend - op < lit_len) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) {
+            break; // last sequence, literals only
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        long match_len = token & 15;
+        if (match_len == 15
+            && (match_len = read_length(&ip, iend, 15)) < 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)
+            || oend - op < match_len) {
+            return -1;
+        }
+
+        // the match can overlap what it produces (runs),
+        // in which case it has to be copied byte by byte
+        const uint8_t *ref = op - offset;
+        if (offset >= (size_t)match_len) {
+            memcpy(op, ref, match_len);
+        }
+        else {
+            for (long i = 0; i < match_len; ++i) {
+                op[i] = ref[i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op - (uint8_t *)dst;
+}
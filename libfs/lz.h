@@ -0,0 +1,43 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/**
+ * lz_compress_bound - Worst case compressed size
+ * @len: Size of the data to compress
+ *
+ * Return: the size of an output buffer large enough for lz_compress() to never
+ * fail on @len bytes of input.
+ */
+size_t lz_compress_bound(size_t len);
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src in bytes
+ * @dst: Buffer to be filled with the compressed data
+ * @dst_len: Size of @dst in bytes
+ *
+ * Compress @len bytes of @src with a byte-oriented LZ77 codec (4-byte minimum
+ * matches within a 64 KiB window, no entropy coding), which favors speed over
+ * ratio.
+ *
+ * Return: 0 if the compressed data doesn't fit in @dst_len bytes. Otherwise the
+ * size of the compressed data.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dst_len);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data compressed by lz_compress()
+ * @len: Size of @src in bytes
+ * @dst: Buffer to be filled with the decompressed data
+ * @dst_len: Size of @dst in bytes
+ *
+ * Return: -1 if @src is not valid compressed data, or if the decompressed data
+ * doesn't fit in @dst_len bytes. Otherwise the size of the decompressed data.
+ */
+long lz_decompress(const void *src, size_t len, void *dst, size_t dst_len);
+
+#endif /* _LZ_H */
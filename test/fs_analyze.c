@@ -0,0 +1,245 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define analyze_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	analyze_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Buckets of the free extent histogram: lengths 1, 2-3, 4-7, ... */
+#define HIST_BUCKETS 33
+
+/* Layout of a file */
+struct file_layout {
+	char name[FS_LONG_FILENAME_LEN];
+	uint64_t size;
+	/* Data blocks (clusters on the large format) */
+	uint64_t blocks;
+	uint64_t extents;
+	/* Blocks skipped (forward or backward) between extents */
+	uint64_t seek_distance;
+	/* The chain is longer than the disk, so it has a loop */
+	bool looped;
+};
+
+/* Layout of the free space */
+struct free_layout {
+	uint64_t blocks;
+	uint64_t extents;
+	uint64_t largest;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+/* Walk the chain of @file, no further than @max_blocks */
+static void analyze_file(struct file_layout *file, uint64_t max_blocks)
+{
+	struct fs_extent extents[256];
+	uint64_t pos = 0, next = 0;
+	int count;
+
+	while ((count = fs_extents(file->name, extents, ARRAY_SIZE(extents),
+				   &pos)) > 0) {
+		for (int i = 0; i < count; i++) {
+			uint64_t first = extents[i].first_block;
+
+			if (file->extents > 0)
+				file->seek_distance += first > next ?
+					first - next : next - first;
+			next = first + extents[i].count;
+			file->blocks += extents[i].count;
+			file->extents++;
+		}
+		if (file->blocks > max_blocks) {
+			file->looped = true;
+			return;
+		}
+	}
+	if (count < 0)
+		die("Cannot walk file %s", file->name);
+}
+
+static void analyze_free(struct free_layout *free_space)
+{
+	struct fs_extent extents[256];
+	uint64_t pos = 0;
+	int count;
+
+	while ((count = fs_free_extents(extents, ARRAY_SIZE(extents),
+					&pos)) > 0) {
+		for (int i = 0; i < count; i++) {
+			uint64_t len = extents[i].count;
+			int bucket = 0;
+
+			while (bucket < HIST_BUCKETS - 1 && len >> (bucket + 1))
+				bucket++;
+			free_space->hist[bucket]++;
+			free_space->blocks += len;
+			free_space->extents++;
+			if (len > free_space->largest)
+				free_space->largest = len;
+		}
+	}
+	if (count < 0)
+		die("Cannot list free space");
+}
+
+static double avg_extent(const struct file_layout *file)
+{
+	return file->extents ? (double)file->blocks / file->extents : 0;
+}
+
+static void print_text(const struct file_layout *files, size_t count,
+		       const struct free_layout *free_space)
+{
+	uint64_t extents = 0, fragmented = 0;
+
+	printf("%-24s %12s %10s %8s %10s %12s\n", "file", "size", "blocks",
+	       "extents", "avg extent", "seek dist");
+	for (size_t i = 0; i < count; i++) {
+		const struct file_layout *file = &files[i];
+
+		printf("%-24s %12" PRIu64 " %10" PRIu64 " %8" PRIu64
+		       " %10.1f %12" PRIu64 "%s\n", file->name, file->size,
+		       file->blocks, file->extents, avg_extent(file),
+		       file->seek_distance, file->looped ? " (loop)" : "");
+		extents += file->extents;
+		if (file->extents > 1)
+			fragmented++;
+	}
+
+	printf("\n%zu files, %" PRIu64 " extents, %" PRIu64
+	       " fragmented files\n", count, extents, fragmented);
+	printf("free: %" PRIu64 " blocks in %" PRIu64
+	       " extents, largest %" PRIu64 " blocks\n", free_space->blocks,
+	       free_space->extents, free_space->largest);
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		uint64_t min = (uint64_t)1 << i;
+
+		if (!free_space->hist[i])
+			continue;
+		printf("  %10" PRIu64 " - %-10" PRIu64 " %10" PRIu64 "\n", min,
+		       2 * min - 1, free_space->hist[i]);
+	}
+}
+
+/* Print @str as a JSON string */
+static void print_json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_json(const struct file_layout *files, size_t count,
+		       const struct free_layout *free_space)
+{
+	bool first = true;
+
+	printf("{\"files\": [");
+	for (size_t i = 0; i < count; i++) {
+		const struct file_layout *file = &files[i];
+
+		printf("%s\n  {\"name\": ", i ? "," : "");
+		print_json_string(file->name);
+		printf(", \"size\": %" PRIu64 ", \"blocks\": %" PRIu64
+		       ", \"extents\": %" PRIu64 ", \"avg_extent\": %.2f"
+		       ", \"seek_distance\": %" PRIu64 ", \"loop\": %s}",
+		       file->size, file->blocks, file->extents,
+		       avg_extent(file), file->seek_distance,
+		       file->looped ? "true" : "false");
+	}
+	printf("],\n \"free\": {\"blocks\": %" PRIu64 ", \"extents\": %" PRIu64
+	       ", \"largest\": %" PRIu64 ", \"histogram\": [",
+	       free_space->blocks, free_space->extents, free_space->largest);
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		uint64_t min = (uint64_t)1 << i;
+
+		if (!free_space->hist[i])
+			continue;
+		printf("%s\n  {\"min\": %" PRIu64 ", \"max\": %" PRIu64
+		       ", \"count\": %" PRIu64 "}", first ? "" : ",", min,
+		       2 * min - 1, free_space->hist[i]);
+		first = false;
+	}
+	printf("]}}\n");
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [--json] <diskname>\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_mount_opts opts = { .read_only = true };
+	struct free_layout free_space = { 0 };
+	struct file_layout *files = NULL;
+	struct fs_dirent entries[64];
+	size_t count = 0, pos = 0;
+	char *diskname;
+	struct stat st;
+	bool json = false;
+	int listed;
+
+	if (argc == 3 && !strcmp(argv[1], "--json"))
+		json = true;
+	else if (argc != 2)
+		usage(argv[0]);
+	diskname = argv[argc - 1];
+
+	/* No chain can be longer than the disk */
+	if (stat(diskname, &st))
+		die("Cannot stat diskname");
+	if (fs_mount_with(diskname, &opts))
+		die("Cannot mount diskname");
+
+	while ((listed = fs_list(entries, ARRAY_SIZE(entries), &pos)) > 0) {
+		files = realloc(files, (count + listed) * sizeof(*files));
+		if (!files)
+			die("Cannot malloc");
+		for (int i = 0; i < listed; i++) {
+			struct file_layout *file = &files[count++];
+
+			memset(file, 0, sizeof(*file));
+			strcpy(file->name, entries[i].name);
+			file->size = entries[i].size;
+			analyze_file(file, st.st_size / 4096);
+		}
+	}
+	if (listed < 0)
+		die("Cannot list files");
+	analyze_free(&free_space);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (json)
+		print_json(files, count, &free_space);
+	else
+		print_text(files, count, &free_space);
+
+	free(files);
+	return 0;
+}
@@ -0,0 +1,1042 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <crc32c.h>
+#include <fat_scan.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define MiB (1024 * 1024)
+
+/* Number of runs of each measure, the best one is reported */
+#define RUNS 5
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+struct bench_arg {
+	int argc;
+	char **argv;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+/* Buffer of @size bytes of pseudo-random data */
+static char *random_buf(size_t size)
+{
+	char *buf = malloc(size);
+	unsigned int seed = 42;
+
+	if (!buf)
+		die("Cannot malloc");
+	for (size_t i = 0; i < size; i++)
+		buf[i] = rand_r(&seed);
+	return buf;
+}
+
+/* Drop the pages of @diskname from the page cache */
+static void drop_cache(char *diskname)
+{
+	int fd = open(diskname, O_RDONLY);
+
+	if (fd < 0 || fsync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+		die("Cannot drop the cache of diskname");
+	close(fd);
+}
+
+/*
+ * Format @diskname with @flags, write @size bytes of @data in a file, and
+ * return the best throughput (in MB/s) of reading it all back, from the page
+ * cache, or from storage if @cold.
+ */
+static double read_throughput(char *diskname, int flags, char *data,
+			      size_t size, int cold)
+{
+	char *buf = malloc(MiB);
+	double best = 0;
+	int fd;
+
+	if (!buf)
+		die("Cannot malloc");
+	if (fs_format(diskname, size / 4096 + 16, 0, flags))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("bench"))
+		die("Cannot create file");
+	fd = fs_open("bench");
+	if (fd < 0)
+		die("Cannot open file");
+	if (fs_write(fd, data, size) != (int)size)
+		die("Cannot write file");
+
+	for (int run = 0; run < RUNS; run++) {
+		double start = now(), elapsed;
+		size_t done = 0;
+
+		if (cold) {
+			drop_cache(diskname);
+			start = now();
+		}
+		fs_lseek(fd, 0);
+		while (done < size) {
+			int ret = fs_read(fd, buf, MiB);
+			if (ret <= 0)
+				die("Cannot read file");
+			done += ret;
+		}
+		elapsed = now() - start;
+		if (size / elapsed / 1e6 > best)
+			best = size / elapsed / 1e6;
+	}
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+	return best;
+}
+
+/* Throughput (in MB/s) of @crc over blocks of @data */
+static double crc_throughput(uint32_t (*crc)(uint32_t, const void *, size_t),
+			     char *data, size_t size)
+{
+	double best = 0;
+	uint32_t sum = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+		double start = now(), elapsed;
+
+		for (size_t i = 0; i + 4096 <= size; i += 4096)
+			sum ^= crc(0, data + i, 4096);
+		elapsed = now() - start;
+		if (size / elapsed / 1e6 > best)
+			best = size / elapsed / 1e6;
+	}
+	/* Keep the checksums from being optimized away */
+	if (sum == 0x12345678)
+		printf(" ");
+	return best;
+}
+
+void bench_checksum(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 64 * MiB;
+	double plain, checked;
+	char *data;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file size in MiB]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]) * MiB;
+
+	data = random_buf(size);
+
+	printf("crc32c (%s): %.0f MB/s, portable: %.0f MB/s\n",
+	       crc32c_impl(), crc_throughput(crc32c, data, size),
+	       crc_throughput(crc32c_portable, data, size));
+
+	for (int cold = 0; cold < 2; cold++) {
+		plain = read_throughput(b_arg->argv[0], FS_FORMAT_LARGE, data,
+					size, cold);
+		checked = read_throughput(b_arg->argv[0], FS_FORMAT_CHECKSUM,
+					  data, size, cold);
+		printf("fs_read (%s): %.0f MB/s, with checksums: %.0f MB/s "
+		       "(%+.1f%%)\n", cold ? "storage" : "page cache", plain,
+		       checked, (checked - plain) / plain * 100);
+	}
+
+	free(data);
+}
+
+/* Synthetic FAT, as 16-bit and 32-bit entries */
+struct bench_fat {
+	uint16_t *fat16;
+	uint32_t *fat32;
+};
+
+/*
+ * Nearly full FAT of @count entries: the last 64 are free and, with @holes,
+ * one in 50 of the others as well, so that each kernel has to go through all
+ * of it before finding what it looks for
+ */
+static void bench_fat_init(struct bench_fat *fat, size_t count, int holes)
+{
+	fat->fat16 = malloc(count * sizeof(uint16_t));
+	fat->fat32 = malloc(count * sizeof(uint32_t));
+	if (!fat->fat16 || !fat->fat32)
+		die("Cannot malloc");
+	for (size_t i = 0; i < count; i++) {
+		int used = i < count - 64 && !(holes && i % 50 == 49);
+		fat->fat16[i] = used ? 0xffff : 0;
+		fat->fat32[i] = used ? 0xffffffff : 0;
+	}
+}
+
+/*
+ * Time @kernel (0: count, 1: find zero, 2: find run of 64 zeros) of @ops over
+ * @count entries of @fat, on 16 or 32 bits if @wide, and return the best time
+ * in ms
+ */
+static double fat_scan_time(const struct fat_scan_ops *ops, int kernel,
+			    int wide, struct bench_fat *fat, size_t count)
+{
+	double best = 0;
+	size_t sum = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+		double start = now(), elapsed;
+
+		for (int rep = 0; rep < 10; rep++) {
+			switch (kernel) {
+			case 0:
+				sum += wide ?
+					ops->count_nonzero32(fat->fat32, count) :
+					ops->count_nonzero16(fat->fat16, count);
+				break;
+			case 1:
+				sum += wide ?
+					ops->find_zero32(fat->fat32, count) :
+					ops->find_zero16(fat->fat16, count);
+				break;
+			default:
+				sum += wide ?
+					ops->find_zero_run32(fat->fat32, count,
+							     64) :
+					ops->find_zero_run16(fat->fat16, count,
+							     64);
+			}
+		}
+		elapsed = (now() - start) * 1000 / 10;
+		if (!best || elapsed < best)
+			best = elapsed;
+	}
+	/* Keep the results from being optimized away */
+	if (sum == 1)
+		printf(" ");
+	return best;
+}
+
+void bench_fatscan(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	const char *impls[] = { "scalar", "sse2", "avx2" };
+	const char *kernels[] = { "count_nonzero", "find_zero",
+				  "find_zero_run" };
+	size_t count = 1024 * 1024;
+	struct bench_fat full, holey;
+
+	if (b_arg->argc > 0)
+		count = get_argv(b_arg->argv[0]);
+	if (count <= 64)
+		die("need more than 64 entries");
+
+	bench_fat_init(&full, count, 0);
+	bench_fat_init(&holey, count, 1);
+
+	printf("%zu entries, best kernels: %s\n", count, fat_scan()->name);
+	for (int wide = 0; wide < 2; wide++) {
+		for (int k = 0; k < 3; k++) {
+			/* find_zero would stop at the first hole */
+			struct bench_fat *fat = k == 1 ? &full : &holey;
+			double scalar = 0;
+
+			printf("%s%d:", kernels[k], wide ? 32 : 16);
+			for (int i = 0; i < ARRAY_SIZE(impls); i++) {
+				const struct fat_scan_ops *ops;
+				double ms;
+
+				ops = fat_scan_impl(impls[i]);
+				if (!ops)
+					continue;
+				ms = fat_scan_time(ops, k, wide, fat, count);
+				if (!scalar)
+					scalar = ms;
+				printf(" %s %.3f ms (x%.1f)", impls[i], ms,
+				       scalar / ms);
+			}
+			printf("\n");
+		}
+	}
+
+	free(full.fat16);
+	free(full.fat32);
+	free(holey.fat16);
+	free(holey.fat32);
+}
+
+/* Requests kept in flight by the asynchronous reader */
+#define ASYNC_DEPTH 4
+
+/*
+ * Read @size bytes of file @fd by chunks of 1 MiB, checksumming each chunk
+ * (the "compute" part), either one chunk at a time or with ASYNC_DEPTH reads
+ * in flight while the previous chunks get checksummed. Return the time it took
+ * in ms.
+ */
+static double async_read_time(int fd, char *bufs, size_t size, int async)
+{
+	struct fs_request *reqs[ASYNC_DEPTH];
+	size_t chunks = size / MiB;
+	double start = now();
+	uint32_t sum = 0;
+
+	fs_lseek(fd, 0);
+	if (!async) {
+		for (size_t i = 0; i < chunks; i++) {
+			if (fs_read(fd, bufs, MiB) != MiB)
+				die("Cannot read file");
+			sum ^= crc32c_portable(0, bufs, MiB);
+		}
+	} else {
+		for (size_t i = 0; i < chunks && i < ASYNC_DEPTH; i++)
+			reqs[i] = fs_read_async(fd, bufs + i * MiB, MiB, NULL,
+						NULL);
+		for (size_t i = 0; i < chunks; i++) {
+			char *buf = bufs + (i % ASYNC_DEPTH) * MiB;
+
+			if (fs_wait(reqs[i % ASYNC_DEPTH]) != MiB)
+				die("Cannot read file");
+			sum ^= crc32c_portable(0, buf, MiB);
+			if (i + ASYNC_DEPTH < chunks)
+				reqs[i % ASYNC_DEPTH] =
+					fs_read_async(fd, buf, MiB, NULL, NULL);
+		}
+	}
+	/* Keep the checksums from being optimized away */
+	if (sum == 0x12345678)
+		printf(" ");
+	return (now() - start) * 1000;
+}
+
+void bench_async(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 64 * MiB;
+	char *data, *bufs;
+	int fd;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file size in MiB]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]) * MiB;
+
+	data = random_buf(size);
+	bufs = malloc(ASYNC_DEPTH * MiB);
+	if (!bufs)
+		die("Cannot malloc");
+	if (fs_format(b_arg->argv[0], size / 4096 + 16, 0, FS_FORMAT_LARGE))
+		die("Cannot format diskname");
+	if (fs_mount(b_arg->argv[0]))
+		die("Cannot mount diskname");
+	if (fs_create("bench"))
+		die("Cannot create file");
+	fd = fs_open("bench");
+	if (fd < 0)
+		die("Cannot open file");
+	if (fs_write(fd, data, size) != (int)size)
+		die("Cannot write file");
+
+	for (int async = 0; async < 2; async++) {
+		double best = 0;
+
+		for (int run = 0; run < RUNS; run++) {
+			double ms = async_read_time(fd, bufs, size, async);
+			if (!best || ms < best)
+				best = ms;
+		}
+		printf("read + checksum, %s: %.1f ms\n",
+		       async ? "asynchronous" : "synchronous", best);
+	}
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(bufs);
+	free(data);
+}
+
+/*
+ * Time (in ms) of mounting @diskname with @opts, with the disk out of the page
+ * cache, best of RUNS
+ */
+static double mount_time(char *diskname, struct fs_mount_opts *opts)
+{
+	double best = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+		double start, ms;
+
+		drop_cache(diskname);
+		start = now();
+		if (fs_mount_with(diskname, opts))
+			die("Cannot mount diskname");
+		ms = (now() - start) * 1000;
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		if (!best || ms < best)
+			best = ms;
+	}
+	return best;
+}
+
+void bench_mount(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	struct fs_mount_opts eager = { .lazy_fat = false };
+	struct fs_mount_opts lazy = { .lazy_fat = true, .fat_cache_blocks = 64 };
+	size_t max_gib = 16;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [max disk size in GiB]");
+	if (b_arg->argc > 1)
+		max_gib = get_argv(b_arg->argv[1]);
+
+	/* Sparse images, with a FAT entry for each 4 KiB block */
+	for (size_t gib = 1; gib <= max_gib; gib *= 4) {
+		size_t blocks = gib * 1024 * 1024 / 4;
+
+		if (fs_format(b_arg->argv[0], blocks, 0, FS_FORMAT_LARGE))
+			die("Cannot format diskname");
+		printf("%4zu GiB (%5zu FAT blocks): eager %8.2f ms, "
+		       "lazy %6.2f ms\n", gib, blocks / 1024,
+		       mount_time(b_arg->argv[0], &eager),
+		       mount_time(b_arg->argv[0], &lazy));
+	}
+}
+
+void bench_dir(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t max_files = 100000;
+	char filename[24];
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [max file count]");
+	if (b_arg->argc > 1)
+		max_files = get_argv(b_arg->argv[1]);
+
+	/* Empty files, so only the root directory grows */
+	for (size_t files = 1000; files <= max_files; files *= 10) {
+		double start, create_ms, open_ms, mount_ms;
+
+		if (fs_format(b_arg->argv[0], files / 128 + 64, 0,
+			      FS_FORMAT_LARGE))
+			die("Cannot format diskname");
+		if (fs_mount(b_arg->argv[0]))
+			die("Cannot mount diskname");
+
+		start = now();
+		for (size_t i = 0; i < files; i++) {
+			snprintf(filename, sizeof(filename), "file%zu", i);
+			if (fs_create(filename))
+				die("Cannot create file %s", filename);
+		}
+		create_ms = (now() - start) * 1000;
+
+		start = now();
+		for (size_t i = 0; i < files; i++) {
+			int fd;
+
+			snprintf(filename, sizeof(filename), "file%zu", i);
+			fd = fs_open(filename);
+			if (fd < 0)
+				die("Cannot open file %s", filename);
+			fs_close(fd);
+		}
+		open_ms = (now() - start) * 1000;
+
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		mount_ms = mount_time(b_arg->argv[0], NULL);
+
+		printf("%7zu files: create %8.2f ms, open %8.2f ms, "
+		       "mount %6.2f ms\n", files, create_ms, open_ms, mount_ms);
+	}
+}
+
+#define COMMIT_THREADS_MAX 8
+
+struct commit_arg {
+	int id;
+	size_t files;
+};
+
+/* Create files, each one made durable before the next */
+static void *commit_worker(void *arg)
+{
+	struct commit_arg *c_arg = arg;
+	char filename[24];
+
+	for (size_t i = 0; i < c_arg->files; i++) {
+		snprintf(filename, sizeof(filename), "t%d_%zu", c_arg->id, i);
+		if (fs_create(filename) || fs_sync())
+			die("Cannot create file %s", filename);
+	}
+	return NULL;
+}
+
+/* Creations per second with @threads threads syncing after each one */
+static double commit_rate(char *diskname, int flags, int threads,
+			  size_t files)
+{
+	pthread_t tids[COMMIT_THREADS_MAX];
+	struct commit_arg args[COMMIT_THREADS_MAX];
+	double start, elapsed;
+
+	if (fs_format(diskname, 16384, 0, flags))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	start = now();
+	for (int t = 0; t < threads; t++) {
+		args[t].id = t;
+		args[t].files = files / threads;
+		if (pthread_create(&tids[t], NULL, commit_worker, &args[t]))
+			die("Cannot create thread");
+	}
+	for (int t = 0; t < threads; t++)
+		pthread_join(tids[t], NULL);
+	elapsed = now() - start;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return files / elapsed;
+}
+
+void bench_commit(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t files = 2000;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file count]");
+	if (b_arg->argc > 1)
+		files = get_argv(b_arg->argv[1]);
+
+	/*
+	 * Without a journal, every fs_sync() writes the metadata in place.
+	 * With one, the threads syncing at the same time share a commit.
+	 */
+	printf("in place: %8.0f creates/s\n",
+	       commit_rate(b_arg->argv[0], FS_FORMAT_LARGE, 1, files));
+	for (int threads = 1; threads <= COMMIT_THREADS_MAX; threads *= 2)
+		printf("journal, %d thread%s: %8.0f creates/s\n", threads,
+		       threads > 1 ? "s" : "",
+		       commit_rate(b_arg->argv[0], FS_FORMAT_JOURNAL, threads,
+				   files));
+}
+
+/*
+ * Write @size bytes of @data to a new file of @diskname mounted with @opts,
+ * syncing at the end, then read them back from storage by chunks of 1 MiB
+ * into @buf. Return the throughputs (in MB/s) in @write_mbs and @read_mbs.
+ */
+static void stream_throughput(char *diskname, struct fs_mount_opts *opts,
+			      char *data, size_t size, char *buf,
+			      double *write_mbs, double *read_mbs)
+{
+	double start;
+	size_t done;
+	int fd;
+
+	if (fs_format(diskname, size / 4096 + 64, 0, FS_FORMAT_LARGE))
+		die("Cannot format diskname");
+	drop_cache(diskname);
+	if (fs_mount_with(diskname, opts))
+		die("Cannot mount diskname");
+	if (fs_create("bench"))
+		die("Cannot create file");
+	fd = fs_open("bench");
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now();
+	for (done = 0; done < size; done += MiB)
+		if (fs_write(fd, data + done, MiB) != MiB)
+			die("Cannot write file");
+	if (fs_sync())
+		die("Cannot sync");
+	*write_mbs = size / (now() - start) / 1e6;
+
+	drop_cache(diskname);
+	start = now();
+	fs_lseek(fd, 0);
+	for (done = 0; done < size; done += MiB)
+		if (fs_read(fd, buf, MiB) != MiB)
+			die("Cannot read file");
+	*read_mbs = size / (now() - start) / 1e6;
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void bench_direct(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	struct fs_mount_opts buffered = { .direct_io = false };
+	struct fs_mount_opts direct = { .direct_io = true };
+	size_t size = 256 * MiB;
+	double write_mbs, read_mbs;
+	char *data;
+	void *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file size in MiB]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]) * MiB;
+
+	/* Aligned, so that direct I/O goes straight to the buffer */
+	data = random_buf(size);
+	if (posix_memalign(&buf, 4096, MiB))
+		die("Cannot malloc");
+
+	stream_throughput(b_arg->argv[0], &buffered, data, size, buf,
+			  &write_mbs, &read_mbs);
+	printf("buffered: write %7.1f MB/s, read %7.1f MB/s\n", write_mbs,
+	       read_mbs);
+	stream_throughput(b_arg->argv[0], &direct, data, size, buf,
+			  &write_mbs, &read_mbs);
+	printf("direct:   write %7.1f MB/s, read %7.1f MB/s\n", write_mbs,
+	       read_mbs);
+
+	free(buf);
+	free(data);
+}
+
+/* Appends timed after the first one */
+#define APPENDS 10000
+
+void bench_append(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t max_mib = 256;
+	char record[100];
+	char *data;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [max file size in MiB]");
+	if (b_arg->argc > 1)
+		max_mib = get_argv(b_arg->argv[1]);
+
+	data = random_buf(max_mib * MiB);
+	memset(record, 'r', sizeof(record));
+
+	for (size_t mib = 1; mib <= max_mib; mib *= 4) {
+		size_t size = mib * MiB;
+		double start, first_us, append_us;
+		int fd;
+
+		if (fs_format(b_arg->argv[0], size / 4096 + 1024, 0,
+			      FS_FORMAT_LARGE))
+			die("Cannot format diskname");
+		if (fs_mount(b_arg->argv[0]) || fs_create("log"))
+			die("Cannot create file");
+		fd = fs_open("log");
+		if (fd < 0 || fs_write(fd, data, size) != (int)size)
+			die("Cannot write file");
+		fs_close(fd);
+		/* The end of the file is to be found again */
+		if (fs_umount() || fs_mount(b_arg->argv[0]))
+			die("Cannot remount diskname");
+		fd = fs_open("log");
+		if (fd < 0)
+			die("Cannot open file");
+
+		start = now();
+		if (fs_append(fd, record, sizeof(record)) != sizeof(record))
+			die("Cannot append to file");
+		first_us = (now() - start) * 1e6;
+		start = now();
+		for (int i = 0; i < APPENDS; i++)
+			if (fs_append(fd, record, sizeof(record)) !=
+			    sizeof(record))
+				die("Cannot append to file");
+		append_us = (now() - start) * 1e6 / APPENDS;
+
+		fs_close(fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		printf("%4zu MiB: first append %8.1f us, then %6.2f us each\n",
+		       mib, first_us, append_us);
+	}
+	free(data);
+}
+
+#define ALLOC_FILES 8
+
+/* Append @size bytes of @data to each of the files @fds by @chunk bytes */
+static void append_round_robin(int *fds, int count, char *data, size_t size,
+			       size_t chunk)
+{
+	for (size_t done = 0; done < size; done += chunk)
+		for (int i = 0; i < count; i++)
+			if (fs_write(fds[i], data + done, chunk) != (int)chunk)
+				die("Cannot write file");
+}
+
+/*
+ * Age @diskname with @policy: files growing side by side, half of them
+ * deleted, new files written at once in the holes, and the others growing
+ * again. Return how long it took in ms, and the throughput (in MB/s) of
+ * reading all files back with direct I/O in @read_mbs.
+ */
+static double alloc_time(char *diskname, enum fs_alloc_policy policy,
+			 char *data, size_t size, char *buf, double *read_mbs)
+{
+	struct fs_mount_opts opts = { .alloc_policy = policy };
+	struct fs_mount_opts direct = { .direct_io = true };
+	char filename[24];
+	int fds[ALLOC_FILES];
+	size_t total = 0;
+	double start, ms;
+
+	if (fs_format(diskname, ALLOC_FILES * size * 2 / 4096 + 64, 0,
+		      FS_FORMAT_LARGE))
+		die("Cannot format diskname");
+	if (fs_mount_with(diskname, &opts))
+		die("Cannot mount diskname");
+
+	start = now();
+	for (int i = 0; i < ALLOC_FILES; i++) {
+		snprintf(filename, sizeof(filename), "file%d", i);
+		if (fs_create(filename) || (fds[i] = fs_open(filename)) < 0)
+			die("Cannot create file %s", filename);
+	}
+	append_round_robin(fds, ALLOC_FILES, data, size, 64 * 1024);
+	for (int i = 1; i < ALLOC_FILES; i += 2) {
+		snprintf(filename, sizeof(filename), "file%d", i);
+		fs_close(fds[i]);
+		if (fs_delete(filename))
+			die("Cannot delete file %s", filename);
+		snprintf(filename, sizeof(filename), "new%d", i);
+		if (fs_create(filename) || (fds[i] = fs_open(filename)) < 0)
+			die("Cannot create file %s", filename);
+		if (fs_write(fds[i], data, size / 2) != (int)(size / 2))
+			die("Cannot write file");
+		/* Only the old files grow again */
+		fs_close(fds[i]);
+		fds[i] = fds[i - 1];
+	}
+	for (int i = 0; i < ALLOC_FILES; i += 2)
+		fds[i / 2] = fds[i];
+	append_round_robin(fds, ALLOC_FILES / 2, data, size / 2, 64 * 1024);
+	ms = (now() - start) * 1000;
+	for (int i = 0; i < ALLOC_FILES / 2; i++)
+		fs_close(fds[i]);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (fs_mount_with(diskname, &direct))
+		die("Cannot mount diskname");
+	start = now();
+	for (int i = 0; i < ALLOC_FILES; i++) {
+		int fd, ret;
+
+		snprintf(filename, sizeof(filename), i % 2 ? "new%d" : "file%d",
+			 i);
+		fd = fs_open(filename);
+		if (fd < 0)
+			die("Cannot open file %s", filename);
+		while ((ret = fs_read(fd, buf, MiB)) > 0)
+			total += ret;
+		fs_close(fd);
+	}
+	*read_mbs = total / (now() - start) / 1e6;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return ms;
+}
+
+void bench_alloc(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	const char *names[] = { "first-fit", "next-fit", "goal", "best-fit" };
+	enum fs_alloc_policy policies[] = { FS_ALLOC_FIRST_FIT,
+		FS_ALLOC_NEXT_FIT, FS_ALLOC_GOAL, FS_ALLOC_BEST_FIT };
+	size_t size = 16 * MiB;
+	char *data;
+	void *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file size in MiB]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]) * MiB;
+
+	data = random_buf(size);
+	if (posix_memalign(&buf, 4096, MiB))
+		die("Cannot malloc");
+
+	for (int i = 0; i < ARRAY_SIZE(policies); i++) {
+		double read_mbs, ms;
+
+		ms = alloc_time(b_arg->argv[0], policies[i], data, size, buf,
+				&read_mbs);
+		printf("%-9s: writes %8.2f ms, direct read %7.1f MB/s\n",
+		       names[i], ms, read_mbs);
+	}
+
+	free(buf);
+	free(data);
+}
+
+/* Number of blocks without a file on the mounted disk */
+static uint64_t free_blocks(void)
+{
+	struct fs_extent extents[256];
+	uint64_t pos = 0, blocks = 0;
+	int count;
+
+	while ((count = fs_free_extents(extents, ARRAY_SIZE(extents),
+					&pos)) > 0)
+		for (int i = 0; i < count; i++)
+			blocks += extents[i].count;
+	if (count < 0)
+		die("Cannot list free space");
+	return blocks;
+}
+
+/*
+ * Write @files small files of up to 2 KiB of @data to @diskname, packed or
+ * not. Return how long it took in ms, how many blocks they use in @blocks,
+ * and the throughput (in MB/s) of reading them all back from storage in
+ * @read_mbs.
+ */
+static double pack_time(char *diskname, bool packed, int files, char *data,
+			uint64_t *blocks, double *read_mbs)
+{
+	struct fs_mount_opts opts = { .pack_small_files = packed };
+	size_t data_blocks = files + 1024;
+	char filename[24], buf[2048];
+	size_t total = 0;
+	double start, ms;
+
+	if (fs_format(diskname, data_blocks, 0, FS_FORMAT_LARGE))
+		die("Cannot format diskname");
+	if (fs_mount_with(diskname, &opts))
+		die("Cannot mount diskname");
+	start = now();
+	for (int i = 0; i < files; i++) {
+		int size = i * 397 % 2048 + 1, fd;
+
+		snprintf(filename, sizeof(filename), "file%d", i);
+		if (fs_create(filename) || (fd = fs_open(filename)) < 0)
+			die("Cannot create file %s", filename);
+		if (fs_write(fd, data + i % 1024, size) != size)
+			die("Cannot write file");
+		fs_close(fd);
+	}
+	ms = (now() - start) * 1000;
+	*blocks = data_blocks - free_blocks();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	drop_cache(diskname);
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	start = now();
+	for (int i = 0; i < files; i++) {
+		int fd;
+
+		snprintf(filename, sizeof(filename), "file%d", i);
+		fd = fs_open(filename);
+		if (fd < 0)
+			die("Cannot open file %s", filename);
+		total += fs_read(fd, buf, sizeof(buf));
+		fs_close(fd);
+	}
+	*read_mbs = total / (now() - start) / 1e6;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return ms;
+}
+
+void bench_pack(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	int files = 10000;
+	char *data;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [number of files]");
+	if (b_arg->argc > 1)
+		files = get_argv(b_arg->argv[1]);
+
+	data = random_buf(4096);
+	for (int packed = 0; packed < 2; packed++) {
+		double read_mbs, ms;
+		uint64_t blocks;
+
+		ms = pack_time(b_arg->argv[0], packed, files, data, &blocks,
+			       &read_mbs);
+		printf("%-8s: %d files in %8" PRIu64 " blocks, writes %8.2f ms,"
+		       " cold read %7.1f MB/s\n", packed ? "packed" : "unpacked",
+		       files, blocks, ms, read_mbs);
+	}
+	free(data);
+}
+
+/* Copy file "src" of the mounted disk to "dst" through @buf of @len bytes */
+static void copy_through(char *buf, size_t len)
+{
+	int src, dst, ret;
+
+	if (fs_create("dst"))
+		die("Cannot create file");
+	src = fs_open("src");
+	dst = fs_open("dst");
+	if (src < 0 || dst < 0)
+		die("Cannot open file");
+	while ((ret = fs_read(src, buf, len)) > 0)
+		if (fs_write(dst, buf, ret) != ret)
+			die("Cannot write file");
+	if (ret < 0)
+		die("Cannot read file");
+	fs_close(src);
+	fs_close(dst);
+}
+
+void bench_copy(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	double through = 0, copy = 0;
+	size_t size = 256 * MiB;
+	char *data, *buf;
+	int fd;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [file size in MiB]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]) * MiB;
+
+	data = random_buf(size);
+	buf = malloc(MiB);
+	if (!buf)
+		die("Cannot malloc");
+	if (fs_format(b_arg->argv[0], size * 2 / 4096 + 1024, 0,
+		      FS_FORMAT_LARGE))
+		die("Cannot format diskname");
+	if (fs_mount(b_arg->argv[0]) || fs_create("src"))
+		die("Cannot create file");
+	fd = fs_open("src");
+	if (fd < 0 || fs_write(fd, data, size) != (int)size)
+		die("Cannot write file");
+	fs_close(fd);
+
+	for (int i = 0; i < RUNS; i++) {
+		double start = now(), mbs;
+
+		copy_through(buf, MiB);
+		mbs = size / (now() - start) / 1e6;
+		through = mbs > through ? mbs : through;
+		if (fs_delete("dst"))
+			die("Cannot delete file");
+
+		start = now();
+		if (fs_copy("src", "dst"))
+			die("Cannot copy file");
+		mbs = size / (now() - start) / 1e6;
+		copy = mbs > copy ? mbs : copy;
+		if (fs_delete("dst"))
+			die("Cannot delete file");
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	printf("read/write: %7.1f MB/s\n", through);
+	printf("fs_copy:    %7.1f MB/s\n", copy);
+	free(buf);
+	free(data);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} benchmarks[] = {
+	{ "checksum",	bench_checksum },
+	{ "fatscan",	bench_fatscan },
+	{ "async",	bench_async },
+	{ "mount",	bench_mount },
+	{ "dir",	bench_dir },
+	{ "commit",	bench_commit },
+	{ "direct",	bench_direct },
+	{ "alloc",	bench_alloc },
+	{ "append",	bench_append },
+	{ "pack",	bench_pack },
+	{ "copy",	bench_copy },
+};
+
+void usage(char *program)
+{
+	int i;
+	fprintf(stderr, "Usage: %s <benchmark> [<arg>]\n", program);
+	fprintf(stderr, "Possible benchmarks are:\n");
+	for (i = 0; i < ARRAY_SIZE(benchmarks); i++)
+		fprintf(stderr, "\t%s\n", benchmarks[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	char *program;
+	char *name;
+	struct bench_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	name = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+		if (!strcmp(name, benchmarks[i].name)) {
+			benchmarks[i].func(&arg);
+			break;
+		}
+	}
+
+	if (i == ARRAY_SIZE(benchmarks)) {
+		bench_error("invalid benchmark '%s'", name);
+		usage(program);
+	}
+
+	return 0;
+}
@@ -0,0 +1,435 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bulk_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bulk_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Files are moved by chunks of this many bytes */
+#define CHUNK_SIZE (1024 * 1024)
+
+/* Bytes read but not written yet, at most */
+#define IN_FLIGHT (64 * 1024 * 1024)
+
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+
+/* A chunk of file @file, at @offset. The last one of the file has @eof set */
+struct chunk {
+	size_t file;
+	size_t offset;
+	size_t len;
+	bool eof;
+	char *data;
+	struct chunk *next;
+};
+
+/* Chunks on their way from the threads reading them to those writing them */
+struct queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct chunk *head;
+	struct chunk *tail;
+	size_t bytes;
+	size_t max_bytes;
+};
+
+struct file {
+	char name[FS_LONG_FILENAME_LEN];
+	size_t size;
+	int fd;
+};
+
+static char *host_dir;
+static struct file *files;
+static size_t file_count;
+
+/* Next file for the import workers to read */
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_file;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_init(struct queue *queue, size_t max_bytes)
+{
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	queue->head = queue->tail = NULL;
+	queue->bytes = 0;
+	queue->max_bytes = max_bytes;
+}
+
+/* A chunk bigger than the whole queue still goes in once it's empty */
+static void queue_push(struct queue *queue, struct chunk *chunk)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->bytes && queue->bytes + chunk->len > queue->max_bytes)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	chunk->next = NULL;
+	if (queue->tail)
+		queue->tail->next = chunk;
+	else
+		queue->head = chunk;
+	queue->tail = chunk;
+	queue->bytes += chunk->len;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static struct chunk *queue_pop(struct queue *queue)
+{
+	struct chunk *chunk;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->head)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	chunk = queue->head;
+	queue->head = chunk->next;
+	if (!queue->head)
+		queue->tail = NULL;
+	queue->bytes -= chunk->len;
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+	return chunk;
+}
+
+static struct chunk *chunk_new(size_t file, size_t offset, size_t len)
+{
+	struct chunk *chunk = malloc(sizeof(*chunk));
+
+	if (!chunk || !(chunk->data = malloc(len ? len : 1)))
+		die("Cannot malloc");
+	chunk->file = file;
+	chunk->offset = offset;
+	chunk->len = len;
+	chunk->eof = false;
+	return chunk;
+}
+
+static void chunk_free(struct chunk *chunk)
+{
+	free(chunk->data);
+	free(chunk);
+}
+
+static void add_file(const char *name, size_t size)
+{
+	static size_t capacity;
+
+	if (strlen(name) >= FS_LONG_FILENAME_LEN)
+		die("File name too long: %s", name);
+	if (file_count == capacity) {
+		capacity = capacity ? capacity * 2 : 256;
+		files = realloc(files, capacity * sizeof(*files));
+		if (!files)
+			die("Cannot malloc");
+	}
+	strcpy(files[file_count].name, name);
+	files[file_count].size = size;
+	files[file_count].fd = -1;
+	file_count++;
+}
+
+/*
+ * Collect the regular files under directory @path of the host, named by their
+ * path relative to @host_dir (@prefix being that of @path)
+ */
+static void scan_dir(const char *path, const char *prefix)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+
+	if (!dir)
+		die_perror("opendir");
+	while ((entry = readdir(dir))) {
+		char host_path[PATH_MAX], name[PATH_MAX];
+		struct stat st;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		snprintf(host_path, sizeof(host_path), "%s/%s", path,
+			 entry->d_name);
+		snprintf(name, sizeof(name), "%s%s", prefix, entry->d_name);
+		if (stat(host_path, &st))
+			die_perror("stat");
+		if (S_ISDIR(st.st_mode)) {
+			strcat(name, "/");
+			scan_dir(host_path, name);
+		} else if (S_ISREG(st.st_mode)) {
+			add_file(name, st.st_size);
+		}
+	}
+	closedir(dir);
+}
+
+/* Read whole host files, one at a time, into @queue */
+static void *import_worker(void *arg)
+{
+	struct queue *queue = arg;
+
+	for (;;) {
+		char path[PATH_MAX];
+		size_t file, offset = 0;
+		struct stat st;
+		bool eof;
+		int fd;
+
+		pthread_mutex_lock(&next_lock);
+		file = next_file++;
+		pthread_mutex_unlock(&next_lock);
+		if (file >= file_count)
+			return NULL;
+
+		snprintf(path, sizeof(path), "%s/%s", host_dir,
+			 files[file].name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st))
+			die_perror("open");
+		do {
+			size_t want = st.st_size - offset < CHUNK_SIZE ?
+				st.st_size - offset : CHUNK_SIZE;
+			struct chunk *chunk = chunk_new(file, offset, want);
+			ssize_t len = read(fd, chunk->data, want);
+
+			if (len < 0)
+				die_perror("read");
+			/* (a short read means the file shrank) */
+			chunk->len = len;
+			offset += len;
+			eof = (size_t)len < want ||
+				offset >= (size_t)st.st_size;
+			chunk->eof = eof;
+			queue_push(queue, chunk);
+		} while (!eof);
+		close(fd);
+	}
+}
+
+/* Write the chunks the workers read to the mounted disk, as they come */
+static size_t import_files(int threads)
+{
+	pthread_t workers[MAX_THREADS];
+	struct queue queue;
+	size_t done = 0, bytes = 0;
+
+	queue_init(&queue, IN_FLIGHT);
+	for (int i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, import_worker, &queue))
+			die("Cannot create thread");
+
+	while (done < file_count) {
+		struct chunk *chunk = queue_pop(&queue);
+		struct file *file = &files[chunk->file];
+
+		if (chunk->offset == 0) {
+			if (fs_create(file->name))
+				die("Cannot create file %s", file->name);
+			file->fd = fs_open(file->name);
+			if (file->fd < 0)
+				die("Cannot open file %s", file->name);
+		}
+		if (fs_write(file->fd, chunk->data, chunk->len) !=
+		    (int)chunk->len)
+			die("Cannot write file %s", file->name);
+		bytes += chunk->len;
+		if (chunk->eof) {
+			fs_close(file->fd);
+			done++;
+		}
+		chunk_free(chunk);
+	}
+
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	return bytes;
+}
+
+/* Create the directories leading to host file @path */
+static void make_parents(char *path)
+{
+	for (char *slash = strchr(path + 1, '/'); slash;
+	     slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			die_perror("mkdir");
+		*slash = '/';
+	}
+}
+
+/* Write the chunks of @queue to host files, until a chunk of no file */
+static void *export_worker(void *arg)
+{
+	struct queue *queue = arg;
+	struct chunk *chunk;
+	int fd = -1;
+
+	while ((chunk = queue_pop(queue))->file != SIZE_MAX) {
+		if (chunk->offset == 0) {
+			char path[PATH_MAX];
+
+			snprintf(path, sizeof(path), "%s/%s", host_dir,
+				 files[chunk->file].name);
+			make_parents(path);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				die_perror("open");
+		}
+		if (write(fd, chunk->data, chunk->len) != (ssize_t)chunk->len)
+			die_perror("write");
+		if (chunk->eof)
+			close(fd);
+		chunk_free(chunk);
+	}
+	chunk_free(chunk);
+	return NULL;
+}
+
+/*
+ * Read the files of the mounted disk into the queues of the workers, each one
+ * writing every file it gets to the host in turn
+ */
+static size_t export_files(int threads)
+{
+	pthread_t workers[MAX_THREADS];
+	struct queue queues[MAX_THREADS];
+	size_t bytes = 0;
+
+	for (int i = 0; i < threads; i++) {
+		queue_init(&queues[i], IN_FLIGHT / threads);
+		if (pthread_create(&workers[i], NULL, export_worker,
+				   &queues[i]))
+			die("Cannot create thread");
+	}
+
+	for (size_t i = 0; i < file_count; i++) {
+		struct queue *queue = &queues[i % threads];
+		size_t offset = 0;
+		int fd = fs_open(files[i].name);
+		bool eof;
+
+		if (fd < 0)
+			die("Cannot open file %s", files[i].name);
+		do {
+			size_t want = files[i].size - offset < CHUNK_SIZE ?
+				files[i].size - offset : CHUNK_SIZE;
+			struct chunk *chunk = chunk_new(i, offset, want);
+			int len = fs_read(fd, chunk->data, want);
+
+			if (len < 0 || (size_t)len < want)
+				die("Cannot read file %s", files[i].name);
+			chunk->len = len;
+			offset += len;
+			bytes += len;
+			eof = offset >= files[i].size;
+			chunk->eof = eof;
+			queue_push(queue, chunk);
+		} while (!eof);
+		fs_close(fd);
+	}
+
+	/* A chunk of no file tells the workers to stop */
+	for (int i = 0; i < threads; i++)
+		queue_push(&queues[i], chunk_new(SIZE_MAX, 0, 0));
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	return bytes;
+}
+
+static void list_files(void)
+{
+	struct fs_dirent entries[64];
+	size_t pos = 0;
+	int listed;
+
+	while ((listed = fs_list(entries, ARRAY_SIZE(entries), &pos)) > 0)
+		for (int i = 0; i < listed; i++)
+			add_file(entries[i].name, entries[i].size);
+	if (listed < 0)
+		die("Cannot list files");
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s import|export <diskname> <directory> "
+		"[threads]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int threads = DEFAULT_THREADS;
+	bool import;
+	size_t bytes;
+	double start, secs;
+
+	if (argc != 4 && argc != 5)
+		usage(argv[0]);
+	if (!strcmp(argv[1], "import"))
+		import = true;
+	else if (!strcmp(argv[1], "export"))
+		import = false;
+	else
+		usage(argv[0]);
+	host_dir = argv[3];
+	if (argc == 5) {
+		threads = atoi(argv[4]);
+		if (threads < 1 || threads > MAX_THREADS)
+			die("Between 1 and %d threads", MAX_THREADS);
+	}
+
+	start = now();
+	if (fs_mount(argv[2]))
+		die("Cannot mount diskname");
+	if (import) {
+		scan_dir(host_dir, "");
+		bytes = import_files(threads);
+	} else {
+		if (mkdir(host_dir, 0755) && errno != EEXIST)
+			die_perror("mkdir");
+		list_files();
+		bytes = export_files(threads);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	secs = now() - start;
+
+	printf("%s %zu files, %zu bytes in %.3f s: %.1f MB/s, %.0f files/s\n",
+	       import ? "imported" : "exported", file_count, bytes, secs,
+	       bytes / secs / 1e6, file_count / secs);
+	free(files);
+	return 0;
+}
@@ -1,12 +1,15 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -307,6 +310,1200 @@ void thread_fs_info(void *arg)
         die("Cannot unmount diskname");
 }
 
+/*
+ * Self-checking tests: each one goes through part of the library on the disk it
+ * is given (formatted again as it needs), checks what it gets back, then prints
+ * "<test>: ok".
+ */
+#define check(cond)							\
+do {									\
+	if (!(cond))							\
+		die("line %d: check failed: %s", __LINE__, #cond);	\
+} while (0)
+
+/* Fill @buf with bytes that depend on @seed */
+static void fill(char *buf, size_t len, unsigned int seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+
+    for (size_t i = 0; i < len; i++) {
+        x = x * 1103515245u + 12345;
+        buf[i] = x >> 16;
+    }
+}
+
+/* Format @t_arg's disk with @blocks data blocks and mount it */
+static char *test_disk(struct thread_arg *t_arg, size_t blocks, int flags)
+{
+    if (t_arg->argc < 1)
+        die("Usage: <diskname>");
+
+    check(!fs_format(t_arg->argv[0], blocks, 0, flags));
+    check(!fs_mount(t_arg->argv[0]));
+    return t_arg->argv[0];
+}
+
+static void remount(const char *diskname)
+{
+    check(!fs_umount());
+    check(!fs_mount(diskname));
+}
+
+static void write_file(const char *filename, const char *buf, size_t len)
+{
+    int fs_fd;
+
+    check(!fs_create(filename));
+    fs_fd = fs_open(filename);
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, (void *)buf, len) == len);
+    check(!fs_close(fs_fd));
+}
+
+/* Check that file @filename holds the @len bytes of @buf, and nothing more */
+static void check_file(const char *filename, const char *buf, size_t len)
+{
+    char *data = malloc(len + 1);
+    int fs_fd;
+
+    check(data);
+    fs_fd = fs_open(filename);
+    check(fs_fd >= 0);
+    check(fs_stat64(fs_fd) == len);
+    check(fs_read(fs_fd, data, len + 1) == len);
+    check(!len || !memcmp(data, buf, len));
+    check(!fs_close(fs_fd));
+    free(data);
+}
+
+static bool has_file(const char *filename)
+{
+    int fs_fd;
+
+    fs_fd = fs_open(filename);
+    if (fs_fd < 0)
+        return false;
+    check(!fs_close(fs_fd));
+    return true;
+}
+
+/* Flip the bits of the byte at @offset of the disk (twice restores it) */
+static void flip_byte(const char *diskname, uint64_t offset)
+{
+    unsigned char byte;
+    int fd;
+
+    fd = open(diskname, O_RDWR);
+    check(fd >= 0);
+    check(pread(fd, &byte, 1, offset) == 1);
+    byte ^= 0xff;
+    check(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+}
+
+/* First block of the disk that starts with the 4096 bytes of @buf */
+static uint64_t disk_find(const char *diskname, const char *buf)
+{
+    char block[4096];
+    uint64_t index = 0;
+    int fd;
+
+    fd = open(diskname, O_RDONLY);
+    check(fd >= 0);
+    while (pread(fd, block, sizeof(block), index * sizeof(block))
+           == sizeof(block) && memcmp(block, buf, sizeof(block)))
+        index++;
+    check(!memcmp(block, buf, sizeof(block)));
+    close(fd);
+    return index;
+}
+
+/* Field of the superblock at byte @offset (the large format's are 64-bit) */
+static uint64_t superblock_field(const char *diskname, uint64_t offset)
+{
+    uint64_t value;
+    int fd;
+
+    fd = open(diskname, O_RDONLY);
+    check(fd >= 0);
+    check(pread(fd, &value, sizeof(value), offset) == sizeof(value));
+    close(fd);
+    return value;
+}
+
+/* Numerator of line "@field=X/Y" (or value of "@field=X") of fs_info() */
+static uint64_t info_field(const char *field)
+{
+    unsigned long long value = 0;
+    char line[128];
+    FILE *out;
+    int saved;
+    bool found = false;
+
+    out = tmpfile();
+    check(out);
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    check(saved >= 0 && dup2(fileno(out), STDOUT_FILENO) >= 0);
+    check(!fs_info());
+    fflush(stdout);
+    check(dup2(saved, STDOUT_FILENO) >= 0);
+    close(saved);
+
+    rewind(out);
+    while (!found && fgets(line, sizeof(line), out))
+        found = !strncmp(line, field, strlen(field))
+                && line[strlen(field)] == '='
+                && sscanf(line + strlen(field) + 1, "%llu", &value) == 1;
+    fclose(out);
+    check(found);
+    return value;
+}
+
+static void test_passed(const char *test)
+{
+    check(!fs_umount());
+    printf("%s: ok\n", test);
+}
+
+void thread_test_batch(void *arg)
+{
+    struct thread_arg *t_arg = arg;
+    uint64_t free_clusters, free_entries;
+    char data[5000], name[32];
+    char *diskname;
+    int i;
+
+    if (t_arg->argc < 1)
+        die("Usage: <diskname>");
+    diskname = t_arg->argv[0];
+    check(!fs_mount(diskname));
+    fill(data, sizeof(data), 1);
+    write_file("a", data, sizeof(data));
+    write_file("c", NULL, 0);
+
+    /* An operation that conflicts fails the whole batch, which stays open */
+    check(!fs_batch_begin());
+    check(!fs_batch_create("b"));
+    check(!fs_batch_create("a"));
+    check(fs_batch_commit() == -1);
+    check(fs_umount() == -1);
+    check(!fs_batch_abort());
+    check(has_file("a") && has_file("c") && !has_file("b"));
+
+    /* A valid batch is applied as a whole */
+    check(!fs_batch_begin());
+    check(!fs_batch_create("b"));
+    check(!fs_batch_rename("a", "d"));
+    check(!fs_batch_delete("c"));
+    check(!fs_batch_commit());
+    check(has_file("b") && has_file("d"));
+    check(!has_file("a") && !has_file("c"));
+
+    remount(diskname);
+    check(has_file("b") && has_file("d"));
+    check(!has_file("a") && !has_file("c"));
+    check_file("b", NULL, 0);
+    check_file("d", data, sizeof(data));
+    check(!fs_umount());
+
+    /*
+     * A batch that fails gives back the clusters the root directory and
+     * the name heap had to grow by for the files it creates
+     */
+    diskname = test_disk(arg, 256, FS_FORMAT_LARGE);
+    free_clusters = info_field("fat_free_ratio");
+    free_entries = info_field("rdir_free_ratio");
+    check(!fs_batch_begin());
+    for (i = 0; i < 300; i++) {
+        snprintf(name, sizeof(name), "a-rather-long-name-%03d", i);
+        check(!fs_batch_create(name));
+    }
+    check(!fs_batch_delete("missing"));
+    check(fs_batch_commit() == -1);
+    check(info_field("fat_free_ratio") == free_clusters);
+    check(info_field("rdir_free_ratio") == free_entries);
+    check(!fs_batch_abort());
+    check(!fs_batch_begin());
+    check(!fs_batch_create(name));
+    check(!fs_batch_commit());
+    remount(diskname);
+    check(has_file(name));
+    check(info_field("fat_free_ratio") >= free_clusters - 1);
+    test_passed("test_batch");
+}
+
+void thread_test_cluster(void *arg)
+{
+    struct thread_arg *t_arg = arg;
+    static char data[100000];
+    uint64_t free_clusters;
+    char *diskname;
+    int fs_fd;
+
+    if (t_arg->argc < 1)
+        die("Usage: <diskname>");
+    diskname = t_arg->argv[0];
+
+    /* Only the large format has clusters of more than a block */
+    check(fs_format(diskname, 1024, 16384, 0) == -1);
+    check(fs_format(diskname, 1024, 16384 + 4096 / 2, FS_FORMAT_LARGE) == -1);
+    check(!fs_format(diskname, 1024, 16384, FS_FORMAT_LARGE));
+    check(!fs_mount(diskname));
+    check(info_field("cluster_size") == 16384);
+    free_clusters = info_field("fat_free_ratio");
+
+    /* Files take whole clusters: 1, 7 and 2 of them */
+    fill(data, sizeof(data), 14);
+    write_file("small", data, 100);
+    write_file("big", data, sizeof(data));
+    check(!fs_create("edge"));
+    fs_fd = fs_open("edge");
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, data, 10000) == 10000);
+    check(fs_write(fs_fd, data + 10000, 10000) == 10000);
+    check(!fs_close(fs_fd));
+    check(info_field("fat_free_ratio") == free_clusters - 10);
+
+    /* Reads and writes that cross cluster boundaries */
+    fs_fd = fs_open("big");
+    check(fs_fd >= 0);
+    check(!fs_lseek(fs_fd, 16384 - 50));
+    check(fs_write(fs_fd, data + 500, 3 * 16384) == 3 * 16384);
+    memmove(data + 16384 - 50, data + 500, 3 * 16384);
+    check(!fs_close(fs_fd));
+
+    remount(diskname);
+    check_file("big", data, sizeof(data));
+    check_file("small", data, 100);
+    fill(data, sizeof(data), 14);
+    check_file("edge", data, 20000);
+    check(!fs_delete("big"));
+    check(info_field("fat_free_ratio") == free_clusters - 3);
+    test_passed("test_cluster");
+}
+
+void thread_test_compress(void *arg)
+{
+    static char data[200 * 1024], patch[3000], part[2000];
+    struct fs_compress_stats stats;
+    char *diskname;
+    int fs_fd;
+
+    /* Runs of repeated bytes compress, the others don't */
+    diskname = test_disk(arg, 256, 0);
+    fill(data, sizeof(data), 2);
+    for (size_t i = 0; i < sizeof(data); i += 512)
+        memset(data + i, 'a' + i / 512 % 26, 384);
+    check(!fs_create_compressed("z"));
+    fs_fd = fs_open("z");
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, data, sizeof(data)) == sizeof(data));
+    check(!fs_close(fs_fd));
+    check(!fs_compress_stats(&stats));
+    check(stats.bytes_out < stats.bytes_in);
+
+    remount(diskname);
+    check_file("z", data, sizeof(data));
+
+    /* Overwrite the middle of a chunk, and across two chunks */
+    fs_fd = fs_open("z");
+    check(fs_fd >= 0);
+    fill(patch, sizeof(patch), 3);
+    check(!fs_lseek(fs_fd, 70000));
+    check(fs_write(fs_fd, patch, sizeof(patch)) == sizeof(patch));
+    memcpy(data + 70000, patch, sizeof(patch));
+    check(!fs_lseek(fs_fd, 131072 - 1000));
+    check(fs_write(fs_fd, patch, sizeof(patch)) == sizeof(patch));
+    memcpy(data + 131072 - 1000, patch, sizeof(patch));
+
+    /* Reads across chunk boundaries see the writes */
+    check(!fs_lseek(fs_fd, 65536 - 1000));
+    check(fs_read(fs_fd, part, sizeof(part)) == sizeof(part));
+    check(!memcmp(part, data + 65536 - 1000, sizeof(part)));
+    check(!fs_lseek(fs_fd, 131072 - 500));
+    check(fs_read(fs_fd, part, sizeof(part)) == sizeof(part));
+    check(!memcmp(part, data + 131072 - 500, sizeof(part)));
+    check(!fs_close(fs_fd));
+    check_file("z", data, sizeof(data));
+
+    remount(diskname);
+    check_file("z", data, sizeof(data));
+    check(!fs_umount());
+
+    /*
+     * On a full disk, closing a compressed file fails and keeps it open,
+     * with what was written, until there is room
+     */
+    diskname = test_disk(arg, 64, 0);
+    check(!fs_create("filler"));
+    fs_fd = fs_open("filler");
+    check(fs_fd >= 0);
+    while (fs_write(fs_fd, data, sizeof(data)) == sizeof(data))
+        ;
+    check(!fs_close(fs_fd));
+    check(!fs_create_compressed("y"));
+    fs_fd = fs_open("y");
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, patch, sizeof(patch)) == sizeof(patch));
+    check(fs_close(fs_fd) == -1);
+    check(!fs_delete("filler"));
+    check(!fs_close(fs_fd));
+    remount(diskname);
+    check_file("y", patch, sizeof(patch));
+    test_passed("test_compress");
+}
+
+void thread_test_checksum(void *arg)
+{
+    static char data[3 * 4096], read_back[sizeof(data)];
+    uint64_t root_block, data_block;
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 64, FS_FORMAT_CHECKSUM);
+    fill(data, sizeof(data), 4);
+    write_file("f", data, sizeof(data));
+    check(!fs_umount());
+
+    /* Blocks of the root directory and of the file */
+    root_block = superblock_field(diskname, 16);
+    data_block = disk_find(diskname, data);
+
+    /* A corrupted data block fails the read, not the mount */
+    flip_byte(diskname, data_block * 4096 + 100);
+    check(!fs_mount(diskname));
+    fs_fd = fs_open("f");
+    check(fs_fd >= 0);
+    check(fs_read(fs_fd, read_back, sizeof(read_back)) == -1);
+    check(!fs_close(fs_fd));
+    check(!fs_umount());
+    flip_byte(diskname, data_block * 4096 + 100);
+
+    /* Corrupted metadata fails the mount */
+    flip_byte(diskname, 4096 + 8);
+    check(fs_mount(diskname) == -1);
+    flip_byte(diskname, 4096 + 8);
+    flip_byte(diskname, root_block * 4096 + 8);
+    check(fs_mount(diskname) == -1);
+    flip_byte(diskname, root_block * 4096 + 8);
+
+    check(!fs_mount(diskname));
+    check_file("f", data, sizeof(data));
+    test_passed("test_checksum");
+}
+
+/*
+ * Asynchronous reads of ASYNC_PART bytes each, with a callback that checks the
+ * next read of the fd hasn't started yet (its part of the buffer is untouched)
+ */
+#define ASYNC_PARTS 8
+#define ASYNC_PART 5000
+
+static char async_data[ASYNC_PARTS * ASYNC_PART];
+static char async_back[ASYNC_PARTS * ASYNC_PART];
+static int async_order[ASYNC_PARTS];
+static int async_done;
+static int async_gate[2];
+
+static void async_read_done(struct fs_request *req, int result, void *arg)
+{
+    int part = (int)(intptr_t)arg;
+    size_t at = part * ASYNC_PART;
+
+    check(req && result == ASYNC_PART);
+    check(!memcmp(async_back + at, async_data + at, ASYNC_PART));
+    check(part == ASYNC_PARTS - 1
+          || memcmp(async_back + at + ASYNC_PART, async_data + at + ASYNC_PART,
+                    ASYNC_PART));
+    async_order[async_done++] = part;
+}
+
+/* Holds the requests of its fd back until async_gate is written to */
+static void async_blocked(struct fs_request *req, int result, void *arg)
+{
+    char byte;
+
+    check(read(async_gate[0], &byte, 1) == 1);
+}
+
+void thread_test_async(void *arg)
+{
+    struct fs_request *reqs[ASYNC_PARTS], *req;
+    char *diskname;
+    int fs_fd, i;
+
+    diskname = test_disk(arg, 64, 0);
+    fill(async_data, sizeof(async_data), 15);
+    check(!fs_create("a"));
+    fs_fd = fs_open("a");
+    check(fs_fd >= 0);
+    check(!fs_write_async(-1, async_data, 1, NULL, NULL));
+    check(fs_poll(NULL) == -1 && fs_wait(NULL) == -1);
+
+    /* The writes of an fd are performed in order, each one moving it on */
+    for (i = 0; i < ASYNC_PARTS; i++) {
+        reqs[i] = fs_write_async(fs_fd, async_data + i * ASYNC_PART,
+                                 ASYNC_PART, NULL, NULL);
+        check(reqs[i]);
+    }
+    while (!fs_poll(reqs[ASYNC_PARTS - 1]))
+        usleep(100);
+    check(fs_poll(reqs[ASYNC_PARTS - 1]) == 1);
+    for (i = 0; i < ASYNC_PARTS; i++)
+        check(fs_wait(reqs[i]) == ASYNC_PART);
+    check(fs_stat64(fs_fd) == sizeof(async_data));
+
+    /* So are the reads, each callback returning before the next read */
+    check(!fs_lseek(fs_fd, 0));
+    for (i = 0; i < ASYNC_PARTS; i++)
+        check(fs_read_async(fs_fd, async_back + i * ASYNC_PART, ASYNC_PART,
+                            async_read_done, (void *)(intptr_t)i));
+    req = fs_read_async(fs_fd, async_back, 1, NULL, NULL);
+    check(req && fs_wait(req) == 0);
+    check(async_done == ASYNC_PARTS);
+    for (i = 0; i < ASYNC_PARTS; i++)
+        check(async_order[i] == i);
+
+    /* The fd can't be closed, nor the disk unmounted, until they are done */
+    check(!pipe(async_gate));
+    check(!fs_lseek(fs_fd, 0));
+    check(fs_read_async(fs_fd, async_back, 10, async_blocked, NULL));
+    req = fs_read_async(fs_fd, async_back, 10, NULL, NULL);
+    check(req);
+    check(fs_close(fs_fd) == -1);
+    check(fs_umount() == -1);
+    check(!fs_poll(req));
+    check(write(async_gate[1], "", 1) == 1);
+    check(fs_wait(req) == 10);
+    check(!fs_close(fs_fd));
+    close(async_gate[0]);
+    close(async_gate[1]);
+
+    remount(diskname);
+    check_file("a", async_data, sizeof(async_data));
+    test_passed("test_async");
+}
+
+void thread_test_pread(void *arg)
+{
+    char data[10000], patch[500], buf[3000];
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 64, 0);
+    fill(data, sizeof(data), 5);
+    write_file("p", data, sizeof(data));
+    fs_fd = fs_open("p");
+    check(fs_fd >= 0);
+    check(!fs_lseek(fs_fd, 100));
+
+    /* Positional accesses leave the file offset where it is */
+    fill(patch, sizeof(patch), 6);
+    check(fs_pwrite(fs_fd, patch, sizeof(patch), 4000) == sizeof(patch));
+    memcpy(data + 4000, patch, sizeof(patch));
+    check(fs_read(fs_fd, buf, 50) == 50);
+    check(!memcmp(buf, data + 100, 50));
+    check(fs_pread(fs_fd, buf, sizeof(buf), 3000) == sizeof(buf));
+    check(!memcmp(buf, data + 3000, sizeof(buf)));
+    check(fs_read(fs_fd, buf, 50) == 50);
+    check(!memcmp(buf, data + 150, 50));
+
+    /* Nothing is read past the end, and nothing is written past it */
+    check(fs_pread(fs_fd, buf, sizeof(buf), 9000) == 1000);
+    check(!memcmp(buf, data + 9000, 1000));
+    check(fs_pread(fs_fd, buf, sizeof(buf), sizeof(data)) == 0);
+    check(fs_pwrite(fs_fd, patch, sizeof(patch), sizeof(data) + 1) == -1);
+    check(!fs_close(fs_fd));
+
+    remount(diskname);
+    check_file("p", data, sizeof(data));
+    test_passed("test_pread");
+}
+
+/* Describe @buf as consecutive segments of the @count lengths of @lens */
+static void make_iov(struct iovec *iov, char *buf, const size_t *lens,
+                     int count)
+{
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = buf;
+        iov[i].iov_len = lens[i];
+        buf += lens[i];
+    }
+}
+
+void thread_test_iov(void *arg)
+{
+    /* Segments end inside, at and right after block boundaries */
+    static const size_t write_lens[] = { 100, 3996, 0, 1, 6000, 2191 };
+    static const size_t patch_lens[] = { 1500, 2500 };
+    static const size_t read_lens[] = { 4095, 2, 8191, 4000 };
+    static char data[12288], patch[4000], read_back[sizeof(data) + 4000];
+    struct iovec iov[6];
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 64, 0);
+    fill(data, sizeof(data), 7);
+    check(!fs_create("v"));
+    fs_fd = fs_open("v");
+    check(fs_fd >= 0);
+    make_iov(iov, data, write_lens, ARRAY_SIZE(write_lens));
+    check(fs_writev(fs_fd, iov, ARRAY_SIZE(write_lens)) == sizeof(data));
+
+    /* Overwrite across a block boundary */
+    fill(patch, sizeof(patch), 8);
+    memcpy(data + 3000, patch, sizeof(patch));
+    check(!fs_lseek(fs_fd, 3000));
+    make_iov(iov, patch, patch_lens, ARRAY_SIZE(patch_lens));
+    check(fs_writev(fs_fd, iov, ARRAY_SIZE(patch_lens)) == sizeof(patch));
+
+    /* Read back with other segments, the last one past the end */
+    check(!fs_lseek(fs_fd, 0));
+    make_iov(iov, read_back, read_lens, ARRAY_SIZE(read_lens));
+    check(fs_readv(fs_fd, iov, ARRAY_SIZE(read_lens)) == sizeof(data));
+    check(!memcmp(read_back, data, sizeof(data)));
+    check(fs_readv(fs_fd, iov, -1) == -1);
+    check(!fs_close(fs_fd));
+
+    remount(diskname);
+    check_file("v", data, sizeof(data));
+    test_passed("test_iov");
+}
+
+void thread_test_map(void *arg)
+{
+    /* The file is 3 blocks long, then grows by a fourth */
+    static char data[4 * 4096], more[4096];
+    const char *view;
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 64, 0);
+    fill(data, sizeof(data), 9);
+    write_file("m", data, 3 * 4096);
+
+    /* Contiguous blocks are mapped from the disk, and see later writes */
+    fs_fd = fs_open("m");
+    check(fs_fd >= 0);
+    check(!fs_map(fs_fd, 0, 0));
+    check(!fs_map(fs_fd, 1000, 3 * 4096));
+    view = fs_map(fs_fd, 1000, 8000);
+    check(view && !memcmp(view, data + 1000, 8000));
+    check(fs_close(fs_fd) == -1);
+    fill(more, 100, 10);
+    check(fs_pwrite(fs_fd, more, 100, 5000) == 100);
+    memcpy(data + 5000, more, 100);
+    check(!memcmp(view, data + 1000, 8000));
+    check(!fs_unmap(view));
+    check(fs_unmap(view) == -1);
+    check(!fs_close(fs_fd));
+
+    /* A file in two pieces (another file is in the way) gets a copy */
+    write_file("n", more, sizeof(more));
+    fs_fd = fs_open("m");
+    check(fs_fd >= 0);
+    check(!fs_lseek(fs_fd, 3 * 4096));
+    check(fs_write(fs_fd, data + 3 * 4096, 4096) == 4096);
+    view = fs_map(fs_fd, 8000, 8000);
+    check(view && !memcmp(view, data + 8000, 8000));
+    fill(more, 100, 11);
+    check(fs_pwrite(fs_fd, more, 100, 9000) == 100);
+    check(!memcmp(view, data + 8000, 8000));
+    memcpy(data + 9000, more, 100);
+    check(fs_close(fs_fd) == -1);
+    check(!fs_unmap(view));
+    check(!fs_close(fs_fd));
+
+    remount(diskname);
+    check_file("m", data, sizeof(data));
+    test_passed("test_map");
+}
+
+/* Write @blocks blocks of @data, from block @first of it, to new file @name */
+static void write_blocks(const char *name, const char *data, size_t first,
+                         size_t blocks)
+{
+    write_file(name, data + first * 4096, blocks * 4096);
+}
+
+void thread_test_lazy_fat(void *arg)
+{
+    struct fs_mount_opts opts = { .lazy_fat = true, .fat_cache_blocks = 1 };
+    static char data[1200 * 4096];
+    static const int kept[] = { 0, 2, 4, 5 };
+    uint64_t free_clusters;
+    char name[8];
+    char *diskname;
+    int i;
+
+    /* 1024 clusters per FAT block, a single one of which is kept in memory */
+    diskname = test_disk(arg, 4096, FS_FORMAT_LARGE);
+    free_clusters = info_field("fat_free_ratio");
+    check(!fs_umount());
+    check(!fs_mount_with(diskname, &opts));
+    fill(data, sizeof(data), 16);
+
+    /*
+     * Files spread over every FAT block, some of which are deleted and
+     * reused: dirty FAT blocks keep getting evicted and written back
+     */
+    for (i = 0; i < 6; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        write_blocks(name, data, i * 100, 600);
+    }
+    check(!fs_delete("f1"));
+    check(!fs_delete("f3"));
+    write_blocks("f6", data, 7, 1100);
+    write_blocks("f7", data, 9, 30);
+    check(info_field("fat_free_ratio") == free_clusters - 4 * 600 - 1130);
+
+    remount(diskname);
+    check(info_field("fat_free_ratio") == free_clusters - 4 * 600 - 1130);
+    for (i = 0; i < ARRAY_SIZE(kept); i++) {
+        snprintf(name, sizeof(name), "f%d", kept[i]);
+        check_file(name, data + kept[i] * 100 * 4096, 600 * 4096);
+    }
+    check_file("f6", data + 7 * 4096, 1100 * 4096);
+    check_file("f7", data + 9 * 4096, 30 * 4096);
+    test_passed("test_lazy_fat");
+}
+
+/* Copy of disk @from as it is right now, as if the host had crashed */
+static void copy_disk(const char *from, const char *to)
+{
+    char buf[65536];
+    ssize_t len;
+    int in, out;
+
+    in = open(from, O_RDONLY);
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    check(in >= 0 && out >= 0);
+    while ((len = read(in, buf, sizeof(buf))) > 0)
+        check(write(out, buf, len) == len);
+    check(len == 0);
+    close(in);
+    close(out);
+}
+
+void thread_test_summary(void *arg)
+{
+    struct fs_mount_opts opts = { .lazy_fat = true, .fat_cache_blocks = 1 };
+    static char data[1100 * 4096];
+    uint64_t free_clusters, copy_free, written = 0;
+    char copy[PATH_MAX];
+    char *diskname;
+    int fs_fd, len;
+
+    diskname = test_disk(arg, 4096, FS_FORMAT_LARGE);
+    snprintf(copy, sizeof(copy), "%s.copy", diskname);
+    free_clusters = info_field("fat_free_ratio");
+    check(!fs_umount());
+
+    /*
+     * The first FAT block gets written back when the file grows past it,
+     * the summary in the superblock stays the one of the mount
+     */
+    check(!fs_mount_with(diskname, &opts));
+    fill(data, sizeof(data), 17);
+    write_file("a", data, sizeof(data));
+    copy_disk(diskname, copy);
+    check(!fs_umount());
+
+    /* Its counts are not trusted: they are those of what the FAT has */
+    check(!fs_mount(copy));
+    copy_free = info_field("fat_free_ratio");
+    check(copy_free < free_clusters);
+    check(!fs_create("b"));
+    fs_fd = fs_open("b");
+    check(fs_fd >= 0);
+    while ((len = fs_write(fs_fd, data, sizeof(data))) > 0)
+        written += len;
+    check(!fs_close(fs_fd));
+    check(written == copy_free * 4096);
+    check(info_field("fat_free_ratio") == 0);
+    check(!fs_umount());
+    unlink(copy);
+
+    /* A clean unmount leaves counts that are right */
+    check(!fs_mount(diskname));
+    check(info_field("fat_free_ratio") == free_clusters - 1100);
+    check_file("a", data, sizeof(data));
+    test_passed("test_summary");
+}
+
+void thread_test_fd_limit(void *arg)
+{
+    static int fds[FS_OPEN_MAX_COUNT];
+    int i;
+
+    test_disk(arg, 64, 0);
+    write_file("f", "x", 1);
+
+    /* Exactly FS_OPEN_MAX_COUNT descriptors can be open at once */
+    for (i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+        fds[i] = fs_open("f");
+        check(fds[i] >= 0);
+    }
+    check(fs_open("f") == -1);
+
+    /* A closed descriptor is rejected, and its slot is reused */
+    check(!fs_close(fds[1000]));
+    check(fs_stat(fds[1000]) == -1);
+    check(fs_close(fds[1000]) == -1);
+    check(fs_open("f") == fds[1000]);
+    check(fs_open("f") == -1);
+    check(fs_stat(fds[FS_OPEN_MAX_COUNT - 1]) == 1);
+
+    for (i = 0; i < FS_OPEN_MAX_COUNT; i++)
+        check(!fs_close(fds[i]));
+    check(fs_close(fds[0]) == -1);
+    test_passed("test_fd_limit");
+}
+
+void thread_test_root_grow(void *arg)
+{
+    struct fs_dirent entries[100];
+    bool seen[3000] = { false };
+    size_t count = 0, pos = 0;
+    int listed, number;
+    char name[16];
+    char *diskname;
+    int i;
+
+    /* Several thousand files: the root directory grows by many clusters */
+    diskname = test_disk(arg, 1024, FS_FORMAT_LARGE);
+    for (i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "file%d", i);
+        check(!fs_create(name));
+    }
+    check(fs_create("file0") == -1);
+    for (i = 0; i < 3000; i += 2) {
+        snprintf(name, sizeof(name), "file%d", i);
+        check(!fs_delete(name));
+    }
+
+    remount(diskname);
+    check(info_field("rdir_free_ratio") >= 1500);
+    for (i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "file%d", i);
+        check(has_file(name) == i % 2);
+    }
+
+    /* And fs_list() goes through all of them, in pages */
+    while ((listed = fs_list(entries, ARRAY_SIZE(entries), &pos)) > 0) {
+        for (i = 0; i < listed; i++) {
+            check(sscanf(entries[i].name, "file%d", &number) == 1);
+            check(number >= 0 && number < 3000 && number % 2);
+            check(!seen[number] && entries[i].size == 0);
+            seen[number] = true;
+        }
+        count += listed;
+    }
+    check(listed == 0 && count == 1500);
+    test_passed("test_root_grow");
+}
+
+/* Name @i of @len characters, which only the first few set apart */
+static char *long_name(char *name, size_t len, int i)
+{
+    char prefix[8];
+
+    memset(name, 'a' + i % 26, len);
+    name[len] = '\0';
+    memcpy(name, prefix, snprintf(prefix, sizeof(prefix), "%04d", i));
+    return name;
+}
+
+void thread_test_long_names(void *arg)
+{
+    char name[FS_LONG_FILENAME_LEN + 1], other[FS_LONG_FILENAME_LEN + 1];
+    char *diskname;
+    int i;
+
+    diskname = test_disk(arg, 256, FS_FORMAT_LARGE);
+
+    /* The longest name fits, one more character doesn't */
+    long_name(name, FS_LONG_FILENAME_LEN - 1, 0);
+    write_file(name, NULL, 0);
+    check_file(name, NULL, 0);
+    long_name(name, FS_LONG_FILENAME_LEN, 1);
+    check(fs_create(name) == -1);
+
+    /*
+     * Churn: most of the names become garbage in the heap, which gets
+     * compacted when it is written back
+     */
+    for (i = 1; i < 60; i++)
+        write_file(long_name(name, 200, i), (char *)&i, sizeof(i));
+    for (i = 1; i < 50; i++)
+        check(!fs_delete(long_name(name, 200, i)));
+    check(!fs_batch_begin());
+    for (i = 50; i < 55; i++)
+        check(!fs_batch_rename(long_name(name, 200, i),
+                               long_name(other, 180, i + 100)));
+    check(!fs_batch_commit());
+    remount(diskname);
+    for (i = 60; i < 80; i++)
+        write_file(long_name(name, 220, i), (char *)&i, sizeof(i));
+
+    remount(diskname);
+    check(has_file(long_name(name, FS_LONG_FILENAME_LEN - 1, 0)));
+    for (i = 1; i < 50; i++)
+        check(fs_open(long_name(name, 200, i)) == -1);
+    for (i = 50; i < 55; i++) {
+        check(fs_open(long_name(name, 200, i)) == -1);
+        check_file(long_name(name, 180, i + 100), (char *)&i, sizeof(i));
+    }
+    for (i = 55; i < 60; i++)
+        check_file(long_name(name, 200, i), (char *)&i, sizeof(i));
+    for (i = 60; i < 80; i++)
+        check_file(long_name(name, 220, i), (char *)&i, sizeof(i));
+    test_passed("test_long_names");
+}
+
+void thread_test_journal(void *arg)
+{
+    char data[10000];
+    char *diskname;
+    int status, fs_fd;
+    pid_t pid;
+
+    diskname = test_disk(arg, 256, FS_FORMAT_JOURNAL);
+    check(!fs_umount());
+    fill(data, sizeof(data), 12);
+
+    /* The child dies right after fs_sync(), without unmounting */
+    pid = fork();
+    check(pid >= 0);
+    if (!pid) {
+        check(!fs_mount(diskname));
+        write_file("gone", data, 100);
+        write_file("kept", data, sizeof(data));
+        check(!fs_delete("gone"));
+        check(!fs_sync());
+        _exit(0);
+    }
+    check(waitpid(pid, &status, 0) == pid);
+    check(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    /* What was synced is replayed from the journal */
+    check(!fs_mount(diskname));
+    check(has_file("kept") && !has_file("gone"));
+    check_file("kept", data, sizeof(data));
+    remount(diskname);
+    check_file("kept", data, sizeof(data));
+    check(!fs_umount());
+
+    /*
+     * What an open compressed file holds in memory is stored by fs_sync(),
+     * but the other commits only record the size of what is stored already
+     */
+    pid = fork();
+    check(pid >= 0);
+    if (!pid) {
+        check(!fs_mount(diskname));
+        check(!fs_create_compressed("z"));
+        fs_fd = fs_open("z");
+        check(fs_fd >= 0);
+        check(fs_write(fs_fd, data, 6000) == 6000);
+        check(!fs_sync());
+        check(fs_write(fs_fd, data + 6000, 4000) == 4000);
+        check(!fs_batch_begin());
+        check(!fs_batch_create("b"));
+        check(!fs_batch_commit());
+        _exit(0);
+    }
+    check(waitpid(pid, &status, 0) == pid);
+    check(WIFEXITED(status) && !WEXITSTATUS(status));
+    check(!fs_mount(diskname));
+    check(has_file("kept") && has_file("b"));
+    check_file("z", data, 6000);
+    test_passed("test_journal");
+}
+
+void thread_test_direct_io(void *arg)
+{
+    struct fs_mount_opts opts = { .direct_io = true };
+    static char data[300000], back[sizeof(data)];
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 256, FS_FORMAT_LARGE);
+    check(!fs_umount());
+    check(!fs_mount_with(diskname, &opts));
+
+    /* Transfers of any size and offset, not only whole aligned blocks */
+    fill(data, sizeof(data), 18);
+    write_file("d", data, sizeof(data));
+    fs_fd = fs_open("d");
+    check(fs_fd >= 0);
+    check(!fs_lseek(fs_fd, 4095));
+    check(fs_write(fs_fd, data + 7, 8193) == 8193);
+    memmove(data + 4095, data + 7, 8193);
+    check(fs_pread(fs_fd, back, 10, 4090) == 10);
+    check(!memcmp(back, data + 4090, 10));
+    check(!fs_close(fs_fd));
+    write_file("small", data, 3);
+    check_file("d", data, sizeof(data));
+
+    /* And what went around the page cache is there for any mount */
+    check(!fs_umount());
+    check(!fs_mount_with(diskname, &opts));
+    check_file("d", data, sizeof(data));
+    remount(diskname);
+    check_file("d", data, sizeof(data));
+    check_file("small", data, 3);
+    test_passed("test_direct_io");
+}
+
+void thread_test_alloc(void *arg)
+{
+    struct fs_mount_opts opts = { 0 };
+    static char data[40 * 4096];
+    char name[8];
+    char *diskname;
+    int fs_fds[4];
+    int i, policy;
+
+    fill(data, sizeof(data), 19);
+    for (policy = FS_ALLOC_FIRST_FIT; policy <= FS_ALLOC_BEST_FIT; policy++) {
+        opts.alloc_policy = policy;
+        diskname = test_disk(arg, 256, FS_FORMAT_LARGE);
+        check(!fs_umount());
+        check(!fs_mount_with(diskname, &opts));
+
+        /* Files that grow in turns, then holes of different sizes */
+        for (i = 0; i < 4; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            check(!fs_create(name));
+            fs_fds[i] = fs_open(name);
+            check(fs_fds[i] >= 0);
+        }
+        for (size_t at = 0; at < sizeof(data); at += 5000)
+            for (i = 0; i < 4; i++)
+                check(fs_write(fs_fds[i], data + at, at + 5000 < sizeof(data)
+                               ? 5000 : sizeof(data) - at) > 0);
+        for (i = 0; i < 4; i++)
+            check(!fs_close(fs_fds[i]));
+        check(!fs_delete("f1"));
+        write_file("small", data, 3 * 4096);
+        write_file("large", data + 4096, 30 * 4096);
+
+        remount(diskname);
+        for (i = 0; i < 4; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            if (i != 1)
+                check_file(name, data, sizeof(data));
+        }
+        check_file("small", data, 3 * 4096);
+        check_file("large", data + 4096, 30 * 4096);
+        check(!fs_umount());
+    }
+
+    opts.alloc_policy = FS_ALLOC_BEST_FIT + 1;
+    check(fs_mount_with(diskname, &opts) == -1);
+    check(!fs_mount(diskname));
+    test_passed("test_alloc");
+}
+
+void thread_test_append(void *arg)
+{
+    static char data[20000];
+    char back[100];
+    char *diskname;
+    int fs_fd, other;
+
+    diskname = test_disk(arg, 64, 0);
+    fill(data, sizeof(data), 20);
+    write_file("a", data, 5000);
+    write_file("e", NULL, 0);
+
+    /* After a remount, the tail of the file is found again */
+    remount(diskname);
+    fs_fd = fs_open("a");
+    check(fs_fd >= 0);
+    other = fs_open("a");
+    check(other >= 0);
+    check(fs_append(fs_fd, data + 5000, 3192) == 3192);
+    check(fs_append(other, data + 8192, 1) == 1);
+    check(fs_append(fs_fd, data + 8193, 6000) == 6000);
+
+    /* Each descriptor is left at the end as it was when it appended */
+    check(fs_stat64(other) == 14193);
+    check(fs_read(fs_fd, back, sizeof(back)) == 0);
+    check(fs_read(other, back, sizeof(back)) == sizeof(back));
+    check(!memcmp(back, data + 8193, sizeof(back)));
+    check(!fs_close(fs_fd));
+    check(!fs_close(other));
+    fs_fd = fs_open("e");
+    check(fs_fd >= 0);
+    check(fs_append(fs_fd, data, 4096) == 4096);
+    check(!fs_close(fs_fd));
+
+    remount(diskname);
+    check_file("a", data, 14193);
+    check_file("e", data, 4096);
+    fs_fd = fs_open("a");
+    check(fs_fd >= 0);
+    check(fs_append(fs_fd, data + 14193, 5807) == 5807);
+    check(!fs_close(fs_fd));
+    remount(diskname);
+    check_file("a", data, sizeof(data));
+    test_passed("test_append");
+}
+
+#define PACK_FILES 60
+
+/* Expected content of the files of the packing test */
+static char pack_data[PACK_FILES][8192];
+static size_t pack_size[PACK_FILES];
+
+static char *pack_name(char *name, int i)
+{
+    sprintf(name, "s%d", i);
+    return name;
+}
+
+static void pack_check(void)
+{
+    char name[16];
+
+    for (int i = 0; i < PACK_FILES; i++) {
+        if (pack_size[i] == SIZE_MAX)
+            check(!has_file(pack_name(name, i)));
+        else
+            check_file(pack_name(name, i), pack_data[i], pack_size[i]);
+    }
+}
+
+/* Append @len bytes to file @i of the packing test */
+static void pack_append(int i, size_t len)
+{
+    char name[16];
+    int fs_fd;
+
+    fill(pack_data[i] + pack_size[i], len, i + 100);
+    fs_fd = fs_open(pack_name(name, i));
+    check(fs_fd >= 0);
+    check(fs_append(fs_fd, pack_data[i] + pack_size[i], len) == len);
+    check(!fs_close(fs_fd));
+    pack_size[i] += len;
+}
+
+static void test_pack_format(struct thread_arg *t_arg, int flags)
+{
+    struct fs_mount_opts opts = { .pack_small_files = true };
+    struct fs_dirent entries[PACK_FILES];
+    size_t pos = 0, shared = 0;
+    char name[16];
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(t_arg, 256, flags);
+    check(!fs_umount());
+    check(!fs_mount_with(diskname, &opts));
+
+    /* Small files, the first one empty, share blocks */
+    for (int i = 0; i < PACK_FILES; i++) {
+        pack_size[i] = i * 37 % 2048;
+        fill(pack_data[i], pack_size[i], i);
+        write_file(pack_name(name, i), pack_data[i], pack_size[i]);
+    }
+    check(fs_list(entries, PACK_FILES, &pos) == PACK_FILES);
+    for (int i = 2; i < PACK_FILES; i++)
+        if (entries[i].first_block == entries[i - 1].first_block)
+            shared++;
+    check(shared > PACK_FILES / 2);
+
+    /* Deleting some frees their fragments for the others */
+    for (int i = 0; i < PACK_FILES; i += 3) {
+        check(!fs_delete(pack_name(name, i)));
+        pack_size[i] = SIZE_MAX;
+    }
+
+    /* Files grow within their pack, and out of it past the limit */
+    pack_append(1, 100);
+    pack_append(2, 3000);
+    fs_fd = fs_open(pack_name(name, 4));
+    check(fs_fd >= 0);
+    fill(pack_data[4] + 10, 50, 200);
+    check(fs_pwrite(fs_fd, pack_data[4] + 10, 50, 10) == 50);
+    check(!fs_close(fs_fd));
+    pack_check();
+
+    /* Without the option, the packed files stay readable and writable */
+    remount(diskname);
+    pack_check();
+    pack_append(5, 100);
+    pack_append(7, 4000);
+    remount(diskname);
+    pack_check();
+}
+
+void thread_test_pack(void *arg)
+{
+    /* The fragment of a file is kept in the root entry of either format */
+    test_pack_format(arg, 0);
+    check(!fs_umount());
+    test_pack_format(arg, FS_FORMAT_LARGE);
+    test_passed("test_pack");
+}
+
+void thread_test_copy(void *arg)
+{
+    struct fs_mount_opts opts = { .pack_small_files = true };
+    static char plain[20000], small[500], packed[500];
+    static char compressed[100 * 1024];
+    struct fs_compress_stats before, after;
+    char *diskname;
+    int fs_fd;
+
+    diskname = test_disk(arg, 512, 0);
+    check(!fs_umount());
+    check(!fs_mount_with(diskname, &opts));
+    fill(plain, sizeof(plain), 13);
+    fill(packed, sizeof(packed), 14);
+    memset(compressed, 'c', sizeof(compressed));
+    fill(compressed, 1000, 15);
+    write_file("plain", plain, sizeof(plain));
+    write_file("packed", packed, sizeof(packed));
+    check(!fs_create_compressed("compressed"));
+    fs_fd = fs_open("compressed");
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, compressed, sizeof(compressed))
+          == sizeof(compressed));
+    check(!fs_close(fs_fd));
+
+    check(!fs_copy("plain", "plain2"));
+    check(!fs_copy("packed", "packed2"));
+    check(!fs_compress_stats(&before));
+    check(!fs_copy("compressed", "compressed2"));
+    check(!fs_compress_stats(&after));
+    check(after.bytes_in > before.bytes_in);
+    check(fs_copy("plain", "packed2") == -1);
+    check(fs_copy("missing", "missing2") == -1);
+    check(!has_file("missing2"));
+
+    /* The copies don't change with their sources */
+    fill(small, sizeof(small), 16);
+    fs_fd = fs_open("plain");
+    check(fs_fd >= 0);
+    check(fs_write(fs_fd, small, sizeof(small)) == sizeof(small));
+    check(!fs_close(fs_fd));
+    check(!fs_delete("packed"));
+
+    remount(diskname);
+    check_file("plain2", plain, sizeof(plain));
+    memcpy(plain, small, sizeof(small));
+    check_file("plain", plain, sizeof(plain));
+    check_file("packed2", packed, sizeof(packed));
+    check_file("compressed2", compressed, sizeof(compressed));
+    check(!fs_delete("compressed"));
+    check_file("compressed2", compressed, sizeof(compressed));
+    test_passed("test_copy");
+}
+
 size_t get_argv(char *argv)
 {
     long int ret = strtol(argv, NULL, 0);
@@ -325,6 +1522,25 @@ static struct {
         { "rm",		thread_fs_rm },
         { "cat",	thread_fs_cat },
         { "stat",	thread_fs_stat },
+        { "test_batch",	thread_test_batch },
+        { "test_cluster",	thread_test_cluster },
+        { "test_compress",	thread_test_compress },
+        { "test_checksum",	thread_test_checksum },
+        { "test_async",	thread_test_async },
+        { "test_pread",	thread_test_pread },
+        { "test_iov",	thread_test_iov },
+        { "test_map",	thread_test_map },
+        { "test_lazy_fat",	thread_test_lazy_fat },
+        { "test_summary",	thread_test_summary },
+        { "test_fd_limit",	thread_test_fd_limit },
+        { "test_root_grow",	thread_test_root_grow },
+        { "test_long_names",	thread_test_long_names },
+        { "test_journal",	thread_test_journal },
+        { "test_direct_io",	thread_test_direct_io },
+        { "test_alloc",	thread_test_alloc },
+        { "test_append",	thread_test_append },
+        { "test_pack",	thread_test_pack },
+        { "test_copy",	thread_test_copy },
 };
 
 void usage(char *program)
@@ -1,12 +1,16 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -19,13 +23,13 @@
 #define die(...)				\
 do {							\
 	test_fs_error(__VA_ARGS__);	\
-	exit(1);					\
+	fail();						\
 } while (0)
 
 #define die_perror(msg)			\
 do {							\
 	perror(msg);				\
-	exit(1);					\
+	fail();						\
 } while (0)
 
 struct thread_arg {
@@ -33,6 +37,30 @@ struct thread_arg {
 	char **argv;
 };
 
+/*
+ * In batch mode, the disk is mounted once for the whole script: commands don't
+ * mount or unmount it themselves, and a failing command only ends itself.
+ */
+static bool batch_mode;
+static jmp_buf batch_env;
+
+static void __attribute__((noreturn)) fail(void)
+{
+	if (batch_mode)
+		longjmp(batch_env, 1);
+	exit(1);
+}
+
+static int mount_disk(const char *diskname)
+{
+	return batch_mode ? 0 : fs_mount(diskname);
+}
+
+static int umount_disk(void)
+{
+	return batch_mode ? 0 : fs_umount();
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -46,33 +74,35 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		umount_disk();
 		die("Cannot open file");
 	}
 
 	stat = fs_stat(fs_fd);
 	if (stat < 0) {
-		fs_umount();
+		fs_close(fs_fd);
+		umount_disk();
 		die("Cannot stat file");
 	}
 	if (!stat) {
-		fs_umount();
+		fs_close(fs_fd);
+		umount_disk();
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
 	}
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		umount_disk();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (umount_disk())
 		die("cannot unmount diskname");
 
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
@@ -91,21 +121,24 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		umount_disk();
 		die("Cannot open file");
 	}
 
 	stat = fs_stat(fs_fd);
 	if (stat < 0) {
-		fs_umount();
+		fs_close(fs_fd);
+		umount_disk();
 		die("Cannot stat file");
 	}
 	if (!stat) {
+		fs_close(fs_fd);
+		umount_disk();
 		/* Nothing to read, file is empty */
 		printf("Empty file\n");
 		return;
@@ -113,19 +146,23 @@ void thread_fs_cat(void *arg)
 	buf = malloc(stat);
 	if (!buf) {
 		perror("malloc");
-		fs_umount();
+		fs_close(fs_fd);
+		umount_disk();
 		die("Cannot malloc");
 	}
 
 	read = fs_read(fs_fd, buf, stat);
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		free(buf);
+		umount_disk();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (umount_disk()) {
+		free(buf);
 		die("cannot unmount diskname");
+	}
 
 	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
 	printf("Content of the file:\n");
@@ -145,24 +182,32 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
-		fs_umount();
+		umount_disk();
 		die("Cannot delete file");
 	}
 
-	if (fs_umount())
+	if (umount_disk())
 		die("Cannot unmount diskname");
 
 	printf("Removed file '%s'\n", filename);
 }
 
-void thread_fs_add(void *arg)
+/* Release the host file mapped by add_file() */
+static void release_host_file(char *buf, const struct stat *st, int fd)
 {
-	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	if (buf)
+		munmap(buf, st->st_size);
+	close(fd);
+}
+
+static void add_file(struct thread_arg *t_arg, int compressed)
+{
+	struct fs_compress_stats before, after;
+	char *diskname, *filename, *buf = NULL;
 	int fd, fs_fd;
 	struct stat st;
 	int written;
@@ -177,49 +222,89 @@ void thread_fs_add(void *arg)
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
 		die_perror("open");
-	if (fstat(fd, &st))
+	if (fstat(fd, &st)) {
+		close(fd);
 		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
 		die("Not a regular file: %s\n", filename);
+	}
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	/* Map file into buffer (there is nothing to map if it is empty) */
+	if (st.st_size) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			close(fd);
+			die_perror("mmap");
+		}
+	}
 
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
+	 * In batch mode, a failure only ends this command, so the host file is
+	 * released before each die().
 	 */
-	if (fs_mount(diskname))
+	if (mount_disk(diskname)) {
+		release_host_file(buf, &st, fd);
 		die("Cannot mount diskname");
+	}
 
-	if (fs_create(filename)) {
-		fs_umount();
+	/* The statistics count from the mount, which a batch shares */
+	fs_compress_stats(&before);
+
+	if ((compressed ? fs_create_compressed : fs_create)(filename)) {
+		release_host_file(buf, &st, fd);
+		umount_disk();
 		die("Cannot create file");
 	}
 
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
-		fs_umount();
+		release_host_file(buf, &st, fd);
+		umount_disk();
 		die("Cannot open file");
 	}
 
 	written = fs_write(fs_fd, buf, st.st_size);
 
 	if (fs_close(fs_fd)) {
-		fs_umount();
+		release_host_file(buf, &st, fd);
+		umount_disk();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
+	if (compressed) {
+		uint64_t in, out, ns;
+
+		fs_compress_stats(&after);
+		in = after.bytes_in - before.bytes_in;
+		out = after.bytes_out - before.bytes_out;
+		ns = after.compress_ns - before.compress_ns;
+		printf("Compressed %" PRIu64 " bytes into %" PRIu64
+		       " (ratio %.2f, %.1f MB/s)\n", in, out,
+		       out ? (double)in / out : 0.0,
+		       ns ? in * 1000.0 / ns : 0.0);
+	}
+
+	release_host_file(buf, &st, fd);
+
+	if (umount_disk())
 		die("Cannot unmount diskname");
 
 	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
 		   st.st_size);
+}
 
-	munmap(buf, st.st_size);
-	close(fd);
+void thread_fs_add(void *arg)
+{
+	add_file(arg, 0);
+}
+
+void thread_fs_addz(void *arg)
+{
+	add_file(arg, 1);
 }
 
 void thread_fs_ls(void *arg)
@@ -232,12 +317,47 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
 
-	if (fs_umount())
+	if (umount_disk())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_list(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_dirent entries[64];
+	size_t pos = 0;
+	int count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (mount_disk(diskname))
+		die("Cannot mount diskname");
+
+	/* One file per line: name, size and first block, tab-separated */
+	while ((count = fs_list(entries, ARRAY_SIZE(entries), &pos)) > 0) {
+		for (int i = 0; i < count; i++) {
+			if (entries[i].first_block == FS_NO_BLOCK)
+				printf("%s\t%" PRIu64 "\t-\n", entries[i].name,
+				       entries[i].size);
+			else
+				printf("%s\t%" PRIu64 "\t%" PRIu32 "\n",
+				       entries[i].name, entries[i].size,
+				       entries[i].first_block);
+		}
+	}
+	if (count < 0)
+		die("Cannot list files");
+
+	if (umount_disk())
 		die("Cannot unmount diskname");
 }
 
@@ -251,12 +371,12 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (mount_disk(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
 
-	if (fs_umount())
+	if (umount_disk())
 		die("Cannot unmount diskname");
 }
 
@@ -268,22 +388,157 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_mkfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data_blk_count, cluster_size = 0;
+	int flags = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> "
+		    "[large|checksum|journal [cluster size]]");
+
+	diskname = t_arg->argv[0];
+	data_blk_count = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "large"))
+		flags |= FS_FORMAT_LARGE;
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "checksum"))
+		flags |= FS_FORMAT_CHECKSUM;
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "journal"))
+		flags |= FS_FORMAT_JOURNAL;
+	if (t_arg->argc > 3)
+		cluster_size = get_argv(t_arg->argv[3]);
+
+	if (fs_format(diskname, data_blk_count, cluster_size, flags))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+		   data_blk_count);
+}
+
+void thread_fs_batch(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
+	{ "list",	thread_fs_list },
 	{ "add",	thread_fs_add },
+	{ "addz",	thread_fs_addz },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "mkfs",	thread_fs_mkfs },
+	{ "batch",	thread_fs_batch },
 };
 
+/* Most arguments of a command in a batch script */
+#define BATCH_MAX_ARGS 8
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Run a batch script against a single mount. Each line is a command without
+ * the diskname (e.g. "add file"), empty lines and lines starting with '#' are
+ * skipped. The time of each command goes to stderr.
+ */
+void thread_fs_batch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *line = NULL;
+	char *argv[BATCH_MAX_ARGS];
+	size_t line_cap = 0;
+	double start, mount_ms, umount_ms;
+	volatile unsigned int lineno = 0, count = 0, failed = 0;
+	FILE *script = stdin;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [script]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		script = fopen(t_arg->argv[1], "r");
+		if (!script)
+			die_perror("fopen");
+	}
+
+	start = now_ms();
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	mount_ms = now_ms() - start;
+
+	batch_mode = true;
+	while (getline(&line, &line_cap, script) >= 0) {
+		struct thread_arg cmd_arg = { .argc = 1, .argv = argv };
+		char *cmd, *tok;
+		double cmd_start;
+		size_t i;
+
+		lineno++;
+		cmd = strtok(line, " \t\r\n");
+		if (!cmd || cmd[0] == '#')
+			continue;
+		argv[0] = diskname;
+		while (cmd_arg.argc < BATCH_MAX_ARGS &&
+		       (tok = strtok(NULL, " \t\r\n")))
+			argv[cmd_arg.argc++] = tok;
+
+		for (i = 0; i < ARRAY_SIZE(commands); i++)
+			if (!strcmp(cmd, commands[i].name))
+				break;
+
+		count++;
+		cmd_start = now_ms();
+		if (i == ARRAY_SIZE(commands) ||
+		    commands[i].func == thread_fs_mkfs ||
+		    commands[i].func == thread_fs_batch) {
+			test_fs_error("line %u: invalid command '%s'", lineno,
+				      cmd);
+			failed++;
+			continue;
+		}
+		if (setjmp(batch_env)) {
+			failed++;
+			fprintf(stderr, "batch: line %u: %s failed\n", lineno,
+				cmd);
+			continue;
+		}
+		commands[i].func(&cmd_arg);
+		/* Keep the output of the commands and the timings in order */
+		fflush(stdout);
+		fprintf(stderr, "batch: line %u: %s %.3f ms\n", lineno, cmd,
+			now_ms() - cmd_start);
+	}
+	batch_mode = false;
+	free(line);
+	if (script != stdin)
+		fclose(script);
+
+	start = now_ms();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	umount_ms = now_ms() - start;
+
+	fprintf(stderr, "batch: %u commands, %u failed, mount %.3f ms, "
+		"umount %.3f ms\n", count, failed, mount_ms, umount_ms);
+	if (failed)
+		exit(1);
+}
+
 void usage(char *program)
 {
 	int i;
 	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "       %s batch <diskname> [script]\n", program);
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
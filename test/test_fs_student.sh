@@ -199,6 +199,30 @@ run_fs_info_full() {
 	add_answer "${sub}"
 }
 
+# Info on empty disk in the large format
+run_fs_info_large() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+    run_tool ./test_fs.x mkfs test.fs 100000 large
+    run_test ./test_fs.x info test.fs
+    rm -f test.fs
+
+    local line_array=()
+    line_array+=("$(select_line "${STDOUT}" "2")")
+    line_array+=("$(select_line "${STDOUT}" "3")")
+    line_array+=("$(select_line "${STDOUT}" "7")")
+    local corr_array=()
+    corr_array+=("total_blk_count=100100")
+    corr_array+=("fat_blk_count=98")
+    corr_array+=("fat_free_ratio=99999/100000")
+
+    sub=0
+    compare_output_lines line_array[@] corr_array[@] "0.33"
+
+    inc_total
+    add_answer "${sub}"
+}
+
 #
 # Phase 2
 #
@@ -251,6 +275,57 @@ run_fs_create_multiple() {
 	add_answer "${sub}"
 }
 
+# make fs with fs_make.x, add two and remove one in a test_fs.x batch, ls with
+# fs_ref.x
+run_fs_batch_create() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool dd if=/dev/zero of=test-file-1 bs=10 count=1
+	run_tool dd if=/dev/zero of=test-file-2 bs=10 count=1
+	printf "add test-file-1\nadd test-file-2\nrm test-file-1\n" > test-batch
+	run_tool timeout 2 ./test_fs.x batch test.fs test-batch
+
+	run_test ./fs_ref.x ls test.fs
+
+	rm -f test.fs test-file-1 test-file-2 test-batch
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("file: test-file-2, size: 10, data_blk: 2")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+	inc_total
+	add_answer "${sub}"
+}
+
+#
+# Phase 3
+#
+
+# Self-checking test of the library in my_test_fs.x, which prints "<test>: ok".
+# Most tests format the disk again their own way.
+run_fs_unit() {
+    log "\n--- Running ${FUNCNAME} ${1} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./my_test_fs.x "${1}" test.fs
+	rm -f test.fs
+	[[ ! -z ${STDERR} ]] && info "${STDERR}"
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("${1}: ok")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+	inc_total
+	add_answer "${sub}"
+}
+
 #
 # Run tests
 #
@@ -258,9 +333,31 @@ run_tests() {
 	# Phase 1
 	run_fs_info
 	run_fs_info_full
+	run_fs_info_large
 	# Phase 2
 	run_fs_simple_create
 	run_fs_create_multiple
+	run_fs_batch_create
+	# Phase 3
+	run_fs_unit test_batch
+	run_fs_unit test_cluster
+	run_fs_unit test_compress
+	run_fs_unit test_checksum
+	run_fs_unit test_async
+	run_fs_unit test_pread
+	run_fs_unit test_iov
+	run_fs_unit test_map
+	run_fs_unit test_lazy_fat
+	run_fs_unit test_summary
+	run_fs_unit test_fd_limit
+	run_fs_unit test_root_grow
+	run_fs_unit test_long_names
+	run_fs_unit test_journal
+	run_fs_unit test_direct_io
+	run_fs_unit test_alloc
+	run_fs_unit test_append
+	run_fs_unit test_pack
+	run_fs_unit test_copy
 }
 
 make_fs() {
@@ -268,7 +365,7 @@ make_fs() {
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "my_test_fs.x" "fs_make.x" "fs_ref.x")
 
     # Make sure executables were properly created
     local x